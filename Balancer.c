@@ -0,0 +1,477 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/opencl.h>
+#endif
+
+#include "dispenser.h"
+#include "model.h"
+#include "pool.h"
+#include "progcache.h"
+#include "devices.h"
+#include "native.h"
+#include "trace.h"
+#include "rng.h"
+#include "elem.h"
+#include "taskgraph.h"
+#include "job.h"
+
+#define CHKERR(err, str) \
+	if (err != CL_SUCCESS) \
+	{ \
+		fprintf(stdout, "CL Error %d: %s\n", err, str); \
+		exit(1); \
+	}
+
+#define TIMER_START clock_gettime(CLOCK_REALTIME, &timer1)
+#define TIMER_END clock_gettime(CLOCK_REALTIME, &timer2)
+#define MILLISECONDS (timer2.tv_sec - timer1.tv_sec) * 1000.0f + (timer2.tv_nsec - timer1.tv_nsec) / 1000000.0f
+struct timespec timer1;
+struct timespec timer2;
+
+//Milliseconds an idle daemon waits between looks at quit
+#define POLL_MS 200
+
+//Most clients connected at once; more wait in the listen backlog
+#define MAX_CLIENTS 16
+
+//OpenCL Constructs
+const char *AddSourceFile = "VectorAdd.cl";
+const char *BoundSourceFile = "CPUBound.cl";
+struct worker workers[MAX_WORKERS];
+int num_workers = 0;
+int cpu_split = 0;
+enum cpu_backend_t cpu_backend = BACKEND_OPENCL;
+
+enum scheme_t { CPU_ONLY, GPU_ONLY, CPU_GPU_STATIC, CPU_GPU_DYNAMIC };
+enum scheme_t scheme = CPU_GPU_DYNAMIC;
+unsigned long seed = DEFAULT_SEED;
+
+// Everything one element type needs, built by the first job of that type and
+// kept for the rest: the kernels, their measured costs and the buffers
+struct warm_type
+{
+	int ready;
+	cl_kernel add[MAX_WORKERS];
+	cl_kernel bound[MAX_WORKERS];
+	struct task_graph graph;
+	int kernel_add, kernel_bound;
+	int array_a, array_b, array_c;
+};
+struct warm_type warm[ELEM_DOUBLE + 1];
+
+volatile sig_atomic_t quit = 0;
+
+char* readKernelSource(const char* filename)
+{
+	FILE* kernelFile = NULL;
+	kernelFile = fopen(filename, "r");
+	if(!kernelFile)
+		fprintf(stdout,"Error reading file.\n"), exit(0);
+	fseek(kernelFile, 0, SEEK_END);
+	size_t kernelLength = (size_t) ftell(kernelFile);
+	char* kernelSource = (char *) calloc(1, sizeof(char)*kernelLength+1);
+	rewind(kernelFile);
+	if(fread((void *) kernelSource, kernelLength, 1, kernelFile) == 0) {
+		fprintf(stderr, "Could not read source\n");
+		exit(1);
+	}
+	kernelSource[kernelLength] = 0;
+	fclose(kernelFile);
+
+	return kernelSource;
+}
+
+cl_kernel create_kernel(const char* filename, const char* kernel, const cl_context context, const cl_device_id device, enum elem_type_t type)
+{
+	cl_kernel kernel_compute;
+	char* kernelSource = readKernelSource(filename);
+
+	// Build the program executable, reusing a cached binary when possible
+	int err;
+	cl_program program = build_cached_program(context, device, kernelSource, elem_info(type)->options, &err);
+	free(kernelSource);
+	if (err == CL_BUILD_PROGRAM_FAILURE)
+	{
+		char *log;
+		size_t logLen;
+		err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &logLen);
+		log = (char *) malloc(sizeof(char)*logLen);
+		err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logLen, (void *) log, NULL);
+		fprintf(stdout, "CL Error %d: Failed to build program! Log:\n%s", err, log);
+		free(log);
+		exit(1);
+	}
+	CHKERR(err, "Failed to build program!");
+
+	// Create the compute kernel in the program we wish to run
+	kernel_compute = clCreateKernel(program, kernel, &err);
+	CHKERR(err, "Failed to create a compute kernel!");
+
+	return kernel_compute;
+}
+
+// Contexts and queues are made once, when the daemon starts; kernels are
+// built per element type by warm_up
+void setupGPU()
+{
+	int err = 0;
+	cl_device_type type = CL_DEVICE_TYPE_ALL;
+	if(scheme == CPU_ONLY)
+		type = CL_DEVICE_TYPE_CPU;
+	else if(scheme == GPU_ONLY)
+		type = CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_ACCELERATOR;
+
+	//The native backend takes the CPU's place, or joins it with "both"
+	int use_native = scheme != GPU_ONLY && cpu_backend != BACKEND_OPENCL;
+	if(use_native && cpu_backend == BACKEND_NATIVE)
+		type = scheme == CPU_ONLY ? 0 : CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_ACCELERATOR;
+
+	// One worker per device on every platform
+	num_workers = type ? enumerate_workers(workers, MAX_WORKERS, type, cpu_split) : 0;
+	if(use_native)
+	{
+		num_workers = add_native_worker(workers, num_workers, MAX_WORKERS);
+		native_init(0);
+	}
+	if(num_workers == 0)
+	{
+		fprintf(stderr, "Error: no OpenCL device found for this scheme\n");
+		exit(1);
+	}
+
+	int i;
+	for(i = 0; i < num_workers; i++)
+	{
+		struct worker* w = &workers[i];
+		trace_track(TRACE_HOST, i, w->name);
+		if(w->native)
+		{
+			fprintf(stderr, "worker %s: native %s, %d threads\n", w->name, native_isa_name(), native_threads());
+			continue;
+		}
+		trace_track(TRACE_DEVICE, i, w->name);
+		w->context = clCreateContext(NULL, 1, &w->device, NULL, NULL, &err);
+		CHKERR(err, "Failed to create a compute context!");
+		w->commands = clCreateCommandQueue(w->context, w->device, CL_QUEUE_PROFILING_ENABLE, &err);
+		CHKERR(err, "Failed to create a command queue!");
+
+		char name[256];
+		clGetDeviceInfo(w->device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+		fprintf(stderr, "worker %s: %s%s\n", w->name, name, w->subdevice ? " (sub-device)" : "");
+	}
+}
+
+// Build both kernels for type on every worker and measure them on a chunk
+// of random data, so later jobs of the type only have to run
+void warm_up(enum elem_type_t type)
+{
+	struct warm_type* t = &warm[type];
+	size_t elem_size = elem_info(type)->size;
+	size_t chunk = FIXED_CHUNK_SIZE;
+	int d;
+	for(d = 0; d < num_workers; d++)
+	{
+		if(workers[d].native)
+			continue;
+		t->add[d] = create_kernel(AddSourceFile, "compute", workers[d].context, workers[d].device, type);
+		t->bound[d] = create_kernel(BoundSourceFile, "compute", workers[d].context, workers[d].device, type);
+	}
+
+	taskgraph_init(&t->graph, workers, num_workers, type);
+	t->kernel_add = taskgraph_kernel(&t->graph, "add", t->add, native_vector_add);
+	t->kernel_bound = taskgraph_kernel(&t->graph, "bound", t->bound, native_cpu_bound);
+
+	unsigned char* a = host_alloc(elem_size * chunk);
+	unsigned char* b = host_alloc(elem_size * chunk);
+	unsigned char* c = host_alloc(elem_size * chunk);
+	fill_random_bytes(a, chunk, elem_size, elem_info(type)->is_float, seed, 0);
+	fill_random_bytes(b, chunk, elem_size, elem_info(type)->is_float, seed, 1);
+	t->array_a = taskgraph_array(&t->graph, a, chunk);
+	t->array_b = taskgraph_array(&t->graph, b, chunk);
+	t->array_c = taskgraph_array(&t->graph, c, chunk);
+	taskgraph_calibrate(&t->graph, t->kernel_add, t->array_a, t->array_b, t->array_c, chunk / 8, chunk);
+	taskgraph_calibrate(&t->graph, t->kernel_bound, t->array_a, t->array_b, t->array_c, chunk / 8, chunk);
+	free(a);
+	free(b);
+	free(c);
+
+	fprintf(stderr, "%s costs per %lu elements:", elem_info(type)->name, chunk);
+	for(d = 0; d < num_workers; d++)
+		fprintf(stderr, " %s add %f ms bound %f ms", workers[d].name,
+			model_time(&t->graph.kernels[t->kernel_add].models[d], chunk), model_time(&t->graph.kernels[t->kernel_bound].models[d], chunk));
+	fprintf(stderr, "\n");
+	t->ready = 1;
+}
+
+// Run one job on its arrays in shared memory and fill in the reply
+void run_job(const struct job_request* job, struct job_reply* reply)
+{
+	memset(reply, 0, sizeof(*reply));
+	if(job->elem_type < 0 || job->elem_type > ELEM_DOUBLE || job->length == 0
+		|| (job->kind != JOB_VECTOR_ADD && job->kind != JOB_VECTOR_ADD_PLUS))
+	{
+		reply->status = 1;
+		snprintf(reply->message, sizeof(reply->message), "bad job");
+		return;
+	}
+	enum elem_type_t type = job->elem_type;
+	//All three arrays have to fit in a size_t, and then in the object
+	if(job->length > SIZE_MAX / 3 / elem_info(type)->size)
+	{
+		reply->status = 1;
+		snprintf(reply->message, sizeof(reply->message), "%lu elements is too long", job->length);
+		return;
+	}
+	size_t bytes = elem_info(type)->size * job->length;
+	size_t chunk = job->chunk > 0 ? job->chunk : FIXED_CHUNK_SIZE;
+	struct warm_type* t = &warm[type];
+	//The client need not end the name
+	char name[JOB_NAME_SIZE];
+	snprintf(name, sizeof(name), "%.*s", JOB_NAME_SIZE - 1, job->shm);
+
+	TIMER_START;
+	if(!t->ready)
+		warm_up(type);
+	unsigned char* data = job_map(name, 3 * bytes, 0);
+	if(data == NULL)
+	{
+		reply->status = 1;
+		snprintf(reply->message, sizeof(reply->message), "could not map %s with %lu bytes", name, (unsigned long) (3 * bytes));
+		return;
+	}
+	int err = taskgraph_bind(&t->graph, t->array_a, data, job->length);
+	if(err == CL_SUCCESS)
+		err = taskgraph_bind(&t->graph, t->array_b, data + bytes, job->length);
+	if(err == CL_SUCCESS)
+		err = taskgraph_bind(&t->graph, t->array_c, data + 2 * bytes, job->length);
+	if(err != CL_SUCCESS)
+	{
+		job_unmap(data, 3 * bytes);
+		reply->status = 1;
+		snprintf(reply->message, sizeof(reply->message), "CL error %d creating buffers for %lu elements", err, job->length);
+		return;
+	}
+	TIMER_END;
+	reply->setup_time = MILLISECONDS;
+
+	TIMER_START;
+	int kernel = job->kind == JOB_VECTOR_ADD ? t->kernel_add : t->kernel_bound;
+	size_t offset;
+	for(offset = 0; offset < job->length; offset += chunk)
+		taskgraph_task(&t->graph, kernel, t->array_a, t->array_b, t->array_c, offset, job->length - offset < chunk ? job->length - offset : chunk);
+	taskgraph_schedule(&t->graph);
+	taskgraph_run(&t->graph);
+	TIMER_END;
+	reply->run_time = MILLISECONDS;
+	trace_span(TRACE_MAIN, job_kind_name(job->kind), &timer1, &timer2);
+
+	size_t gpu_elements = 0;
+	int i;
+	for(i = 0; i < t->graph.num_tasks; i++)
+		if(workers[t->graph.tasks[i].device].isGPU)
+			gpu_elements += t->graph.tasks[i].size;
+	reply->gpu_share = (float) gpu_elements / job->length;
+	reply->uploaded = t->graph.uploaded;
+	reply->downloaded = t->graph.downloaded;
+	taskgraph_clear(&t->graph);
+	job_unmap(data, 3 * bytes);
+	trace_collect();
+
+	fprintf(stderr, "job %s %s %lu: %f ms setup, %f ms run, %lu elements copied in and %lu out\n", job_kind_name(job->kind),
+		elem_info(type)->name, job->length, reply->setup_time, reply->run_time, reply->uploaded, reply->downloaded);
+}
+
+void stop(int signal)
+{
+	quit = 1;
+}
+
+// A connected client and as much of its next request as has arrived
+struct client
+{
+	int fd;
+	struct job_request job;
+	size_t received;
+};
+
+// Read what the client has sent, which poll said is there, and run its job
+// once the whole request is in. Returns 0 when the client has gone away.
+int client_input(struct client* c)
+{
+	ssize_t n = read(c->fd, (char*) &c->job + c->received, sizeof(c->job) - c->received);
+	if(n < 0 && errno == EINTR)
+		return 1;
+	if(n <= 0)
+		return 0;
+	c->received += n;
+	if(c->received < sizeof(c->job))
+		return 1;
+	c->received = 0;
+	struct job_reply reply;
+	run_job(&c->job, &reply);
+	return job_send(c->fd, &reply, sizeof(reply));
+}
+
+// Answer jobs from every connected client until a signal asks to stop. Each
+// connection sends any number of requests and gets a reply to each. Jobs run
+// one at a time, but requests are read as they arrive, so an idle client or
+// one that sends half a request holds up no one. The signal may go to any of
+// the runtime's threads, so a blocked call would not see it: poll gives up
+// every POLL_MS to look at quit.
+void serve(const char* path)
+{
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(address.sun_path))
+	{
+		fprintf(stderr, "Error: socket path %s is too long\n", path);
+		exit(1);
+	}
+	strcpy(address.sun_path, path);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path);
+	if(listener < 0 || bind(listener, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(listener, 16) != 0)
+	{
+		fprintf(stderr, "Error: could not listen on %s\n", path);
+		exit(1);
+	}
+	fprintf(stderr, "listening on %s\n", path);
+
+	struct client clients[MAX_CLIENTS];
+	struct pollfd polls[MAX_CLIENTS + 1];	//The listener, then the clients
+	int num_clients = 0;
+	int i, n;
+	while(!quit)
+	{
+		polls[0].fd = listener;
+		polls[0].events = num_clients < MAX_CLIENTS ? POLLIN : 0;
+		for(i = 0; i < num_clients; i++)
+		{
+			polls[i + 1].fd = clients[i].fd;
+			polls[i + 1].events = POLLIN;
+		}
+		if(poll(polls, num_clients + 1, POLL_MS) <= 0)
+			continue;
+
+		for(i = 0, n = 0; i < num_clients; i++)
+		{
+			if(polls[i + 1].revents && !client_input(&clients[i]))
+				close(clients[i].fd);
+			else
+				clients[n++] = clients[i];
+		}
+		num_clients = n;
+
+		if(polls[0].revents & POLLIN)
+		{
+			int fd = accept(listener, NULL, NULL);
+			if(fd < 0)
+			{
+				if(errno != EINTR)
+					fprintf(stderr, "Warning: accept failed\n");
+				continue;
+			}
+			clients[num_clients].fd = fd;
+			clients[num_clients].received = 0;
+			num_clients++;
+		}
+	}
+	for(i = 0; i < num_clients; i++)
+		close(clients[i].fd);
+	close(listener);
+	unlink(path);
+}
+
+
+int main(int argc, char** argv)
+{
+	if(argc > 1)
+	{
+		switch(atoi(argv[1]))
+		{
+			case 0: scheme = CPU_ONLY;
+				break;
+			case 1: scheme = GPU_ONLY;
+				break;
+			case 3: scheme = CPU_GPU_DYNAMIC;
+				break;
+			default:
+				fprintf(stderr, "Error: Balancer runs schemes 0, 1 and 3\n");
+				exit(1);
+		}
+	}
+	//CPU_SUBDEVICES=N splits each CPU into N sub-devices, 1 keeps it whole,
+	//and unset splits it by NUMA node
+	const char* split = getenv("CPU_SUBDEVICES");
+	if(split)
+		cpu_split = atoi(split);
+	//CPU_BACKEND=native runs CPU tasks on the host SIMD kernels instead of
+	//the OpenCL CPU device, and both keeps the two side by side
+	const char* backend = getenv("CPU_BACKEND");
+	if(backend && !parse_cpu_backend(backend, &cpu_backend))
+	{
+		fprintf(stderr, "Error: unknown CPU backend %s\n", backend);
+		exit(1);
+	}
+	//ELEM_TYPE=t1,t2,... warms those element types up before taking jobs;
+	//others are warmed up by their first job
+	const char* types = getenv("ELEM_TYPE");
+	//TRACE_FILE=path writes a Chrome trace of every job, written on exit
+	trace_open(getenv("TRACE_FILE"));
+	trace_track(TRACE_HOST, TRACE_MAIN, "main");
+
+	//Stop between jobs on SIGINT or SIGTERM, and outlive clients that go away
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stop;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	setupGPU();
+	if(types)
+	{
+		char* copy = strdup(types);
+		char* name;
+		for(name = strtok(copy, ","); name; name = strtok(NULL, ","))
+		{
+			enum elem_type_t type;
+			if(!parse_elem_type(name, &type))
+			{
+				fprintf(stderr, "Error: unknown element type %s\n", name);
+				exit(1);
+			}
+			if(!warm[type].ready)
+				warm_up(type);
+		}
+		free(copy);
+	}
+	fprintf(stderr, "kernel cache: %d hits, %d misses, %f ms build time\n",
+		program_cache_stats.hits, program_cache_stats.misses, program_cache_stats.build_time);
+
+	serve(job_socket_path());
+
+	trace_close();
+	int t;
+	for(t = 0; t <= ELEM_DOUBLE; t++)
+		if(warm[t].ready)
+			taskgraph_destroy(&warm[t].graph);
+	if(scheme != GPU_ONLY && cpu_backend != BACKEND_OPENCL)
+		native_shutdown();
+	return 0;
+}
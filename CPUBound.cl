@@ -1,14 +1,20 @@
-__kernel void compute(	__global unsigned char* a,
-			__global unsigned char* b,
-			__global unsigned char* c,
+// ELEM is the element type and CALC the type the sums are done in, both
+// passed as -D options by the host
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+__kernel void compute(	__global ELEM* a,
+			__global ELEM* b,
+			__global ELEM* c,
 			const unsigned long length)
 {
-	unsigned int tid = get_global_id(0);
+	size_t tid = get_global_id(0);
 	if(tid < length)
 	{
-		unsigned int x = a[tid];
-		unsigned int y = b[tid];
-		unsigned int val = 0;
+		CALC x = a[tid];
+		CALC y = b[tid];
+		CALC val = 0;
 		val += x;
 		val += y;
 		val += x;
@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/opencl.h>
+#endif
+
+#include "dispenser.h"
+#include "model.h"
+#include "pool.h"
+#include "progcache.h"
+#include "devices.h"
+#include "native.h"
+#include "trace.h"
+#include "rng.h"
+#include "verify.h"
+#include "elem.h"
+#include "taskgraph.h"
+
+#define CHKERR(err, str) \
+	if (err != CL_SUCCESS) \
+	{ \
+		fprintf(stdout, "CL Error %d: %s\n", err, str); \
+		exit(1); \
+	}
+
+#define TIMER_START clock_gettime(CLOCK_REALTIME, &timer1)
+#define TIMER_END clock_gettime(CLOCK_REALTIME, &timer2)
+#define MILLISECONDS (timer2.tv_sec - timer1.tv_sec) * 1000.0f + (timer2.tv_nsec - timer1.tv_nsec) / 1000000.0f
+struct timespec timer1;
+struct timespec timer2;
+
+#define TOTAL_TIMER_START clock_gettime(CLOCK_REALTIME, &total_timer1)
+#define TOTAL_TIMER_END clock_gettime(CLOCK_REALTIME, &total_timer2)
+#define TOTAL_MILLISECONDS (total_timer2.tv_sec - total_timer1.tv_sec) * 1000.0f + (total_timer2.tv_nsec - total_timer1.tv_nsec) / 1000000.0f
+struct timespec total_timer1;
+struct timespec total_timer2;
+
+//OpenCL Constructs
+const char *AddSourceFile = "VectorAdd.cl";
+const char *BoundSourceFile = "CPUBound.cl";
+struct worker workers[MAX_WORKERS];
+cl_kernel bound_kernels[MAX_WORKERS];	//The add kernels are each worker's own kernel
+int num_workers = 0;
+int cpu_split = 0;
+enum cpu_backend_t cpu_backend = BACKEND_OPENCL;
+
+//Number of iterations to warmup caches
+const int warmup = 0;
+
+enum scheme_t { CPU_ONLY, GPU_ONLY, CPU_GPU_STATIC, CPU_GPU_DYNAMIC };
+enum scheme_t scheme = CPU_ONLY;
+int staged = 0;			//Wait for every chunk of a stage before starting the next
+size_t fixed_chunk = 0;		//0 keeps FIXED_CHUNK_SIZE
+size_t task_chunk;		//Elements per task
+size_t work_group_size = 0;	//0 uses the largest the device allows
+unsigned long seed = DEFAULT_SEED;
+int fresh_data = 0;		//Regenerate the inputs before every iteration
+unsigned long generation = 0;	//Sets of inputs generated so far
+enum verify_mode_t verify_mode = VERIFY_SAMPLE;
+
+//Data: c = a + b, then d = CPUBound(c, b)
+unsigned long length;
+enum elem_type_t elem_type = ELEM_UINT8;
+size_t elem_size;
+unsigned char* h_a;
+unsigned char* h_b;
+unsigned char* h_c;
+unsigned char* h_d;
+unsigned char* h_check;
+unsigned long check_sum;		//verify_checksum of h_check
+
+//Task graph of the two stages
+struct task_graph graph;
+int kernel_add, kernel_bound;
+int array_a, array_b, array_c, array_d;
+
+//Function Prototypes
+void fillArray(unsigned char* nums, const unsigned long length, unsigned long stream);
+unsigned long verify_answer(unsigned char* toCheck, unsigned char* answer, const unsigned long len);
+void serial_chain(unsigned char* a, unsigned char* b, unsigned char* c, unsigned char* d, const unsigned long len);
+
+void test_setup();
+void test_verify();
+
+char* readKernelSource(const char* filename)
+{
+	FILE* kernelFile = NULL;
+	kernelFile = fopen(filename, "r");
+	if(!kernelFile)
+		fprintf(stdout,"Error reading file.\n"), exit(0);
+	fseek(kernelFile, 0, SEEK_END);
+	size_t kernelLength = (size_t) ftell(kernelFile);
+	char* kernelSource = (char *) calloc(1, sizeof(char)*kernelLength+1);
+	rewind(kernelFile);
+	if(fread((void *) kernelSource, kernelLength, 1, kernelFile) == 0) {
+		fprintf(stderr, "Could not read source\n");
+		exit(1);
+	}
+	kernelSource[kernelLength] = 0;
+	fclose(kernelFile);
+
+	return kernelSource;
+}
+
+cl_kernel create_kernel(const char* filename, const char* kernel, const cl_context context, const cl_device_id device)
+{
+	cl_kernel kernel_compute;
+	char* kernelSource = readKernelSource(filename);
+
+	// Build the program executable, reusing a cached binary when possible
+	int err;
+	cl_program program = build_cached_program(context, device, kernelSource, elem_info(elem_type)->options, &err);
+	free(kernelSource);
+	if (err == CL_BUILD_PROGRAM_FAILURE)
+	{
+		char *log;
+		size_t logLen;
+		err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &logLen);
+		log = (char *) malloc(sizeof(char)*logLen);
+		err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logLen, (void *) log, NULL);
+		fprintf(stdout, "CL Error %d: Failed to build program! Log:\n%s", err, log);
+		free(log);
+		exit(1);
+	}
+	CHKERR(err, "Failed to build program!");
+
+	// Create the compute kernel in the program we wish to run
+	kernel_compute = clCreateKernel(program, kernel, &err);
+	CHKERR(err, "Failed to create a compute kernel!");
+
+	return kernel_compute;
+}
+
+void setupGPU()
+{
+	int err = 0;
+	cl_device_type type = CL_DEVICE_TYPE_ALL;
+	if(scheme == CPU_ONLY)
+		type = CL_DEVICE_TYPE_CPU;
+	else if(scheme == GPU_ONLY)
+		type = CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_ACCELERATOR;
+
+	//The native backend takes the CPU's place, or joins it with "both"
+	int use_native = scheme != GPU_ONLY && cpu_backend != BACKEND_OPENCL;
+	if(use_native && cpu_backend == BACKEND_NATIVE)
+		type = scheme == CPU_ONLY ? 0 : CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_ACCELERATOR;
+
+	// One worker per device on every platform
+	num_workers = type ? enumerate_workers(workers, MAX_WORKERS, type, cpu_split) : 0;
+	if(use_native)
+	{
+		num_workers = add_native_worker(workers, num_workers, MAX_WORKERS);
+		native_init(0);
+	}
+	if(num_workers == 0)
+	{
+		fprintf(stderr, "Error: no OpenCL device found for this scheme\n");
+		exit(1);
+	}
+
+	int i;
+	for(i = 0; i < num_workers; i++)
+	{
+		struct worker* w = &workers[i];
+		trace_track(TRACE_HOST, i, w->name);
+		if(w->native)
+		{
+			fprintf(stderr, "worker %s: native %s, %d threads\n", w->name, native_isa_name(), native_threads());
+			continue;
+		}
+		trace_track(TRACE_DEVICE, i, w->name);
+		w->context = clCreateContext(NULL, 1, &w->device, NULL, NULL, &err);
+		CHKERR(err, "Failed to create a compute context!");
+		w->commands = clCreateCommandQueue(w->context, w->device, CL_QUEUE_PROFILING_ENABLE, &err);
+		CHKERR(err, "Failed to create a command queue!");
+		w->kernel = create_kernel(AddSourceFile, "compute", w->context, w->device);
+		bound_kernels[i] = create_kernel(BoundSourceFile, "compute", w->context, w->device);
+
+		char name[256];
+		clGetDeviceInfo(w->device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+		fprintf(stderr, "worker %s: %s%s\n", w->name, name, w->subdevice ? " (sub-device)" : "");
+	}
+}
+
+// Register the kernels and arrays with the task graph and measure what each
+// kernel costs on every worker at one and at an eighth of a task
+void graph_setup()
+{
+	cl_kernel add_kernels[MAX_WORKERS];
+	int d;
+	for(d = 0; d < num_workers; d++)
+		add_kernels[d] = workers[d].kernel;
+
+	taskgraph_init(&graph, workers, num_workers, elem_type);
+	graph.local_size = work_group_size;
+	kernel_add = taskgraph_kernel(&graph, "add", add_kernels, native_vector_add);
+	kernel_bound = taskgraph_kernel(&graph, "bound", bound_kernels, native_cpu_bound);
+	array_a = taskgraph_array(&graph, h_a, length);
+	array_b = taskgraph_array(&graph, h_b, length);
+	array_c = taskgraph_array(&graph, h_c, length);
+	array_d = taskgraph_array(&graph, h_d, length);
+	//Run as one graph, c only passes between the stages and never has to
+	//reach the host
+	if(!staged)
+		taskgraph_scratch(&graph, array_c);
+
+	size_t small = task_chunk / 8 > 0 ? task_chunk / 8 : task_chunk;
+	taskgraph_calibrate(&graph, kernel_add, array_a, array_b, array_c, small, task_chunk);
+	taskgraph_calibrate(&graph, kernel_bound, array_c, array_b, array_d, small, task_chunk);
+
+	fprintf(stderr, "task costs per %lu elements:", task_chunk);
+	for(d = 0; d < num_workers; d++)
+		fprintf(stderr, " %s add %f ms bound %f ms", workers[d].name,
+			model_time(&graph.kernels[kernel_add].models[d], task_chunk), model_time(&graph.kernels[kernel_bound].models[d], task_chunk));
+	fprintf(stderr, "\n");
+}
+
+// Add the tasks of stage 0, c = a + b, or stage 1, d = CPUBound(c, b), or of
+// both with each chunk's second task straight after its first
+void add_tasks(int stage)
+{
+	size_t offset;
+	for(offset = 0; offset < length; offset += task_chunk)
+	{
+		size_t size = length - offset < task_chunk ? length - offset : task_chunk;
+		if(stage != 1)
+			taskgraph_task(&graph, kernel_add, array_a, array_b, array_c, offset, size);
+		if(stage != 0)
+			taskgraph_task(&graph, kernel_bound, array_c, array_b, array_d, offset, size);
+	}
+}
+
+// Schedule and run what is in the graph, then empty it, adding how long
+// its copies and kernels ran to data_time and exec_time. Returns the share of
+// the elements the GPUs processed.
+float run_graph(float* data_time, float* exec_time)
+{
+	int counts[MAX_WORKERS] = {0};
+	size_t gpu_elements = 0;
+	size_t elements = 0;
+	int d, i;
+	float predicted = taskgraph_schedule(&graph);
+	taskgraph_run(&graph);
+
+	for(i = 0; i < graph.num_tasks; i++)
+	{
+		const struct task* t = &graph.tasks[i];
+		counts[t->device]++;
+		elements += t->size;
+		if(workers[t->device].isGPU)
+			gpu_elements += t->size;
+	}
+	fprintf(stderr, "task graph: %d tasks,", graph.num_tasks);
+	for(d = 0; d < num_workers; d++)
+		fprintf(stderr, " %s %d", workers[d].name, counts[d]);
+	fprintf(stderr, ", %lu elements copied in and %lu out, %f ms predicted, %f ms in copies, %f ms in kernels\n", graph.uploaded,
+		graph.downloaded, predicted, graph.data_time, graph.exec_time);
+	*data_time += graph.data_time;
+	*exec_time += graph.exec_time;
+	taskgraph_clear(&graph);
+	return elements ? (float) gpu_elements / elements : 0;
+}
+
+void test_setup()
+{
+	//Every set of inputs takes the next two streams of the seed
+	fillArray(h_a, length, 2 * generation);
+	fillArray(h_b, length, 2 * generation + 1);
+	generation++;
+	serial_chain(h_a, h_b, h_c, h_check, length);
+	if(verify_mode == VERIFY_CHECKSUM)
+		check_sum = verify_checksum(h_check, length, elem_size, 0);
+}
+
+// Check h_d against h_check the way VERIFY asks and report what it cost
+void test_verify()
+{
+	if(verify_mode == VERIFY_NONE)
+		return;
+	struct timespec start, end;
+	clock_gettime(CLOCK_REALTIME, &start);
+	unsigned long mismatches;
+	if(verify_mode == VERIFY_CHECKSUM)
+		mismatches = verify_checksum(h_d, length, elem_size, 0) != check_sum ? verify_answer(h_d, h_check, length) : 0;
+	else if(verify_mode == VERIFY_SAMPLE)
+		mismatches = verify_sample(h_d, h_check, length, elem_size, seed + generation);
+	else
+		mismatches = verify_answer(h_d, h_check, length);
+	clock_gettime(CLOCK_REALTIME, &end);
+	fprintf(stderr, "verify %s: %s (%lu mismatches), %f ms\n", verify_mode_name(verify_mode), mismatches ? "FAILED" : "ok", mismatches,
+		(end.tv_sec - start.tv_sec) * 1000.0f + (end.tv_nsec - start.tv_nsec) / 1000000.0f);
+}
+
+// Both stages as one graph, so a chunk's second task can start as soon as
+// its first is done, or one graph per stage with the host waiting in between.
+// data_time and exec_time are the times copies and kernels ran summed over
+// the workers, so they can exceed the total when they overlap.
+void run_test(float* data_time, float* exec_time, float* total_time, float* gpu_share)
+{
+	*data_time = 0;
+	*exec_time = 0;
+	TOTAL_TIMER_START;
+	TIMER_START;
+	if(staged)
+	{
+		add_tasks(0);
+		*gpu_share = run_graph(data_time, exec_time) / 2;
+		add_tasks(1);
+		*gpu_share += run_graph(data_time, exec_time) / 2;
+	}
+	else
+	{
+		add_tasks(-1);
+		*gpu_share = run_graph(data_time, exec_time);
+	}
+	TIMER_END;
+	trace_span(TRACE_MAIN, "schedule", &timer1, &timer2);
+	TOTAL_TIMER_END;
+	*total_time = TOTAL_MILLISECONDS;
+	test_verify();
+	trace_collect();
+}
+
+// Fill nums with random bytes from one stream of seed, on every core
+void fillArray(unsigned char* nums, const unsigned long length, unsigned long stream)
+{
+	fill_random_bytes(nums, length, elem_size, elem_info(elem_type)->is_float, seed, stream);
+}
+
+// c = a + b, then d = CPUBound(c, b)
+void serial_chain(unsigned char* a, unsigned char* b, unsigned char* c, unsigned char* d, const unsigned long len)
+{
+	elem_vector_add(elem_type, a, b, c, len);
+	elem_cpu_bound(elem_type, c, b, d, len);
+}
+
+unsigned long verify_answer(unsigned char* toCheck, unsigned char* answer, const unsigned long len)
+{
+	return verify_compare(toCheck, answer, len, elem_size);
+}
+
+
+int main(int argc, char** argv)
+{
+	const char* scheme_name;
+
+	length = atol(argv[1]);
+	unsigned int iters = atoi(argv[2]);
+	switch(atoi(argv[3]))
+	{
+		case 0: scheme = CPU_ONLY;
+			scheme_name = "c";
+			break;
+		case 1: scheme = GPU_ONLY;
+			scheme_name = "g";
+			break;
+		case 3: scheme = CPU_GPU_DYNAMIC;
+			scheme_name = "cg-dag";
+			//fixed, the chunking every other workload defaults to, is the task
+			//graph; staged runs one stage at a time for comparison
+			if(argc > 4 && strcmp(argv[4], "staged") == 0)
+			{
+				staged = 1;
+				scheme_name = "cg-dag-staged";
+			}
+			else if(argc > 4 && strcmp(argv[4], "fixed") != 0)
+			{
+				fprintf(stderr, "Error: Chain chunks are fixed or staged, not %s\n", argv[4]);
+				exit(1);
+			}
+			break;
+		default:
+			fprintf(stderr, "Error: Chain runs schemes 0, 1 and 3\n");
+			exit(1);
+	}
+	//CPU_SUBDEVICES=N splits each CPU into N sub-devices, 1 keeps it whole,
+	//and unset splits it by NUMA node
+	const char* split = getenv("CPU_SUBDEVICES");
+	if(split)
+		cpu_split = atoi(split);
+	//CHUNK_SIZE sets the elements per task and LOCAL_SIZE the work group size
+	const char* chunk = getenv("CHUNK_SIZE");
+	if(chunk)
+		fixed_chunk = atol(chunk);
+	const char* local = getenv("LOCAL_SIZE");
+	if(local)
+		work_group_size = atol(local);
+	//ELEM_TYPE=uint8|uint32|uint64|float|double picks the element type the
+	//kernels are built for
+	const char* type = getenv("ELEM_TYPE");
+	if(type && !parse_elem_type(type, &elem_type))
+	{
+		fprintf(stderr, "Error: unknown element type %s\n", type);
+		exit(1);
+	}
+	elem_size = elem_info(elem_type)->size;
+	//CPU_BACKEND=native runs CPU tasks on the host SIMD kernels instead of
+	//the OpenCL CPU device, and both keeps the two side by side
+	const char* backend = getenv("CPU_BACKEND");
+	if(backend && !parse_cpu_backend(backend, &cpu_backend))
+	{
+		fprintf(stderr, "Error: unknown CPU backend %s\n", backend);
+		exit(1);
+	}
+	//TRACE_FILE=path writes a Chrome trace of every command and scheduler phase
+	trace_open(getenv("TRACE_FILE"));
+	trace_track(TRACE_HOST, TRACE_MAIN, "main");
+
+	h_a = host_alloc(elem_size * length);
+	h_b = host_alloc(elem_size * length);
+	h_c = host_alloc(elem_size * length);
+	h_d = host_alloc(elem_size * length);
+	h_check = malloc(elem_size * length);
+
+	//SEED picks the inputs, FRESH_DATA=1 makes new ones every iteration and
+	//VERIFY=none|full|sample|checksum picks how each run's result is checked
+	const char* seed_value = getenv("SEED");
+	if(seed_value)
+		seed = strtoul(seed_value, NULL, 0);
+	const char* verify = getenv("VERIFY");
+	if(verify && !parse_verify_mode(verify, &verify_mode))
+	{
+		fprintf(stderr, "Error: unknown verify mode %s\n", verify);
+		exit(1);
+	}
+	const char* fresh = getenv("FRESH_DATA");
+	if(fresh)
+		fresh_data = atoi(fresh);
+	test_setup();
+
+	setupGPU();
+	fprintf(stderr, "kernel cache: %d hits, %d misses, %f ms build time\n",
+		program_cache_stats.hits, program_cache_stats.misses, program_cache_stats.build_time);
+	task_chunk = fixed_chunk > 0 ? fixed_chunk : FIXED_CHUNK_SIZE;
+	if(task_chunk > length)
+		task_chunk = length;
+	graph_setup();
+
+	float data_time = 0;
+	float exec_time = 0;
+	float total_time = 0;
+	float gpu_share = 0;
+
+	int i;
+	for(i = 0; i < iters+warmup; i++)
+	{
+		//Copies of a and b the workers kept from the last iteration are
+		//reused unless the inputs changed
+		if(fresh_data && i > 0)
+		{
+			test_setup();
+			taskgraph_invalidate(&graph, array_a);
+			taskgraph_invalidate(&graph, array_b);
+		}
+		memset(h_c, 0, elem_size * length);
+		memset(h_d, 0, elem_size * length);
+		taskgraph_invalidate(&graph, array_c);
+		taskgraph_invalidate(&graph, array_d);
+		run_test(&data_time, &exec_time, &total_time, &gpu_share);
+		if(i >= warmup)
+		{
+			fprintf(stdout,"%d\tChain\t%s\t%f\t%lu\t%f\t%f\t%f\n", i - warmup, scheme_name, gpu_share, length, data_time, exec_time, total_time);
+		}
+		data_time = 0;
+		exec_time = 0;
+	}
+
+	fflush(stdout);
+	trace_close();
+	taskgraph_destroy(&graph);
+	if(scheme != GPU_ONLY && cpu_backend != BACKEND_OPENCL)
+		native_shutdown();
+	free(h_a);
+	free(h_b);
+	free(h_c);
+	free(h_d);
+	free(h_check);
+	return 0;
+}
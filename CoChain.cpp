@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <memory>
+
+#include "coro.hpp"
+
+extern "C" {
+#include "dispenser.h"
+#include "pool.h"
+#include "devices.h"
+#include "native.h"
+#include "trace.h"
+#include "rng.h"
+#include "verify.h"
+#include "elem.h"
+}
+
+// Chain's two stages, c = a + b then d = CPUBound(c, b), with every chunk
+// written as straight-line code in a coroutine. Each worker runs a few
+// streams at once, each with its own queue and chunk buffers, so one
+// stream's transfers overlap another's kernels and every device stays busy
+// from the main thread alone. c never leaves the device.
+
+#define TIMER_START clock_gettime(CLOCK_REALTIME, &timer1)
+#define TIMER_END clock_gettime(CLOCK_REALTIME, &timer2)
+#define MILLISECONDS (timer2.tv_sec - timer1.tv_sec) * 1000.0f + (timer2.tv_nsec - timer1.tv_nsec) / 1000000.0f
+struct timespec timer1;
+struct timespec timer2;
+
+#define TOTAL_TIMER_START clock_gettime(CLOCK_REALTIME, &total_timer1)
+#define TOTAL_TIMER_END clock_gettime(CLOCK_REALTIME, &total_timer2)
+#define TOTAL_MILLISECONDS (total_timer2.tv_sec - total_timer1.tv_sec) * 1000.0f + (total_timer2.tv_nsec - total_timer1.tv_nsec) / 1000000.0f
+struct timespec total_timer1;
+struct timespec total_timer2;
+
+#define MAX_STREAMS 8
+
+//OpenCL Constructs
+const char *AddSourceFile = "VectorAdd.cl";
+const char *BoundSourceFile = "CPUBound.cl";
+struct worker workers[MAX_WORKERS];
+int num_workers = 0;
+int cpu_split = 0;
+enum cpu_backend_t cpu_backend = BACKEND_OPENCL;
+
+//Number of iterations to warmup caches
+const int warmup = 0;
+
+enum scheme_t { CPU_ONLY, GPU_ONLY, CPU_GPU_STATIC, CPU_GPU_DYNAMIC };
+enum scheme_t scheme = CPU_ONLY;
+int num_streams = 2;		//Chunks in flight per OpenCL worker
+size_t fixed_chunk = 0;		//0 keeps FIXED_CHUNK_SIZE
+size_t task_chunk;		//Elements per chunk
+size_t work_group_size = 0;	//0 uses the largest the device allows
+unsigned long seed = DEFAULT_SEED;
+int fresh_data = 0;		//Regenerate the inputs before every iteration
+unsigned long generation = 0;	//Sets of inputs generated so far
+enum verify_mode_t verify_mode = VERIFY_SAMPLE;
+
+//Data: c = a + b, then d = CPUBound(c, b)
+unsigned long length;
+enum elem_type_t elem_type = ELEM_UINT8;
+size_t elem_size;
+unsigned char* h_a;
+unsigned char* h_b;
+unsigned char* h_c;		//Only native workers write c to the host
+unsigned char* h_d;
+unsigned char* h_check;
+unsigned long check_sum;		//verify_checksum of h_check
+
+struct dispenser* dispenser;	//Made by run_test for each iteration
+balancer::executor executor;
+size_t elements[MAX_WORKERS];	//Processed by each worker in this iteration
+float copy_times[MAX_WORKERS];	//Milliseconds each worker's copies ran in this iteration
+float kernel_times[MAX_WORKERS];	//and its kernels
+
+// The OpenCL objects of one worker. Streams share its kernels: they set the
+// arguments and enqueue without suspending in between, so no other stream
+// can get in the way.
+struct device
+{
+	device(cl_device_id id) :
+		ctx(id),
+		add(ctx, id, AddSourceFile, "compute", elem_info(elem_type)->options),
+		bound(ctx, id, BoundSourceFile, "compute", elem_info(elem_type)->options)
+	{
+		clGetDeviceInfo(id, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &local_size, NULL);
+		if(work_group_size > 0 && work_group_size < local_size)
+			local_size = work_group_size;
+	}
+
+	balancer::context ctx;
+	balancer::kernel add;
+	balancer::kernel bound;
+	size_t local_size;
+};
+
+// A queue and a chunk's worth of each array
+struct stream
+{
+	stream(device& dev, cl_device_id id) :
+		q(executor, dev.ctx, id),
+		a(dev.ctx, elem_size * task_chunk),
+		b(dev.ctx, elem_size * task_chunk),
+		c(dev.ctx, elem_size * task_chunk),
+		d(dev.ctx, elem_size * task_chunk)
+	{
+	}
+
+	balancer::queue q;
+	balancer::buffer a, b, c, d;
+};
+
+std::unique_ptr<device> devices[MAX_WORKERS];
+std::unique_ptr<stream> streams[MAX_WORKERS][MAX_STREAMS];
+
+//Function Prototypes
+void fillArray(unsigned char* nums, const unsigned long length, unsigned long stream);
+unsigned long verify_answer(unsigned char* toCheck, unsigned char* answer, const unsigned long len);
+void serial_chain(unsigned char* a, unsigned char* b, unsigned char* c, unsigned char* d, const unsigned long len);
+
+void test_setup();
+void test_verify();
+
+void setupGPU()
+{
+	cl_device_type type = CL_DEVICE_TYPE_ALL;
+	if(scheme == CPU_ONLY)
+		type = CL_DEVICE_TYPE_CPU;
+	else if(scheme == GPU_ONLY)
+		type = CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_ACCELERATOR;
+
+	//The native backend takes the CPU's place, or joins it with "both"
+	int use_native = scheme != GPU_ONLY && cpu_backend != BACKEND_OPENCL;
+	if(use_native && cpu_backend == BACKEND_NATIVE)
+		type = scheme == CPU_ONLY ? 0 : CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_ACCELERATOR;
+
+	// One worker per device on every platform
+	num_workers = type ? enumerate_workers(workers, MAX_WORKERS, type, cpu_split) : 0;
+	if(use_native)
+	{
+		num_workers = add_native_worker(workers, num_workers, MAX_WORKERS);
+		native_init(0);
+	}
+	if(num_workers == 0)
+	{
+		fprintf(stderr, "Error: no OpenCL device found for this scheme\n");
+		exit(1);
+	}
+
+	int i, s;
+	for(i = 0; i < num_workers; i++)
+	{
+		struct worker* w = &workers[i];
+		trace_track(TRACE_HOST, i, w->name);
+		if(w->native)
+		{
+			fprintf(stderr, "worker %s: native %s, %d threads\n", w->name, native_isa_name(), native_threads());
+			continue;
+		}
+		devices[i] = std::make_unique<device>(w->device);
+		for(s = 0; s < num_streams; s++)
+			streams[i][s] = std::make_unique<stream>(*devices[i], w->device);
+
+		char name[256];
+		clGetDeviceInfo(w->device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+		fprintf(stderr, "worker %s: %s%s\n", w->name, name, w->subdevice ? " (sub-device)" : "");
+	}
+}
+
+// Claim chunks for worker dev and run both stages on each until none are left
+balancer::job run_stream(int dev, stream& s)
+{
+	device& d = *devices[dev];
+	size_t offset = 0;
+	size_t size;
+	while((size = dispenser_claim(dispenser, dev, &offset)) > 0)
+	{
+		size_t bytes = elem_size * size;
+		balancer::command write_a = s.q.write(s.a, h_a + elem_size * offset, bytes);
+		balancer::command write_b = s.q.write(s.b, h_b + elem_size * offset, bytes);
+		co_await write_b;
+
+		d.add.args(s.a, s.b, s.c, size);
+		balancer::command add = s.q.run(d.add, size, d.local_size);
+		d.bound.args(s.c, s.b, s.d, size);
+		balancer::command bound = s.q.run(d.bound, size, d.local_size);
+		co_await bound;		//In order, so add is done too
+
+		balancer::command read_d = s.q.read(s.d, h_d + elem_size * offset, bytes);
+		co_await read_d;
+		elements[dev] += size;
+		copy_times[dev] += write_a.milliseconds() + write_b.milliseconds() + read_d.milliseconds();
+		kernel_times[dev] += add.milliseconds() + bound.milliseconds();
+	}
+}
+
+// The native kernels run on the host thread team and block this thread, so
+// let the OpenCL streams move on between chunks
+balancer::job run_native(int dev)
+{
+	size_t offset = 0;
+	size_t size;
+	while((size = dispenser_claim(dispenser, dev, &offset)) > 0)
+	{
+		size_t at = elem_size * offset;
+		struct timespec start, end;
+		clock_gettime(CLOCK_REALTIME, &start);
+		native_vector_add(h_a + at, h_b + at, h_c + at, size, elem_type);
+		native_cpu_bound(h_c + at, h_b + at, h_d + at, size, elem_type);
+		clock_gettime(CLOCK_REALTIME, &end);
+		elements[dev] += size;
+		kernel_times[dev] += (end.tv_sec - start.tv_sec) * 1000.0f + (end.tv_nsec - start.tv_nsec) / 1000000.0f;
+		co_await balancer::yield(executor);
+	}
+}
+
+void test_setup()
+{
+	//Every set of inputs takes the next two streams of the seed
+	fillArray(h_a, length, 2 * generation);
+	fillArray(h_b, length, 2 * generation + 1);
+	generation++;
+	serial_chain(h_a, h_b, h_c, h_check, length);
+	if(verify_mode == VERIFY_CHECKSUM)
+		check_sum = verify_checksum(h_check, length, elem_size, 0);
+}
+
+// Check h_d against h_check the way VERIFY asks and report what it cost
+void test_verify()
+{
+	if(verify_mode == VERIFY_NONE)
+		return;
+	struct timespec start, end;
+	clock_gettime(CLOCK_REALTIME, &start);
+	unsigned long mismatches;
+	if(verify_mode == VERIFY_CHECKSUM)
+		mismatches = verify_checksum(h_d, length, elem_size, 0) != check_sum ? verify_answer(h_d, h_check, length) : 0;
+	else if(verify_mode == VERIFY_SAMPLE)
+		mismatches = verify_sample(h_d, h_check, length, elem_size, seed + generation);
+	else
+		mismatches = verify_answer(h_d, h_check, length);
+	clock_gettime(CLOCK_REALTIME, &end);
+	fprintf(stderr, "verify %s: %s (%lu mismatches), %f ms\n", verify_mode_name(verify_mode), mismatches ? "FAILED" : "ok", mismatches,
+		(end.tv_sec - start.tv_sec) * 1000.0f + (end.tv_nsec - start.tv_nsec) / 1000000.0f);
+}
+
+// Start every stream and run them all from this thread until the dispenser
+// is empty. data_time and exec_time are the times copies and kernels ran
+// summed over the workers, so they can exceed the total when they overlap.
+void run_test(float* data_time, float* exec_time, float* total_time, float* gpu_share)
+{
+	struct device_chunking chunkings[MAX_WORKERS];
+	int d, s;
+	for(d = 0; d < num_workers; d++)
+	{
+		chunkings[d] = workers[d].chunking;
+		elements[d] = 0;
+		copy_times[d] = 0;
+		kernel_times[d] = 0;
+	}
+	dispenser = dispenser_alloc();
+	dispenser_init(dispenser, CHUNK_FIXED, length, chunkings, num_workers);
+	dispenser_set_chunk(dispenser, task_chunk);
+
+	TOTAL_TIMER_START;
+	TIMER_START;
+	for(d = 0; d < num_workers; d++)
+	{
+		if(workers[d].native)
+			continue;
+		for(s = 0; s < num_streams; s++)
+			run_stream(d, *streams[d][s]);
+	}
+	for(d = 0; d < num_workers; d++)
+		if(workers[d].native)
+			run_native(d);
+	executor.run();
+	TIMER_END;
+	trace_span(TRACE_MAIN, "schedule", &timer1, &timer2);
+	TOTAL_TIMER_END;
+	*total_time = TOTAL_MILLISECONDS;
+	dispenser_destroy(dispenser);
+	dispenser_free(dispenser);
+
+	size_t gpu_elements = 0;
+	*data_time = 0;
+	*exec_time = 0;
+	fprintf(stderr, "streams:");
+	for(d = 0; d < num_workers; d++)
+	{
+		fprintf(stderr, " %s %lu", workers[d].name, elements[d]);
+		if(workers[d].isGPU)
+			gpu_elements += elements[d];
+		*data_time += copy_times[d];
+		*exec_time += kernel_times[d];
+	}
+	fprintf(stderr, " elements, %f ms in copies, %f ms in kernels\n", *data_time, *exec_time);
+	*gpu_share = length ? (float) gpu_elements / length : 0;
+	test_verify();
+	trace_collect();
+}
+
+// Fill nums with random bytes from one stream of seed, on every core
+void fillArray(unsigned char* nums, const unsigned long length, unsigned long stream)
+{
+	fill_random_bytes(nums, length, elem_size, elem_info(elem_type)->is_float, seed, stream);
+}
+
+// c = a + b, then d = CPUBound(c, b)
+void serial_chain(unsigned char* a, unsigned char* b, unsigned char* c, unsigned char* d, const unsigned long len)
+{
+	elem_vector_add(elem_type, a, b, c, len);
+	elem_cpu_bound(elem_type, c, b, d, len);
+}
+
+unsigned long verify_answer(unsigned char* toCheck, unsigned char* answer, const unsigned long len)
+{
+	return verify_compare(toCheck, answer, len, elem_size);
+}
+
+
+int main(int argc, char** argv)
+{
+	const char* scheme_name;
+
+	length = atol(argv[1]);
+	unsigned int iters = atoi(argv[2]);
+	switch(atoi(argv[3]))
+	{
+		case 0: scheme = CPU_ONLY;
+			scheme_name = "c";
+			break;
+		case 1: scheme = GPU_ONLY;
+			scheme_name = "g";
+			break;
+		case 3: scheme = CPU_GPU_DYNAMIC;
+			scheme_name = "cg-co";
+			//Chunks are always fixed, the mode every other workload defaults to
+			if(argc > 4 && strcmp(argv[4], "fixed") != 0)
+			{
+				fprintf(stderr, "Error: CoChain chunks are fixed, not %s\n", argv[4]);
+				exit(1);
+			}
+			break;
+		default:
+			fprintf(stderr, "Error: CoChain runs schemes 0, 1 and 3\n");
+			exit(1);
+	}
+	//The fifth argument is the number of streams per OpenCL worker
+	if(argc > 5)
+		num_streams = atoi(argv[5]);
+	if(num_streams < 1 || num_streams > MAX_STREAMS)
+	{
+		fprintf(stderr, "Error: streams must be between 1 and %d\n", MAX_STREAMS);
+		exit(1);
+	}
+	//CPU_SUBDEVICES=N splits each CPU into N sub-devices, 1 keeps it whole,
+	//and unset splits it by NUMA node
+	const char* split = getenv("CPU_SUBDEVICES");
+	if(split)
+		cpu_split = atoi(split);
+	//CHUNK_SIZE sets the elements per chunk and LOCAL_SIZE the work group size
+	const char* chunk = getenv("CHUNK_SIZE");
+	if(chunk)
+		fixed_chunk = atol(chunk);
+	const char* local = getenv("LOCAL_SIZE");
+	if(local)
+		work_group_size = atol(local);
+	//ELEM_TYPE=uint8|uint32|uint64|float|double picks the element type the
+	//kernels are built for
+	const char* type = getenv("ELEM_TYPE");
+	if(type && !parse_elem_type(type, &elem_type))
+	{
+		fprintf(stderr, "Error: unknown element type %s\n", type);
+		exit(1);
+	}
+	elem_size = elem_info(elem_type)->size;
+	//CPU_BACKEND=native runs CPU chunks on the host SIMD kernels instead of
+	//the OpenCL CPU device, and both keeps the two side by side
+	const char* backend = getenv("CPU_BACKEND");
+	if(backend && !parse_cpu_backend(backend, &cpu_backend))
+	{
+		fprintf(stderr, "Error: unknown CPU backend %s\n", backend);
+		exit(1);
+	}
+	//TRACE_FILE=path writes a Chrome trace of the scheduler phases
+	trace_open(getenv("TRACE_FILE"));
+	trace_track(TRACE_HOST, TRACE_MAIN, "main");
+
+	h_a = (unsigned char*) host_alloc(elem_size * length);
+	h_b = (unsigned char*) host_alloc(elem_size * length);
+	h_c = (unsigned char*) host_alloc(elem_size * length);
+	h_d = (unsigned char*) host_alloc(elem_size * length);
+	h_check = (unsigned char*) malloc(elem_size * length);
+
+	//SEED picks the inputs, FRESH_DATA=1 makes new ones every iteration and
+	//VERIFY=none|full|sample|checksum picks how each run's result is checked
+	const char* seed_value = getenv("SEED");
+	if(seed_value)
+		seed = strtoul(seed_value, NULL, 0);
+	const char* verify = getenv("VERIFY");
+	if(verify && !parse_verify_mode(verify, &verify_mode))
+	{
+		fprintf(stderr, "Error: unknown verify mode %s\n", verify);
+		exit(1);
+	}
+	const char* fresh = getenv("FRESH_DATA");
+	if(fresh)
+		fresh_data = atoi(fresh);
+	test_setup();
+
+	task_chunk = fixed_chunk > 0 ? fixed_chunk : FIXED_CHUNK_SIZE;
+	if(task_chunk > length)
+		task_chunk = length;
+	setupGPU();
+	fprintf(stderr, "kernel cache: %d hits, %d misses, %f ms build time\n",
+		program_cache_stats.hits, program_cache_stats.misses, program_cache_stats.build_time);
+
+	float data_time = 0;
+	float exec_time = 0;
+	float total_time = 0;
+	float gpu_share = 0;
+
+	unsigned int i;
+	for(i = 0; i < iters+warmup; i++)
+	{
+		if(fresh_data && i > 0)
+			test_setup();
+		memset(h_d, 0, elem_size * length);
+		run_test(&data_time, &exec_time, &total_time, &gpu_share);
+		if(i >= warmup)
+		{
+			fprintf(stdout,"%d\tCoChain\t%s\t%f\t%lu\t%f\t%f\t%f\n", i - warmup, scheme_name, gpu_share, length, data_time, exec_time, total_time);
+		}
+		data_time = 0;
+		exec_time = 0;
+	}
+
+	fflush(stdout);
+	trace_close();
+	//The wrappers release every OpenCL object here, streams before devices
+	int d, s;
+	for(d = 0; d < num_workers; d++)
+	{
+		for(s = 0; s < num_streams; s++)
+			streams[d][s].reset();
+		devices[d].reset();
+	}
+	if(scheme != GPU_ONLY && cpu_backend != BACKEND_OPENCL)
+		native_shutdown();
+	free(h_a);
+	free(h_b);
+	free(h_c);
+	free(h_d);
+	free(h_check);
+	return 0;
+}
@@ -0,0 +1,73 @@
+// Template for a fused expression on a CPU. The host puts the expression's
+// INPUT_PARAMS, LOAD_INPUTS and EXPR macros in front of it, and passes ELEM,
+// CALC and ACC as -D options.
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#ifndef EXPR_SUM
+#error "This template sums expressions; stored ones use Fused_store.cl"
+#endif
+
+#define PASTE(a, b) a ## b
+#define CONCAT(a, b) PASTE(a, b)
+#define VEC(type, n) CONCAT(type, n)
+#define CONVERT(type, n) CONCAT(convert_, VEC(type, n))
+
+#define LOAD_VEC(in) CONVERT(CALC, 16)(vload16(0, in + offset + i))
+#define LOAD_ONE(in) ((CALC) in[offset + i])
+
+// Like Reduction_CPU.cl's compute, over the expression's value at each
+// element instead of one buffer: each work item sums a contiguous span of
+// chunk elements of [offset, offset + length) and writes one partial to
+// reduction[id]. Every input element is loaded once and nothing else is
+// written.
+__kernel void compute(INPUT_PARAMS
+			__global ACC* reduction,
+			const unsigned long length,
+			const unsigned long chunk,
+			const unsigned long offset)
+{
+	size_t tid = get_global_id(0);
+	unsigned long start = tid * chunk;
+	unsigned long end = min(start + chunk, length);
+	unsigned long i = start;
+
+	VEC(ACC, 16) acc = 0;
+	for(; i + 16 <= end; i += 16)
+	{
+		LOAD_INPUTS(VEC(CALC, 16), LOAD_VEC)
+		acc += CONVERT(ACC, 16)(EXPR(VEC(CALC, 16)));
+	}
+
+	VEC(ACC, 8) acc8 = acc.lo + acc.hi;
+	VEC(ACC, 4) acc4 = acc8.lo + acc8.hi;
+	VEC(ACC, 2) acc2 = acc4.lo + acc4.hi;
+	ACC sum = acc2.lo + acc2.hi;
+	for(; i < end; i++)
+	{
+		LOAD_INPUTS(CALC, LOAD_ONE)
+		sum += (ACC) EXPR(CALC);
+	}
+
+	reduction[tid] = sum;
+}
+
+// Adds up the partials, as Reduction_CPU.cl's combine does
+__kernel void combine(__global const ACC* buffer,
+			__global ACC* reduction,
+			const unsigned long length,
+			const unsigned long chunk,
+			const unsigned long offset)
+{
+	size_t tid = get_global_id(0);
+	__global const ACC* input = buffer + offset;
+	unsigned long start = tid * chunk;
+	unsigned long end = min(start + chunk, length);
+
+	ACC sum = 0;
+	for(unsigned long i = start; i < end; i++)
+		sum += input[i];
+
+	reduction[tid] = sum;
+}
@@ -0,0 +1,76 @@
+// Template for a fused expression on a GPU. The host puts the expression's
+// INPUT_PARAMS, LOAD_INPUTS and EXPR macros in front of it, and passes ELEM,
+// CALC and ACC as -D options. ACC must be at least as wide as the arrival
+// counter.
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#ifndef EXPR_SUM
+#error "This template sums expressions; stored ones use Fused_store.cl"
+#endif
+
+#define LOAD_ONE(in) ((CALC) in[offset + i])
+
+// Reduction_GPU.cl's grid-stride sum over the expression's value at each
+// element of [offset, offset + length) instead of one buffer. Each group
+// leaves its partial in scratch[group]; the last group to arrive adds them
+// into scratch[0] and resets the arrival counter in scratch[groups]. The
+// local size must be a power of two.
+__kernel void compute(INPUT_PARAMS
+			__global ACC* scratch,
+			const unsigned long length,
+			const unsigned long offset,
+			__local ACC* local_mem)
+{
+	__local int last;
+	size_t lid = get_local_id(0);
+	size_t local_size = get_local_size(0);
+	size_t groups = get_num_groups(0);
+	volatile __global unsigned int* arrived = (volatile __global unsigned int*) (scratch + groups);
+
+	ACC sum = 0;
+	for(size_t i = get_global_id(0); i < length; i += get_global_size(0))
+	{
+		LOAD_INPUTS(CALC, LOAD_ONE)
+		sum += (ACC) EXPR(CALC);
+	}
+	local_mem[lid] = sum;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for(size_t size = local_size / 2; size > 0; size /= 2)
+	{
+		if(lid < size)
+			local_mem[lid] += local_mem[lid + size];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if(lid == 0)
+	{
+		scratch[get_group_id(0)] = local_mem[0];
+		mem_fence(CLK_GLOBAL_MEM_FENCE);
+		last = atomic_inc(arrived) == groups - 1;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if(!last)
+		return;
+
+	//Every other group has published its partial, combine them
+	volatile __global ACC* partials = scratch;
+	sum = 0;
+	for(size_t g = lid; g < groups; g += local_size)
+		sum += partials[g];
+	local_mem[lid] = sum;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for(size_t size = local_size / 2; size > 0; size /= 2)
+	{
+		if(lid < size)
+			local_mem[lid] += local_mem[lid + size];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if(lid == 0)
+	{
+		scratch[0] = local_mem[0];
+		*arrived = 0;
+	}
+}
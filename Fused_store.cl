@@ -0,0 +1,27 @@
+// Template for a fused expression whose values are stored, on any device.
+// The host puts the expression's INPUT_PARAMS, LOAD_INPUTS and EXPR macros
+// in front of it, and passes ELEM and CALC as -D options.
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#ifndef EXPR_STORE
+#error "This template stores expressions; summed ones use Fused_CPU.cl or Fused_GPU.cl"
+#endif
+
+#define LOAD_ONE(in) ((CALC) in[offset + i])
+
+// Like VectorAdd.cl's compute, over the expression: element offset + i of
+// out gets its value at the same element of the inputs, for i below length.
+// Every input element is loaded once and every output element written once.
+__kernel void compute(INPUT_PARAMS
+			__global ELEM* out,
+			const unsigned long length,
+			const unsigned long offset)
+{
+	size_t i = get_global_id(0);
+	if(i >= length)
+		return;
+	LOAD_INPUTS(CALC, LOAD_ONE)
+	out[offset + i] = (ELEM) EXPR(CALC);
+}
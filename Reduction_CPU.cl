@@ -1,15 +1,60 @@
-__kernel void compute(__global unsigned long* buffer,
-			__global unsigned long* reduction,
+// ELEM is the element type and ACC the type sums are kept in, both passed as
+// -D options by the host
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#define PASTE(a, b) a ## b
+#define CONCAT(a, b) PASTE(a, b)
+#define VEC(type, n) CONCAT(type, n)
+#define CONVERT(type, n) CONCAT(convert_, VEC(type, n))
+
+// Each work item sums a contiguous span of chunk elements of
+// buffer[offset, offset + length) with 16-wide vector loads and writes one
+// partial to reduction[id]. Spans are cache-friendly on a CPU, where every
+// work group runs on one core. A launch of combine with a single work item
+// over the partials then leaves the total in reduction[0].
+__kernel void compute(__global const ELEM* buffer,
+			__global ACC* reduction,
 			const unsigned long length,
-			const unsigned long chunk)
+			const unsigned long chunk,
+			const unsigned long offset)
 {
-	unsigned int tid = get_global_id(0);
-	int start = tid * chunk;
-	int end = start + chunk;
-	int sum = 0;
-	if(end > length)
-		end = length;
-	for(int i = start; i < end; i++)
-		sum += buffer[i];
+	size_t tid = get_global_id(0);
+	__global const ELEM* input = buffer + offset;
+	unsigned long start = tid * chunk;
+	unsigned long end = min(start + chunk, length);
+	unsigned long i = start;
+
+	VEC(ACC, 16) acc = 0;
+	for(; i + 16 <= end; i += 16)
+		acc += CONVERT(ACC, 16)(vload16(0, input + i));
+
+	VEC(ACC, 8) acc8 = acc.lo + acc.hi;
+	VEC(ACC, 4) acc4 = acc8.lo + acc8.hi;
+	VEC(ACC, 2) acc2 = acc4.lo + acc4.hi;
+	ACC sum = acc2.lo + acc2.hi;
+	for(; i < end; i++)
+		sum += input[i];
+
 	reduction[tid] = sum;
-} 
+}
+
+// Same as compute over partials that are already of the sum type
+__kernel void combine(__global const ACC* buffer,
+			__global ACC* reduction,
+			const unsigned long length,
+			const unsigned long chunk,
+			const unsigned long offset)
+{
+	size_t tid = get_global_id(0);
+	__global const ACC* input = buffer + offset;
+	unsigned long start = tid * chunk;
+	unsigned long end = min(start + chunk, length);
+
+	ACC sum = 0;
+	for(unsigned long i = start; i < end; i++)
+		sum += input[i];
+
+	reduction[tid] = sum;
+}
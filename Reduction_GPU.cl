@@ -1,26 +1,66 @@
-__kernel void compute(__global unsigned long* buffer,
-			__global unsigned long* reduction,
+// ELEM is the element type and ACC the type sums are kept in, both passed as
+// -D options by the host. ACC must be at least as wide as the arrival counter.
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+// Grid-stride reduction of buffer[offset, offset + length) in one launch. The
+// grid has a fixed number of work groups whatever the length. Each group
+// leaves its partial in scratch[group]. The last group to arrive adds the
+// partials into scratch[0] and resets the arrival counter that lives in
+// scratch[groups]. The local size must be a power of two.
+__kernel void compute(__global const ELEM* buffer,
+			__global ACC* scratch,
 			const unsigned long length,
-			const unsigned long chunk,
-			__local unsigned long* local_mem)	
+			const unsigned long offset,
+			__local ACC* local_mem)
 {
-	unsigned int tid = get_local_size(0) * get_group_id(0) + get_local_id(0);
-	unsigned int lid = get_local_id(0);
-	local_mem[lid] = 0;
-	if(tid < length)
-		local_mem[lid] = buffer[tid];
-	local_mem[get_local_size(0) + lid] = buffer[tid + get_local_size(0)];
+	__local int last;
+	size_t lid = get_local_id(0);
+	size_t local_size = get_local_size(0);
+	size_t groups = get_num_groups(0);
+	__global const ELEM* input = buffer + offset;
+	volatile __global unsigned int* arrived = (volatile __global unsigned int*) (scratch + groups);
 
+	ACC sum = 0;
+	for(size_t i = get_global_id(0); i < length; i += get_global_size(0))
+		sum += input[i];
+	local_mem[lid] = sum;
 	barrier(CLK_LOCAL_MEM_FENCE);
-	unsigned int size = get_local_size(0);
-	while(size > 0)
+	for(size_t size = local_size / 2; size > 0; size /= 2)
 	{
 		if(lid < size)
 			local_mem[lid] += local_mem[lid + size];
-		size = size / 2;
 		barrier(CLK_LOCAL_MEM_FENCE);
 	}
 
 	if(lid == 0)
-		reduction[get_group_id(0)] = local_mem[0];
-} 
+	{
+		scratch[get_group_id(0)] = local_mem[0];
+		mem_fence(CLK_GLOBAL_MEM_FENCE);
+		last = atomic_inc(arrived) == groups - 1;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if(!last)
+		return;
+
+	//Every other group has published its partial, combine them
+	volatile __global ACC* partials = scratch;
+	sum = 0;
+	for(size_t g = lid; g < groups; g += local_size)
+		sum += partials[g];
+	local_mem[lid] = sum;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for(size_t size = local_size / 2; size > 0; size /= 2)
+	{
+		if(lid < size)
+			local_mem[lid] += local_mem[lid + size];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if(lid == 0)
+	{
+		scratch[0] = local_mem[0];
+		*arrived = 0;
+	}
+}
@@ -1,9 +1,14 @@
-__kernel void compute(__global unsigned char* a,
-			__global unsigned char* b,
-			__global unsigned char* c,
+// ELEM is the element type, passed as a -D option by the host
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+__kernel void compute(__global ELEM* a,
+			__global ELEM* b,
+			__global ELEM* c,
 			const unsigned long length)
 {
-	unsigned int tid = get_global_id(0);
+	size_t tid = get_global_id(0);
 	if(tid < length)
 	{
 		c[tid] = a[tid] + b[tid];
@@ -11,6 +11,21 @@
 #include <CL/opencl.h>
 #endif
 
+#include "dispenser.h"
+#include "model.h"
+#include "pool.h"
+#include "pipeline.h"
+#include "async.h"
+#include "profile.h"
+#include "progcache.h"
+#include "devices.h"
+#include "native.h"
+#include "trace.h"
+#include "rng.h"
+#include "verify.h"
+#include "elem.h"
+#include "stream.h"
+
 #define CHKERR(err, str) \
 	if (err != CL_SUCCESS) \
 	{ \
@@ -32,19 +47,10 @@ struct timespec total_timer2;
 
 //OpenCL Constructs
 const char *KernelSourceFile = "CPUBound.cl";
-cl_platform_id platform_id;
-cl_device_id device_id_gpu;
-cl_device_id device_id_cpu;
-cl_context context_cpu;
-cl_context context_gpu;
-cl_command_queue commands_cpu;
-cl_command_queue commands_gpu;
-cl_program program;
-cl_kernel kernel_compute_cpu;
-cl_kernel kernel_compute_gpu;
-
-cl_event event_gpu;
-cl_event event_cpu;
+struct worker workers[MAX_WORKERS];
+int num_workers = 0;
+int cpu_split = 0;
+enum cpu_backend_t cpu_backend = BACKEND_OPENCL;
 
 //Number of iterations to warmup caches
 const int warmup = 0;
@@ -52,42 +58,74 @@ const int warmup = 0;
 enum scheme_t { CPU_ONLY, GPU_ONLY, CPU_GPU_STATIC, CPU_GPU_DYNAMIC };
 enum scheme_t scheme = CPU_ONLY;
 float ratio = 0.01;
+float shares[MAX_WORKERS];
+int tune_split = 0;
+int auto_scheme = 0;		//Pick the scheme from the calibration profile
+int pipeline_depth = 1;
+enum driver_t driver = DRIVER_ASYNC;
+size_t fixed_chunk = 0;		//0 keeps FIXED_CHUNK_SIZE
+size_t work_group_size = 0;	//0 uses the largest the device allows
+unsigned long seed = DEFAULT_SEED;
+int fresh_data = 0;		//Regenerate the inputs before every iteration
+unsigned long generation = 0;	//Sets of inputs generated so far
+enum verify_mode_t verify_mode = VERIFY_SAMPLE;
+const char* stream_dir = NULL;	//Map the arrays from files here instead of allocating them
 
 //Data
 unsigned long length;
+enum elem_type_t elem_type = ELEM_UINT8;
+size_t elem_size;
 unsigned char* h_a;
 unsigned char* h_b;
 unsigned char* h_c;
-unsigned char* h_check;
-cl_mem dc_a;
-cl_mem dc_b;
-cl_mem dc_c;
-cl_mem dg_a;
-cl_mem dg_b;
-cl_mem dg_c;
+unsigned char* h_check;		//NULL while streaming
+struct stream_file stream_a, stream_b, stream_c;
+unsigned long check_sum;		//verify_checksum of h_check
+unsigned long checksums[MAX_WORKERS];	//Checksums of each device's retired chunks
+float fold_times[MAX_WORKERS];		//Milliseconds each device spent folding them
+struct buffer_pool pool_a[MAX_WORKERS];
+struct buffer_pool pool_b[MAX_WORKERS];
+struct buffer_pool pool_c[MAX_WORKERS];
+
+// Buffers and commands of one in-flight chunk
+struct chunk_slot
+{
+	cl_mem a;
+	cl_mem b;
+	cl_mem c;
+	size_t origin;
+	size_t offset;		//Start of the chunk in the host arrays
+	struct slot_events events;
+};
+struct chunk_slot slots[MAX_WORKERS][MAX_PIPELINE_DEPTH];
 
 
 // Struct for passing arguments to dynamic_scheduler
 struct dynamic_args
 {
-	int isGPU;
+	int dev;
 	float data_time;
 	float exec_time;
+	float chunk_time;
+	float elapsed_time;
 };
 
 //Function Prototypes
-void fillArray(unsigned char* nums, unsigned long length);
-void verify_answer(unsigned char* toCheck, unsigned char* answer, const unsigned int len);
-void serial_vector_add(unsigned char* a, unsigned char* b, unsigned char* c, const unsigned int len);
+void fillArray(unsigned char* nums, const unsigned long length, unsigned long stream);
+void reference_block(size_t first, size_t count, void* out);
+unsigned long verify_answer(unsigned char* toCheck, unsigned char* answer, const unsigned long len);
+void serial_cpu_bound(unsigned char* a, unsigned char* b, unsigned char* c, const unsigned long len);
 
 void test_setup();
 void test_init();
+void test_verify();
 
-void test_chunk_setup(cl_context context, cl_command_queue commands, size_t global_size, size_t offset, int isGPU);
-void test_chunk_kernel(cl_context context, cl_command_queue commands, cl_device_id device, cl_kernel kernel, size_t global_size, size_t offset, int isGPU);
-void test_chunk_cleanup(cl_context context, cl_command_queue commands, size_t global_size, size_t offset, int isGPU);
+void test_chunk_setup(cl_context context, cl_command_queue commands, size_t global_size, size_t offset, int dev, struct chunk_slot* slot);
+void test_chunk_kernel(cl_context context, cl_command_queue commands, cl_device_id device, cl_kernel kernel, size_t global_size, size_t offset, int dev, struct chunk_slot* slot);
+void test_chunk_cleanup(cl_context context, cl_command_queue commands, size_t global_size, size_t offset, int dev, struct chunk_slot* slot);
+void test_chunk_retire(size_t global_size, int dev, struct chunk_slot* slot);
 
-cl_program createProgramFromSource(const char* filename, const cl_context context)
+char* readKernelSource(const char* filename)
 {
 	FILE* kernelFile = NULL;
 	kernelFile = fopen(filename, "r");
@@ -103,33 +141,29 @@ cl_program createProgramFromSource(const char* filename, const cl_context contex
 	}
 	kernelSource[kernelLength] = 0;
 	fclose(kernelFile);
-	
-	// Create the compute program from the source buffer
-	int err;
-	program = clCreateProgramWithSource(context, 1, (const char **) &kernelSource, NULL, &err);
-	CHKERR(err, "Failed to create a compute program!");
 
-	free(kernelSource);
-	
-	return program;
+	return kernelSource;
 }
 
 cl_kernel create_kernel(const char* filename, const char* kernel, const cl_context context, const cl_device_id device)
 {
 	cl_kernel kernel_compute;
-	// Create a command queue
-	cl_program program = createProgramFromSource(filename, context);
+	char* kernelSource = readKernelSource(filename);
 
-	// Build the program executable
-	int err = clBuildProgram(program, 1, &device, "-cl-opt-disable", NULL, NULL);
-//	int err = clBuildProgram(program, 1, &device, NULL, NULL, NULL);
+	// Build the program executable, reusing a cached binary when possible
+	int err;
+	char options[256];
+	snprintf(options, sizeof(options), "-cl-opt-disable %s", elem_info(elem_type)->options);
+	cl_program program = build_cached_program(context, device, kernelSource, options, &err);
+//	cl_program program = build_cached_program(context, device, kernelSource, elem_info(elem_type)->options, &err);
+	free(kernelSource);
 	if (err == CL_BUILD_PROGRAM_FAILURE)
 	{
 		char *log;
 		size_t logLen;
-		err = clGetProgramBuildInfo(program, device_id_gpu, CL_PROGRAM_BUILD_LOG, 0, NULL, &logLen);
+		err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &logLen);
 		log = (char *) malloc(sizeof(char)*logLen);
-		err = clGetProgramBuildInfo(program, device_id_gpu, CL_PROGRAM_BUILD_LOG, logLen, (void *) log, NULL);
+		err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logLen, (void *) log, NULL);
 		fprintf(stdout, "CL Error %d: Failed to build program! Log:\n%s", err, log);
 		free(log);
 		exit(1);
@@ -145,68 +179,71 @@ cl_kernel create_kernel(const char* filename, const char* kernel, const cl_conte
 
 void setupGPU()
 {
-	// Retrieve an OpenCL platform
-	cl_uint num_platforms = 0;
 	int err = 0;
-	err = clGetPlatformIDs(0, NULL, &num_platforms);
+	cl_device_type type = CL_DEVICE_TYPE_ALL;
+	if(scheme == CPU_ONLY)
+		type = CL_DEVICE_TYPE_CPU;
+	else if(scheme == GPU_ONLY)
+		type = CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_ACCELERATOR;
 
-	cl_platform_id* platform_ids = (cl_platform_id*)(malloc(sizeof(cl_platform_id) * num_platforms));
+	//The native backend takes the CPU's place, or joins it with "both"
+	int use_native = scheme != GPU_ONLY && cpu_backend != BACKEND_OPENCL;
+	if(use_native && cpu_backend == BACKEND_NATIVE)
+		type = scheme == CPU_ONLY ? 0 : CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_ACCELERATOR;
 
-	err = clGetPlatformIDs(num_platforms, platform_ids, NULL);
-	CHKERR(err, "Failed to get a platform!");
-	
-	// Connect to a compute device
-	int i = 0;
-	for(i = 0; i < num_platforms; i++)
+	// One worker per device on every platform
+	num_workers = type ? enumerate_workers(workers, MAX_WORKERS, type, cpu_split) : 0;
+	if(use_native)
 	{
-		cl_device_id device_id;
-		err = clGetDeviceIDs(platform_ids[i], CL_DEVICE_TYPE_CPU, 1, &device_id, NULL);
-		if(err != CL_DEVICE_NOT_FOUND) 
-		{
-			CHKERR(err, "Failed to create a device group!");
-			device_id_cpu = device_id;
-		}
-		
-		err = clGetDeviceIDs(platform_ids[i], CL_DEVICE_TYPE_GPU, 1, &device_id, NULL);
-		if(err != CL_DEVICE_NOT_FOUND) 
-		{
-			CHKERR(err, "Failed to create a device group!");
-			device_id_gpu = device_id;	
-		}
+		num_workers = add_native_worker(workers, num_workers, MAX_WORKERS);
+		native_init(0);
 	}
-	free(platform_ids);	
-
-
-	if(scheme != GPU_ONLY)
+	if(num_workers == 0)
 	{
-		context_cpu = clCreateContext(NULL, 1, &device_id_cpu, NULL, NULL, &err);
-		CHKERR(err, "Failed to create a compute context!");
-		commands_cpu = clCreateCommandQueue(context_cpu, device_id_cpu, 0, &err);
-		CHKERR(err, "Failed to create a command queue!");
-		kernel_compute_cpu = create_kernel(KernelSourceFile, "compute", context_cpu, device_id_cpu);
+		fprintf(stderr, "Error: no OpenCL device found for this scheme\n");
+		exit(1);
 	}
 
-	if(scheme != CPU_ONLY)
+	int i;
+	for(i = 0; i < num_workers; i++)
 	{
-		context_gpu = clCreateContext(NULL, 1, &device_id_gpu, NULL, NULL, &err);
+		struct worker* w = &workers[i];
+		char track[32];
+		snprintf(track, sizeof(track), "scheduler %s", w->name);
+		trace_track(TRACE_HOST, i, track);
+		if(w->native)
+		{
+			fprintf(stderr, "worker %s: native %s, %d threads\n", w->name, native_isa_name(), native_threads());
+			continue;
+		}
+		trace_track(TRACE_DEVICE, i, w->name);
+		w->context = clCreateContext(NULL, 1, &w->device, NULL, NULL, &err);
 		CHKERR(err, "Failed to create a compute context!");
-		commands_gpu = clCreateCommandQueue(context_gpu, device_id_gpu, 0, &err);
+		w->commands = clCreateCommandQueue(w->context, w->device, CL_QUEUE_PROFILING_ENABLE, &err);
 		CHKERR(err, "Failed to create a command queue!");
-		kernel_compute_gpu = create_kernel(KernelSourceFile, "compute", context_gpu, device_id_gpu);
-	}
+		if(pipeline_depth > 1)
+		{
+			w->upload = clCreateCommandQueue(w->context, w->device, CL_QUEUE_PROFILING_ENABLE, &err);
+			CHKERR(err, "Failed to create an upload queue!");
+			w->download = clCreateCommandQueue(w->context, w->device, CL_QUEUE_PROFILING_ENABLE, &err);
+			CHKERR(err, "Failed to create a download queue!");
+		}
+		w->kernel = create_kernel(KernelSourceFile, "compute", w->context, w->device);
 
+		char name[256];
+		clGetDeviceInfo(w->device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+		fprintf(stderr, "worker %s: %s%s\n", w->name, name, w->subdevice ? " (sub-device)" : "");
+	}
 }
 
-long long t_length;
-size_t t_offset;
-pthread_mutex_t mutex;
+enum chunk_mode_t chunk_mode = CHUNK_FIXED;
+struct dispenser dispenser;
 
 
 void* dynamic_scheduler(void* argv)
 {
 	struct dynamic_args* args = argv;
-	int isGPU = args->isGPU;
-	size_t local_size;
+	int dev = args->dev;
 	struct timespec time_start, time_end;
 	
 	cl_device_id device;
@@ -214,316 +251,969 @@ void* dynamic_scheduler(void* argv)
 	cl_kernel kernel;
 	cl_command_queue commands;	
 
-	device = isGPU ? device_id_gpu : device_id_cpu;
-	context = isGPU ? context_gpu : context_cpu;
-	kernel = isGPU ? kernel_compute_gpu : kernel_compute_cpu;
-	commands = isGPU ? commands_gpu : commands_cpu;
-
-	clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &local_size, NULL);
+	device = workers[dev].device;
+	context = workers[dev].context;
+	kernel = workers[dev].kernel;
+	commands = workers[dev].commands;
+	struct chunk_slot* slot = &slots[dev][0];
 
 	size_t offset = 0;
-	size_t global_size = 1024 * 80;
-	while(1)
+	size_t global_size;
+	while((global_size = dispenser_claim(&dispenser, dev, &offset)) > 0)
 	{
-		pthread_mutex_lock(&mutex);		
-		if(t_length <= 0)
-		{
-			pthread_mutex_unlock(&mutex);
-			return NULL;
-		}
-		offset = t_offset;
-		t_length -= global_size;
-		t_offset += global_size;
-		pthread_mutex_unlock(&mutex);
-	
-		global_size = global_size + offset > length ? length - offset : global_size;
-
-
 		clock_gettime(CLOCK_REALTIME, &time_start);
-		test_chunk_setup(context, commands, global_size, offset, isGPU);
-		clFinish(commands);
+		test_chunk_setup(context, commands, global_size, offset, dev, slot);
+		worker_finish(&workers[dev]);
 		clock_gettime(CLOCK_REALTIME, &time_end);
 		args->data_time += (time_end.tv_sec - time_start.tv_sec) * 1000.0f + (time_end.tv_nsec - time_start.tv_nsec) / 1000000.0f;
+		trace_span(dev, "setup", &time_start, &time_end);
 
 		clock_gettime(CLOCK_REALTIME, &time_start);
-		test_chunk_kernel(context, commands, device, kernel, global_size, offset, isGPU);
-		clFinish(commands);
+		test_chunk_kernel(context, commands, device, kernel, global_size, offset, dev, slot);
+		worker_finish(&workers[dev]);
 		clock_gettime(CLOCK_REALTIME, &time_end);
 		args->exec_time += (time_end.tv_sec - time_start.tv_sec) * 1000.0f + (time_end.tv_nsec - time_start.tv_nsec) / 1000000.0f;
+		trace_span(dev, "kernel", &time_start, &time_end);
 
 		clock_gettime(CLOCK_REALTIME, &time_start);
-		test_chunk_cleanup(context, commands, global_size, offset, isGPU);
-		clFinish(commands);
+		test_chunk_cleanup(context, commands, global_size, offset, dev, slot);
+		worker_finish(&workers[dev]);
+		test_chunk_retire(global_size, dev, slot);
 		clock_gettime(CLOCK_REALTIME, &time_end);
 		args->data_time += (time_end.tv_sec - time_start.tv_sec) * 1000.0f + (time_end.tv_nsec - time_start.tv_nsec) / 1000000.0f;
+		trace_span(dev, "cleanup", &time_start, &time_end);
+	}
+	return NULL;
+}
+
+// Keep pipeline_depth chunks in flight on a device. Uploads, kernels and
+// readbacks go to separate queues and are chained with events, so the
+// transfers of one chunk overlap the kernels of its neighbours.
+void* pipelined_scheduler(void* argv)
+{
+	struct dynamic_args* args = argv;
+	int dev = args->dev;
+	struct timespec time_start, time_end;
+
+	cl_device_id device = workers[dev].device;
+	cl_context context = workers[dev].context;
+	cl_kernel kernel = workers[dev].kernel;
+	cl_command_queue commands = workers[dev].commands;
+	cl_command_queue upload = workers[dev].upload;
+	cl_command_queue download = workers[dev].download;
+	struct chunk_slot* ring = slots[dev];
+	size_t sizes[MAX_PIPELINE_DEPTH] = {0};
+
+	clock_gettime(CLOCK_REALTIME, &time_start);
+	size_t offset = 0;
+	int next = 0;
+	int i;
+	while(1)
+	{
+		struct chunk_slot* slot = &ring[next];
+		if(sizes[next] > 0)
+		{
+			struct timespec wait_start, wait_end;
+			clock_gettime(CLOCK_REALTIME, &wait_start);
+			clWaitForEvents(1, &slot->events.last);
+			clock_gettime(CLOCK_REALTIME, &wait_end);
+			trace_span(dev, "wait", &wait_start, &wait_end);
+			args->chunk_time += slot_latency(&slot->events);
+			test_chunk_retire(sizes[next], dev, slot);
+			sizes[next] = 0;
+		}
+
+		size_t global_size = dispenser_claim(&dispenser, dev, &offset);
+		if(global_size == 0)
+			break;
+
+		test_chunk_setup(context, upload, global_size, offset, dev, slot);
+		test_chunk_kernel(context, commands, device, kernel, global_size, offset, dev, slot);
+		test_chunk_cleanup(context, download, global_size, offset, dev, slot);
+		clFlush(upload);
+		clFlush(commands);
+		clFlush(download);
+		sizes[next] = global_size;
+		next = (next + 1) % pipeline_depth;
+	}
+
+	//Drain the chunks still in flight
+	for(i = 0; i < pipeline_depth; i++)
+	{
+		if(sizes[i] == 0)
+			continue;
+		clWaitForEvents(1, &ring[i].events.last);
+		args->chunk_time += slot_latency(&ring[i].events);
+		test_chunk_retire(sizes[i], dev, &ring[i]);
+	}
+	clock_gettime(CLOCK_REALTIME, &time_end);
+	args->elapsed_time = (time_end.tv_sec - time_start.tv_sec) * 1000.0f + (time_end.tv_nsec - time_start.tv_nsec) / 1000000.0f;
+	return NULL;
+}
+
+// Claim the next chunk of dev for its pipeline slot i, enqueue it and watch
+// its last command. Returns the chunk's size, 0 once the dispenser is empty.
+size_t async_submit(struct async_loop* loop, struct async_future* future, int dev, int i)
+{
+	struct worker* w = &workers[dev];
+	struct chunk_slot* slot = &slots[dev][i];
+	size_t offset = 0;
+	size_t global_size = dispenser_claim(&dispenser, dev, &offset);
+	if(global_size == 0)
+		return 0;
+
+	//Without a pipeline every command goes to the one queue
+	cl_command_queue upload = pipeline_depth > 1 ? w->upload : w->commands;
+	cl_command_queue download = pipeline_depth > 1 ? w->download : w->commands;
+	test_chunk_setup(w->context, upload, global_size, offset, dev, slot);
+	test_chunk_kernel(w->context, w->commands, w->device, w->kernel, global_size, offset, dev, slot);
+	test_chunk_cleanup(w->context, download, global_size, offset, dev, slot);
+	if(pipeline_depth > 1)
+	{
+		clFlush(upload);
+		clFlush(download);
+	}
+	clFlush(w->commands);
+	async_watch(loop, future, slot->events.last, (void*) (size_t) (dev * MAX_PIPELINE_DEPTH + i));
+	return global_size;
+}
+
+// Drive every OpenCL worker from this one thread. Each keeps pipeline_depth
+// chunks in flight; when the last command of a chunk completes, its callback
+// hands the chunk back here to be retired, and the slot it used is refilled
+// with the worker's next chunk. Only the wait for a completion blocks.
+void async_scheduler(struct dynamic_args* args)
+{
+	struct async_loop loop;
+	struct async_future futures[MAX_WORKERS][MAX_PIPELINE_DEPTH];
+	size_t sizes[MAX_WORKERS][MAX_PIPELINE_DEPTH] = {{0}};
+	struct timespec time_start, time_end;
+	int d, i;
+
+	async_init(&loop);
+	clock_gettime(CLOCK_REALTIME, &time_start);
+	for(d = 0; d < num_workers; d++)
+		for(i = 0; i < pipeline_depth && !workers[d].native; i++)
+			if((sizes[d][i] = async_submit(&loop, &futures[d][i], d, i)) == 0)
+				break;
+
+	struct async_future* future;
+	while((future = async_next(&loop)) != NULL)
+	{
+		d = (size_t) future->tag / MAX_PIPELINE_DEPTH;
+		i = (size_t) future->tag % MAX_PIPELINE_DEPTH;
+		CHKERR(future->status, "A chunk failed!");
+		args[d].chunk_time += slot_latency(&slots[d][i].events);
+		test_chunk_retire(sizes[d][i], d, &slots[d][i]);
+		sizes[d][i] = async_submit(&loop, future, d, i);
+		if(sizes[d][i] == 0)
+		{
+			//The last of the worker's slots to drain sets its time
+			clock_gettime(CLOCK_REALTIME, &time_end);
+			args[d].elapsed_time = (time_end.tv_sec - time_start.tv_sec) * 1000.0f + (time_end.tv_nsec - time_start.tv_nsec) / 1000000.0f;
+		}
+	}
+	async_destroy(&loop);
+}
+
+// Run one chunk on a device, timing its upload, kernel and download apart
+void probe_phases(int dev, size_t size, float* times)
+{
+	struct timespec time_start, time_end;
+	cl_device_id device = workers[dev].device;
+	cl_context context = workers[dev].context;
+	cl_kernel kernel = workers[dev].kernel;
+	cl_command_queue commands = workers[dev].commands;
+	struct chunk_slot* slot = &slots[dev][0];
+
+	clock_gettime(CLOCK_REALTIME, &time_start);
+	test_chunk_setup(context, commands, size, 0, dev, slot);
+	worker_finish(&workers[dev]);
+	clock_gettime(CLOCK_REALTIME, &time_end);
+	times[0] = (time_end.tv_sec - time_start.tv_sec) * 1000.0f + (time_end.tv_nsec - time_start.tv_nsec) / 1000000.0f;
+
+	clock_gettime(CLOCK_REALTIME, &time_start);
+	test_chunk_kernel(context, commands, device, kernel, size, 0, dev, slot);
+	worker_finish(&workers[dev]);
+	clock_gettime(CLOCK_REALTIME, &time_end);
+	times[1] = (time_end.tv_sec - time_start.tv_sec) * 1000.0f + (time_end.tv_nsec - time_start.tv_nsec) / 1000000.0f;
+
+	clock_gettime(CLOCK_REALTIME, &time_start);
+	test_chunk_cleanup(context, commands, size, 0, dev, slot);
+	worker_finish(&workers[dev]);
+	test_chunk_retire(size, dev, slot);
+	clock_gettime(CLOCK_REALTIME, &time_end);
+	times[2] = (time_end.tv_sec - time_start.tv_sec) * 1000.0f + (time_end.tv_nsec - time_start.tv_nsec) / 1000000.0f;
+}
+
+// Run one chunk on a device, timing the transfers and the kernel separately
+void probe_chunk(int dev, size_t size, float* data_time, float* exec_time)
+{
+	float times[3];
+	probe_phases(dev, size, times);
+	*data_time = times[0] + times[2];
+	*exec_time = times[1];
+}
+
+// Measure a device's per-chunk overhead and throughput with a one work group
+// chunk and a full fixed-size chunk, and derive its minimum chunk size.
+void calibrate_chunking(int dev, struct device_chunking* chunking)
+{
+	cl_device_id device = workers[dev].device;
+	size_t local_size = NATIVE_GRANULARITY;
+	if(!workers[dev].native)
+		clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &local_size, NULL);
+
+	size_t large = FIXED_CHUNK_SIZE > length ? length : FIXED_CHUNK_SIZE;
+	size_t small = local_size > large ? large : local_size;
+	float data_small, exec_small, data_large, exec_large;
+
+	//Throw away the first run so one-time driver costs are not counted as overhead
+	probe_chunk(dev, large, &data_large, &exec_large);
+	probe_chunk(dev, small, &data_small, &exec_small);
+	probe_chunk(dev, large, &data_large, &exec_large);
+
+	chunking_from_probes(chunking, small, data_small + exec_small, large, data_large + exec_large, local_size);
+}
+
+// Fit separate transfer and kernel cost lines for a device from two probe sizes
+void tune_device(int dev, size_t small, size_t large, struct device_model* model)
+{
+	float data_small, exec_small, data_large, exec_large;
+
+	//Throw away the first run so one-time driver costs are not counted as overhead
+	probe_chunk(dev, large, &data_large, &exec_large);
+	probe_chunk(dev, small, &data_small, &exec_small);
+	probe_chunk(dev, large, &data_large, &exec_large);
+
+	fit_phase(&model->data, small, data_small, large, data_large);
+	fit_phase(&model->exec, small, exec_small, large, exec_large);
+}
+
+// Probe every device on a slice of the array and pick the static shares at
+// which they are predicted to finish together. Returns the GPUs' total share.
+float tune_shares()
+{
+	struct device_model models[MAX_WORKERS];
+
+	size_t large = length / 8;
+	if(large < FIXED_CHUNK_SIZE)
+		large = FIXED_CHUNK_SIZE > length ? length : FIXED_CHUNK_SIZE;
+	size_t small = large / 8 > 0 ? large / 8 : large;
+
+	int d;
+	for(d = 0; d < num_workers; d++)
+		tune_device(d, small, large, &models[d]);
+
+	solve_static_shares(models, num_workers, length, shares);
+
+	float tuned = 0;
+	fprintf(stderr, "tuned split:");
+	for(d = 0; d < num_workers; d++)
+	{
+		if(workers[d].isGPU)
+			tuned += shares[d];
+		fprintf(stderr, " %s %f (%f ms)", workers[d].name, shares[d], model_time(&models[d], (size_t) (length * shares[d])));
+	}
+	fprintf(stderr, " predicted\n");
+	return tuned;
+}
+
+// Time each phase of a chunk on a device at PROFILE_SIZES sizes, a quarter
+// apart up to eight fixed-size chunks, and fit a line to each phase
+void profile_worker(int dev, struct device_profile* profile)
+{
+	size_t sizes[PROFILE_SIZES];
+	float upload[PROFILE_SIZES], exec[PROFILE_SIZES], download[PROFILE_SIZES];
+	float times[3];
+	size_t large = 8 * FIXED_CHUNK_SIZE;
+	if(large > length)
+		large = length;
+	if(workers[dev].chunking.max_chunk > 0 && large > workers[dev].chunking.max_chunk)
+		large = workers[dev].chunking.max_chunk;
+
+	//Throw away the first run so one-time driver costs are not counted as overhead
+	probe_phases(dev, large, times);
+	int i;
+	for(i = 0; i < PROFILE_SIZES; i++)
+	{
+		sizes[i] = large >> (2 * (PROFILE_SIZES - 1 - i));
+		if(sizes[i] == 0)
+			sizes[i] = 1;
+		probe_phases(dev, sizes[i], times);
+		upload[i] = times[0];
+		exec[i] = times[1];
+		download[i] = times[2];
+	}
+	fit_phase_points(&profile->upload, sizes, upload, PROFILE_SIZES);
+	fit_phase_points(&profile->exec, sizes, exec, PROFILE_SIZES);
+	fit_phase_points(&profile->download, sizes, download, PROFILE_SIZES);
+
+	//Run the largest size twice more to see how far runs spread
+	float fastest = upload[PROFILE_SIZES - 1] + exec[PROFILE_SIZES - 1] + download[PROFILE_SIZES - 1];
+	float slowest = fastest;
+	for(i = 0; i < 2; i++)
+	{
+		probe_phases(dev, large, times);
+		float total = times[0] + times[1] + times[2];
+		if(total < fastest)
+			fastest = total;
+		if(total > slowest)
+			slowest = total;
+	}
+	profile->jitter = fastest > 0 ? (slowest - fastest) / fastest : 0;
+}
+
+// Pick the scheme, split and chunk size for this run from the calibration
+// profile, measuring and saving any worker the profile has nothing on yet.
+// Returns the name of the scheme picked.
+const char* choose_auto_scheme()
+{
+	const char* names[] = { "auto-c", "auto-g", "auto-cg-s", "auto-cg-d" };
+	struct device_profile profiles[MAX_WORKERS];
+	struct scheme_choice choice;
+	const char* path = profile_path();
+	const char* type = elem_info(elem_type)->name;
+	char key[300];
+	int d;
+	for(d = 0; d < num_workers; d++)
+	{
+		profile_key(&workers[d], key, sizeof(key));
+		if(profile_load(path, "VectorAdd+", type, key, &profiles[d]))
+			continue;
+		profile_worker(d, &profiles[d]);
+		profile_save(path, "VectorAdd+", type, key, &profiles[d]);
+		fprintf(stderr, "profiled %s: upload %f ms + %f elements/ms, launch %f ms + %f elements/ms, download %f ms + %f elements/ms, %f%% jitter\n",
+			workers[d].name, profiles[d].upload.overhead, profiles[d].upload.rate, profiles[d].exec.overhead, profiles[d].exec.rate,
+			profiles[d].download.overhead, profiles[d].download.rate, profiles[d].jitter * 100);
+	}
+
+	choose_scheme(workers, profiles, num_workers, length, FIXED_CHUNK_SIZE / 8, &choice);
+	//Streamed arrays only fit through the dynamic scheme's chunks
+	if(stream_dir)
+		choice.scheme = 3;
+	fprintf(stderr, "auto: c %f ms, g %f ms, cg-s %f ms, cg-d %f ms with %lu-element chunks predicted, picked %s\n",
+		choice.predicted[0], choice.predicted[1], choice.predicted[2], choice.predicted[3], choice.chunk, names[choice.scheme]);
+
+	ratio = 0;
+	if(choice.scheme == 3)
+	{
+		scheme = CPU_GPU_DYNAMIC;
+		chunk_mode = CHUNK_FIXED;
+		if(fixed_chunk == 0)
+			fixed_chunk = choice.chunk;
+		return names[choice.scheme];
+	}
+	//CPUs or GPUs only is a static split that gives the others nothing
+	scheme = CPU_GPU_STATIC;
+	for(d = 0; d < num_workers; d++)
+	{
+		shares[d] = choice.shares[d];
+		if(workers[d].isGPU)
+			ratio += shares[d];
+	}
+	return names[choice.scheme];
+}
+
+// Allocate each device's chunk buffers once and carve one slot per
+// in-flight chunk out of them
+void pool_setup()
+{
+	int d, i;
+	for(d = 0; d < num_workers; d++)
+	{
+		struct worker* w = &workers[d];
+		if(w->native)
+		{
+			if(stream_dir)
+				w->chunking.max_chunk = STREAM_POOL_SIZE / elem_size;
+			continue;
+		}
+		//Streamed arrays are never wrapped, as the driver could pin them whole
+		size_t bytes = elem_size * length;
+		if(stream_dir && bytes > STREAM_POOL_SIZE)
+			bytes = STREAM_POOL_SIZE;
+		int wrapped = !stream_dir && pool_wrap(&pool_a[d], w->context, w->device, CL_MEM_READ_ONLY, h_a, elem_size * length)
+			&& pool_wrap(&pool_b[d], w->context, w->device, CL_MEM_READ_ONLY, h_b, elem_size * length)
+			&& pool_wrap(&pool_c[d], w->context, w->device, CL_MEM_WRITE_ONLY, h_c, elem_size * length);
+		if(!wrapped)
+		{
+			pool_release(&pool_a[d]);
+			pool_release(&pool_b[d]);
+			pool_release(&pool_c[d]);
+			pool_create(&pool_a[d], w->context, w->device, CL_MEM_READ_ONLY, bytes);
+			pool_create(&pool_b[d], w->context, w->device, CL_MEM_READ_ONLY, bytes);
+			pool_create(&pool_c[d], w->context, w->device, CL_MEM_WRITE_ONLY, bytes);
+		}
+
+		size_t slot_size = pool_slot_size(&pool_a[d], pipeline_depth);
+		if(pool_slot_size(&pool_b[d], pipeline_depth) < slot_size)
+			slot_size = pool_slot_size(&pool_b[d], pipeline_depth);
+		if(pool_slot_size(&pool_c[d], pipeline_depth) < slot_size)
+			slot_size = pool_slot_size(&pool_c[d], pipeline_depth);
+		for(i = 0; i < pipeline_depth; i++)
+		{
+			slots[d][i].origin = i * slot_size;
+			slots[d][i].events.track = d;
+		}
+		if((pipeline_depth > 1 || stream_dir) && !wrapped)
+			w->chunking.max_chunk = slot_size / elem_size;
+	}
+}
+
+void pool_teardown()
+{
+	int d;
+	for(d = 0; d < num_workers; d++)
+	{
+		pool_release(&pool_a[d]);
+		pool_release(&pool_b[d]);
+		pool_release(&pool_c[d]);
 	}
 }
 
 void test_setup()
 {
-	fillArray(h_a, length);
-	fillArray(h_b, length);
-	serial_vector_add(h_a, h_b, h_check, length);
+	//Every set of inputs takes the next two streams of the seed. Streamed
+	//inputs read from existing files are kept as they are.
+	if(!stream_dir || stream_a.created)
+		fillArray(h_a, length, 2 * generation);
+	if(!stream_dir || stream_b.created)
+		fillArray(h_b, length, 2 * generation + 1);
+	generation++;
+	if(stream_dir)
+	{
+		//There is no room for a copy of the answer, so checks make it a
+		//block at a time from the inputs
+		if(verify_mode == VERIFY_CHECKSUM)
+			check_sum = verify_checksum_reference(reference_block, length, elem_size);
+		return;
+	}
+	serial_cpu_bound(h_a, h_b, h_check, length);
+	if(verify_mode == VERIFY_CHECKSUM)
+		check_sum = verify_checksum(h_check, length, elem_size, 0);
 }
 
 void test_init()
 {
+	memset(checksums, 0, sizeof(checksums));
+	memset(fold_times, 0, sizeof(fold_times));
+
+	//Hand the freshly filled inputs to zero-copy devices; nothing is copied
+	int d;
+	for(d = 0; d < num_workers; d++)
+	{
+		pool_publish(&pool_a[d], workers[d].commands);
+		pool_publish(&pool_b[d], workers[d].commands);
+	}
 }
 
-void test_chunk_setup(cl_context context, cl_command_queue queue, size_t size, size_t offset, int isGPU)
+void test_chunk_setup(cl_context context, cl_command_queue queue, size_t size, size_t offset, int dev, struct chunk_slot* slot)
 {
 	if(size == 0)
 		return;
-	cl_mem* d_a = isGPU ? &dg_a : &dc_a;
-	cl_mem* d_b = isGPU ? &dg_b : &dc_b;
-	cl_mem* d_c = isGPU ? &dg_c : &dc_c;
-	cl_mem_flags a_flags = CL_MEM_READ_ONLY;
-	cl_mem_flags b_flags = CL_MEM_READ_ONLY;
-	cl_mem_flags c_flags = CL_MEM_WRITE_ONLY;
-	void* a_mem = NULL;
-	void* b_mem = NULL;
-	void* c_mem = NULL;
-
-	if(!isGPU)
-	{
-		a_flags |= CL_MEM_USE_HOST_PTR;
-		b_flags |= CL_MEM_USE_HOST_PTR;
-		c_flags |= CL_MEM_USE_HOST_PTR;
-		a_mem = h_a;
-		b_mem = h_b;
-		c_mem = h_c + offset;
+	slot->offset = offset;
+	if(stream_dir)
+	{
+		//Start reading this chunk and the next one of the same size
+		stream_prefetch(&stream_a, elem_size * offset, 2 * elem_size * size);
+		stream_prefetch(&stream_b, elem_size * offset, 2 * elem_size * size);
 	}
+	//Native workers read and write the host arrays directly
+	if(workers[dev].native)
+		return;
+	struct buffer_pool* p_a = &pool_a[dev];
+	struct buffer_pool* p_b = &pool_b[dev];
+	struct buffer_pool* p_c = &pool_c[dev];
 
-	int err;
-	*d_a = clCreateBuffer(context, a_flags, sizeof(*h_a) * size, a_mem, &err);
-	*d_b = clCreateBuffer(context, b_flags, sizeof(*h_b) * size, b_mem, &err);
-	*d_c = clCreateBuffer(context, c_flags, sizeof(*h_c) * size, c_mem, &err);
-	CHKERR(err, "Failed to create chunk buffers!");
+	if(p_c->host)
+	{
+		//Zero-copy: the kernel reads and writes the host arrays in place
+		slot->a = pool_whole(p_a);
+		slot->b = pool_whole(p_b);
+		slot->c = pool_whole(p_c);
+		return;
+	}
+
+	slot->a = pool_view(p_a, slot->origin, elem_size * size);
+	slot->b = pool_view(p_b, slot->origin, elem_size * size);
+	slot->c = pool_view(p_c, slot->origin, elem_size * size);
 
-	err = clEnqueueWriteBuffer(queue, *d_a, CL_FALSE, 0, sizeof(*h_a) * size, h_a + offset, 0, NULL, NULL);
+	const cl_event* wait;
+	cl_uint num_wait = slot_wait_list(&slot->events, &wait);
+	cl_event event;
+	int err;
+	err = clEnqueueWriteBuffer(queue, slot->a, CL_FALSE, 0, elem_size * size, h_a + elem_size * offset, num_wait, wait, &event);
 	CHKERR(err, "Failed to write chunk buffer A!");
-	err = clEnqueueWriteBuffer(queue, *d_b, CL_FALSE, 0, sizeof(*h_b) * size, h_b + offset, 0, NULL, NULL);
+	slot_chain(&slot->events, event);
+	err = clEnqueueWriteBuffer(queue, slot->b, CL_FALSE, 0, elem_size * size, h_b + elem_size * offset, 0, NULL, &event);
 	CHKERR(err, "Failed to write chunk buffer B!");
+	slot_chain(&slot->events, event);
 }
 
-void test_chunk_kernel(cl_context context, cl_command_queue queue, cl_device_id device, cl_kernel kernel, size_t size, size_t offset, int isGPU)
+void test_chunk_kernel(cl_context context, cl_command_queue queue, cl_device_id device, cl_kernel kernel, size_t size, size_t offset, int dev, struct chunk_slot* slot)
 {
 	if(size == 0)
 		return;
-	cl_mem* d_a = isGPU ? &dg_a : &dc_a;
-	cl_mem* d_b = isGPU ? &dg_b : &dc_b;
-	cl_mem* d_c = isGPU ? &dg_c : &dc_c;
-
-	cl_event* event = isGPU ? &event_gpu : &event_cpu;
+	if(workers[dev].native)
+	{
+		native_cpu_bound(h_a + elem_size * offset, h_b + elem_size * offset, h_c + elem_size * offset, size, elem_type);
+		return;
+	}
+	struct buffer_pool* p_c = &pool_c[dev];
 
 	size_t local_size;
 	clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &local_size, NULL);
+	if(work_group_size > 0 && work_group_size < local_size)
+		local_size = work_group_size;
 
-	int err = clSetKernelArg(kernel, 0, sizeof(cl_mem), d_a);
-	err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), d_b);
-	err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), d_c);
-	err |= clSetKernelArg(kernel, 3, sizeof(size_t), &size);
+	//Zero-copy buffers span the whole array, so shift the work items to the chunk
+	size_t global_offset = p_c->host ? offset : 0;
+	size_t end = global_offset + size;
+
+	int err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &slot->a);
+	err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &slot->b);
+	err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &slot->c);
+	err |= clSetKernelArg(kernel, 3, sizeof(size_t), &end);
 	CHKERR(err, "Errors setting kernel arguments");
 
+	const cl_event* wait;
+	cl_uint num_wait = slot_wait_list(&slot->events, &wait);
+	cl_event event;
 	size_t global_size = (size / local_size) * local_size + (size % local_size == 0 ? 0 : local_size);
-	err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global_size, &local_size, 0, NULL, event);
+	err = clEnqueueNDRangeKernel(queue, kernel, 1, &global_offset, &global_size, &local_size, num_wait, wait, &event);
 	CHKERR(err, "Failed to run kernel!");
+	slot_chain(&slot->events, event);
 }
 
-void test_chunk_cleanup(cl_context context, cl_command_queue queue, size_t size, size_t offset, int isGPU)
+void test_chunk_cleanup(cl_context context, cl_command_queue queue, size_t size, size_t offset, int dev, struct chunk_slot* slot)
 {
-	if(size == 0)
+	if(size == 0 || workers[dev].native)
 		return;
-	cl_mem* d_a = isGPU ? &dg_a : &dc_a;
-	cl_mem* d_b = isGPU ? &dg_b : &dc_b;
-	cl_mem* d_c = isGPU ? &dg_c : &dc_c;
+	struct buffer_pool* p_c = &pool_c[dev];
 
-	int err = clEnqueueReadBuffer(queue, *d_c, CL_TRUE, 0, sizeof(*h_c) * size, h_c + offset, 0, NULL, NULL);
+	const cl_event* wait;
+	cl_uint num_wait = slot_wait_list(&slot->events, &wait);
+	cl_event event;
+	int err;
+	if(p_c->host)
+	{
+		//Map and unmap the chunk so the host sees the kernel's writes in h_c
+		void* mapped = clEnqueueMapBuffer(queue, slot->c, CL_FALSE, CL_MAP_READ, elem_size * offset, elem_size * size, num_wait, wait, &event, &err);
+		CHKERR(err, "Failed to map chunk buffer C!");
+		slot_chain(&slot->events, event);
+		err = clEnqueueUnmapMemObject(queue, slot->c, mapped, 0, NULL, &event);
+		CHKERR(err, "Failed to unmap chunk buffer C!");
+		slot_chain(&slot->events, event);
+		return;
+	}
+
+	err = clEnqueueReadBuffer(queue, slot->c, CL_FALSE, 0, elem_size * size, h_c + elem_size * offset, num_wait, wait, &event);
 	CHKERR(err, "Failed to write chunk buffer C!");
-	
-	clReleaseMemObject(*d_a);
-	clReleaseMemObject(*d_b);
-	clReleaseMemObject(*d_c);
+	slot_chain(&slot->events, event);
+}
+
+// Called once every command of the chunk has completed
+void test_chunk_retire(size_t size, int dev, struct chunk_slot* slot)
+{
+	if(size == 0)
+		return;
+	//Fold the finished chunk into its device's checksum while it is hot in cache
+	//and report the time it takes with the rest of verifying
+	if(verify_mode == VERIFY_CHECKSUM)
+	{
+		struct timespec start, end;
+		clock_gettime(CLOCK_REALTIME, &start);
+		checksums[dev] += verify_checksum(h_c + elem_size * slot->offset, size, elem_size, slot->offset);
+		clock_gettime(CLOCK_REALTIME, &end);
+		fold_times[dev] += (end.tv_sec - start.tv_sec) * 1000.0f + (end.tv_nsec - start.tv_nsec) / 1000000.0f;
+	}
+	//Let go of the chunk's pages so the arrays never have to fit in memory
+	if(stream_dir)
+	{
+		stream_release(&stream_a, elem_size * slot->offset, elem_size * size);
+		stream_release(&stream_b, elem_size * slot->offset, elem_size * size);
+		stream_release(&stream_c, elem_size * slot->offset, elem_size * size);
+	}
+	if(workers[dev].native)
+		return;
+	clReleaseMemObject(slot->a);
+	clReleaseMemObject(slot->b);
+	clReleaseMemObject(slot->c);
+	slot_reset(&slot->events);
 }
 
 void test_cleanup()
 {
-	//verify_answer(h_c, h_check, length);
+	//Checking is finished by test_verify, outside the timed region; only
+	//VERIFY=checksum folds chunks inside it, and reports that time as verifying
+}
+
+// Check h_c against h_check the way VERIFY asks and report what it cost. A
+// checksum that does not match falls back to a full compare to find the
+// wrong elements. The checksum's cost includes folding the chunks as they
+// retired, which happened inside the timed region.
+void test_verify()
+{
+	if(verify_mode == VERIFY_NONE)
+		return;
+	struct timespec start, end;
+	clock_gettime(CLOCK_REALTIME, &start);
+	unsigned long mismatches;
+	float folding = 0;
+	if(verify_mode == VERIFY_CHECKSUM)
+	{
+		unsigned long sum = 0;
+		int d;
+		for(d = 0; d < num_workers; d++)
+		{
+			sum += checksums[d];
+			folding += fold_times[d];
+		}
+		mismatches = sum != check_sum ? verify_answer(h_c, h_check, length) : 0;
+	}
+	else if(verify_mode == VERIFY_SAMPLE && stream_dir)
+		mismatches = verify_sample_reference(h_c, reference_block, length, elem_size, seed + generation);
+	else if(verify_mode == VERIFY_SAMPLE)
+		mismatches = verify_sample(h_c, h_check, length, elem_size, seed + generation);
+	else
+		mismatches = verify_answer(h_c, h_check, length);
+	clock_gettime(CLOCK_REALTIME, &end);
+	fprintf(stderr, "verify %s: %s (%lu mismatches), %f ms\n", verify_mode_name(verify_mode), mismatches ? "FAILED" : "ok", mismatches,
+		folding + (end.tv_sec - start.tv_sec) * 1000.0f + (end.tv_nsec - start.tv_nsec) / 1000000.0f);
+}
+
+// Average number of chunks a pipelined device had in flight
+float pipeline_concurrency(const struct dynamic_args* args)
+{
+	return args->elapsed_time > 0 ? args->chunk_time / args->elapsed_time : 0;
+}
+
+// Fraction of the summed chunk latencies hidden behind other chunks
+float pipeline_overlap(const struct dynamic_args* args)
+{
+	if(args->chunk_time <= 0 || args->elapsed_time >= args->chunk_time)
+		return 0;
+	return 1 - args->elapsed_time / args->chunk_time;
 }
 
 void run_test(float* data_time, float* exec_time, float* total_time)
 {
-	test_setup();
 	TOTAL_TIMER_START;
 	TIMER_START;
 	test_init();	
 	TIMER_END;
+	trace_span(TRACE_MAIN, "init", &timer1, &timer2);
 	*data_time += MILLISECONDS;
-	if(scheme == GPU_ONLY)
+	int d;
+	if(scheme == CPU_GPU_DYNAMIC)
 	{
-		TIMER_START;
-		test_chunk_setup(context_gpu, commands_gpu, length, 0, 1);
-		clFinish(commands_gpu);
-		TIMER_END;
-		*data_time += MILLISECONDS;
-		
-		TIMER_START;
-		test_chunk_kernel(context_gpu, commands_gpu, device_id_gpu, kernel_compute_gpu, length, 0, 1);
-		clFinish(commands_gpu);
-		TIMER_END;
-		*exec_time += MILLISECONDS;
-		
-		TIMER_START;
-		test_chunk_cleanup(context_gpu, commands_gpu, length, 0, 1);
-		clFinish(commands_gpu);
-		TIMER_END;
-		*data_time += MILLISECONDS;
-	}
-	else if(scheme == CPU_ONLY)
-	{
-		TIMER_START;
-		test_chunk_setup(context_cpu, commands_cpu, length, 0, 0);
-		clFinish(commands_cpu);
-		TIMER_END;
-		*data_time += MILLISECONDS;
-		
-		TIMER_START;
-		test_chunk_kernel(context_cpu, commands_cpu, device_id_cpu, kernel_compute_cpu, length, 0, 0);
-		clFinish(commands_cpu);
-		TIMER_END;
-		*exec_time += MILLISECONDS;
+		pthread_t threads[MAX_WORKERS];
+		int rc;
+		void* status;
+		struct dynamic_args args[MAX_WORKERS];
+		struct device_chunking devices[MAX_WORKERS];
+		for(d = 0; d < num_workers; d++)
+		{
+			memset(&args[d], 0, sizeof(args[d]));
+			args[d].dev = d;
+			devices[d] = workers[d].chunking;
+		}
+		dispenser_init(&dispenser, chunk_mode, length, devices, num_workers);
+		if(fixed_chunk > 0)
+			dispenser.chunk = fixed_chunk;
 		
 		TIMER_START;
-		test_chunk_cleanup(context_cpu, commands_cpu, length, 0, 0);
-		clFinish(commands_cpu);
+		//Native chunks run synchronously, so there is nothing to pipeline and
+		//each native worker needs a thread. OpenCL workers share this one
+		//unless DRIVER=threads.
+		for(d = 0; d < num_workers; d++)
+		{
+			if(driver == DRIVER_ASYNC && !workers[d].native)
+				continue;
+			void* (*scheduler)(void*) = pipeline_depth > 1 && !workers[d].native ? pipelined_scheduler : dynamic_scheduler;
+			rc = pthread_create(&threads[d], NULL, scheduler, &args[d]);
+		}
+		if(driver == DRIVER_ASYNC)
+			async_scheduler(args);
+		for(d = 0; d < num_workers; d++)
+			if(driver == DRIVER_THREADS || workers[d].native)
+				rc = pthread_join(threads[d], &status); 
 		TIMER_END;
-		*data_time += MILLISECONDS;
+		trace_span(TRACE_MAIN, "schedule", &timer1, &timer2);
+		dispenser_destroy(&dispenser);
+
+		if(pipeline_depth > 1)
+		{
+			fprintf(stderr, "pipeline depth %d:", pipeline_depth);
+			for(d = 0; d < num_workers; d++)
+				if(!workers[d].native)
+					fprintf(stderr, " %s %f chunks in flight (%f%% overlap)", workers[d].name,
+					pipeline_concurrency(&args[d]), pipeline_overlap(&args[d]) * 100);
+			fprintf(stderr, "\n");
+		}
+
+		*data_time = MILLISECONDS;
 	}
-	else if(scheme == CPU_GPU_STATIC)
+	else
 	{
-		size_t gpu_size = length * ratio;
+		//CPU_ONLY and GPU_ONLY are a static split over the devices of one type
+		size_t sizes[MAX_WORKERS];
+		size_t offsets[MAX_WORKERS];
+		split_by_shares(shares, num_workers, length, sizes, offsets);
+
 		TIMER_START;
-		test_chunk_setup(context_cpu, commands_cpu, length - gpu_size, 0, 0);
-		test_chunk_setup(context_gpu, commands_gpu, gpu_size, length - gpu_size, 1);
-		clFinish(commands_cpu);
-		clFinish(commands_gpu);
+		for(d = 0; d < num_workers; d++)
+			test_chunk_setup(workers[d].context, workers[d].commands, sizes[d], offsets[d], d, &slots[d][0]);
+		for(d = 0; d < num_workers; d++)
+			worker_finish(&workers[d]);
 		TIMER_END;
+		trace_span(TRACE_MAIN, "setup", &timer1, &timer2);
 		*data_time += MILLISECONDS;
 	
 		TIMER_START;
-		test_chunk_kernel(context_gpu, commands_gpu, device_id_gpu, kernel_compute_gpu, gpu_size, length - gpu_size, 1);
-		test_chunk_kernel(context_cpu, commands_cpu, device_id_cpu, kernel_compute_cpu, length - gpu_size, 0, 0);
-		clFlush(commands_gpu);
-		clFlush(commands_cpu);
-		cl_event events[2] = {event_cpu, event_gpu};
-		clEnqueueWaitForEvents(commands_cpu, 2, events);
-		clFinish(commands_cpu);
-		clFinish(commands_gpu);
+		for(d = 0; d < num_workers; d++)
+		{
+			test_chunk_kernel(workers[d].context, workers[d].commands, workers[d].device, workers[d].kernel, sizes[d], offsets[d], d, &slots[d][0]);
+			worker_flush(&workers[d]);
+		}
+		for(d = 0; d < num_workers; d++)
+			worker_finish(&workers[d]);
 		TIMER_END;
+		trace_span(TRACE_MAIN, "kernel", &timer1, &timer2);
 		*exec_time += MILLISECONDS;
 		
 		TIMER_START;
-		test_chunk_cleanup(context_cpu, commands_cpu, length - gpu_size, 0, 0);
-		test_chunk_cleanup(context_gpu, commands_gpu, gpu_size, length - gpu_size, 1);
-		clFinish(commands_cpu);
-		clFinish(commands_gpu);
+		for(d = 0; d < num_workers; d++)
+			test_chunk_cleanup(workers[d].context, workers[d].commands, sizes[d], offsets[d], d, &slots[d][0]);
+		for(d = 0; d < num_workers; d++)
+		{
+			worker_finish(&workers[d]);
+			test_chunk_retire(sizes[d], d, &slots[d][0]);
+		}
 		TIMER_END;
+		trace_span(TRACE_MAIN, "cleanup", &timer1, &timer2);
 		*data_time += MILLISECONDS;
 	}
-	else if(scheme == CPU_GPU_DYNAMIC)
-	{
-		pthread_t threads[2];
-		int rc;
-		void* status;
-		struct dynamic_args cpu_args = {0, 0, 0};
-		struct dynamic_args gpu_args = {1, 0, 0};
-		
-		pthread_mutex_init(&mutex, NULL);
-		t_length = length;
-		t_offset = 0;
-		
-		TIMER_START;
-		rc = pthread_create(&threads[0], NULL, dynamic_scheduler, &gpu_args);
-		rc = pthread_create(&threads[1], NULL, dynamic_scheduler, &cpu_args);
-		rc = pthread_join(threads[0], &status); 
-		rc = pthread_join(threads[1], &status); 
-		TIMER_END;
-
-		*data_time = MILLISECONDS;//cpu_args.data_time + gpu_args.data_time;
-		//*exec_time = cpu_args.exec_time + gpu_args.exec_time;
-	}
-	else
-	{
-		fprintf(stderr, "Scheme not supported.\n");
-		abort();
-	}
 	test_cleanup();	
 	TOTAL_TIMER_END;
 	*total_time = TOTAL_MILLISECONDS;
+	test_verify();
+	trace_collect();
 }
 
-void fillArray(unsigned char* nums, unsigned long length)
+// Fill nums with random bytes from one stream of seed, on every core
+void fillArray(unsigned char* nums, const unsigned long length, unsigned long stream)
 {
-	int i;
-	for(i = 0; i < length; i++)
-	{
-		nums[i] = rand() % 256;
-	}
+	fill_random_bytes(nums, length, elem_size, elem_info(elem_type)->is_float, seed, stream);
 }
 
-void serial_vector_add(unsigned char* a, unsigned char* b, unsigned char* c, const unsigned int len)
+// What CPUBound.cl leaves in c, without doing every add
+void serial_cpu_bound(unsigned char* a, unsigned char* b, unsigned char* c, const unsigned long len)
 {
-	int i;
-	for(i = 0; i < len; i++)
-	{
-		c[i] = a[i] + b[i];
-	}
+	elem_cpu_bound(elem_type, a, b, c, len);
 }
 
-void verify_answer(unsigned char* toCheck, unsigned char* answer, const unsigned int len)
+unsigned long verify_answer(unsigned char* toCheck, unsigned char* answer, const unsigned long len)
 {
-	int i;
-	for(i = 0; i < len; i++)
-	{
-		if(toCheck[i] != answer[i])
-			fprintf(stderr,"Answers differ at position %d (%d, %d)\n", i, toCheck[i], answer[i]);
-	}
+	if(answer == NULL)
+		return verify_compare_reference(toCheck, reference_block, len, elem_size);
+	return verify_compare(toCheck, answer, len, elem_size);
 }
 
+// Expected output of elements [first, first + count), for checks made
+// without h_check
+void reference_block(size_t first, size_t count, void* out)
+{
+	elem_cpu_bound(elem_type, h_a + elem_size * first, h_b + elem_size * first, out, count);
+}
+
+// Map the inputs from a.bin and b.bin in stream_dir and the output to c.bin.
+// Inputs that do not exist yet are created for test_setup to fill.
+void stream_setup()
+{
+	stream_open_input(&stream_a, stream_dir, "a.bin", elem_size * length);
+	stream_open_input(&stream_b, stream_dir, "b.bin", elem_size * length);
+	stream_open_output(&stream_c, stream_dir, "c.bin", elem_size * length);
+	h_a = stream_a.data;
+	h_b = stream_b.data;
+	h_c = stream_c.data;
+	h_check = NULL;
+}
+
+// Start a run with an empty output and none of the inputs cached, so every
+// chunk is read from the files
+void stream_restart()
+{
+	stream_clear(&stream_c);
+	stream_release(&stream_a, 0, stream_a.size);
+	stream_release(&stream_b, 0, stream_b.size);
+}
+
+
 int main(int argc, char** argv)
 {
 	const char* scheme_name;
 
-	length = atoi(argv[1]);
+	length = atol(argv[1]);
 	unsigned int iters = atoi(argv[2]);
-	switch(atoi(argv[3]))
+	//auto picks the scheme, split and chunk size from the calibration profile
+	//once the devices are up; until then it sets up every device
+	if(strcmp(argv[3], "auto") == 0)
 	{
-		case 0: scheme = CPU_ONLY;
-			scheme_name = "c";
-			break;
-		case 1: scheme = GPU_ONLY;
-			scheme_name = "g";
-			break;
-		case 2: scheme = CPU_GPU_STATIC;
-			scheme_name = "cg-s";
-			if(argc > 4)
-				ratio = atof(argv[4]);
-			break;
-		case 3: scheme = CPU_GPU_DYNAMIC;
-			scheme_name = "cg-d";
-			break;
-		default:
-			fprintf(stderr, "Error: no scheme specified\n");
-			exit(1);
+		auto_scheme = 1;
+		scheme = CPU_GPU_DYNAMIC;
+		scheme_name = "auto";
+	}
+	else
+	{
+		switch(atoi(argv[3]))
+		{
+			case 0: scheme = CPU_ONLY;
+				scheme_name = "c";
+				break;
+			case 1: scheme = GPU_ONLY;
+				scheme_name = "g";
+				break;
+			case 2: scheme = CPU_GPU_STATIC;
+				scheme_name = "cg-s";
+				if(argc > 4 && strcmp(argv[4], "auto") == 0)
+				{
+					tune_split = 1;
+					scheme_name = "cg-s-auto";
+				}
+				else if(argc > 4)
+					ratio = atof(argv[4]);
+				break;
+			case 3: scheme = CPU_GPU_DYNAMIC;
+				scheme_name = "cg-d";
+				if(argc > 4 && !parse_chunk_mode(argv[4], &chunk_mode))
+				{
+					fprintf(stderr, "Error: unknown chunk mode %s\n", argv[4]);
+					exit(1);
+				}
+				if(chunk_mode == CHUNK_GUIDED)
+					scheme_name = "cg-d-guided";
+				else if(chunk_mode == CHUNK_FACTORING)
+					scheme_name = "cg-d-factoring";
+				else if(chunk_mode == CHUNK_STEAL)
+					scheme_name = "cg-d-steal";
+				if(argc > 5)
+					pipeline_depth = atoi(argv[5]);
+				if(pipeline_depth < 1 || pipeline_depth > MAX_PIPELINE_DEPTH)
+				{
+					fprintf(stderr, "Error: pipeline depth must be between 1 and %d\n", MAX_PIPELINE_DEPTH);
+					exit(1);
+				}
+				break;
+			default:
+				fprintf(stderr, "Error: no scheme specified\n");
+				exit(1);
+		}
+	}
+	//CPU_SUBDEVICES=N splits each CPU into N sub-devices, 1 keeps it whole,
+	//and unset splits it by NUMA node
+	const char* split = getenv("CPU_SUBDEVICES");
+	if(split)
+		cpu_split = atoi(split);
+	//CHUNK_SIZE and LOCAL_SIZE override the fixed chunk size and the work
+	//group size, so sweeps can vary them without a rebuild
+	const char* chunk = getenv("CHUNK_SIZE");
+	if(chunk)
+		fixed_chunk = atol(chunk);
+	const char* local = getenv("LOCAL_SIZE");
+	if(local)
+		work_group_size = atol(local);
+	//ELEM_TYPE=uint8|uint32|uint64|float|double picks the element type the
+	//kernels are built for
+	const char* type = getenv("ELEM_TYPE");
+	if(type && !parse_elem_type(type, &elem_type))
+	{
+		fprintf(stderr, "Error: unknown element type %s\n", type);
+		exit(1);
+	}
+	elem_size = elem_info(elem_type)->size;
+	//STREAM_DIR=dir maps the arrays from files in dir rather than holding
+	//them in memory, so they can be larger than RAM. The dynamic scheme
+	//bounds what is resident by streaming them through in chunks.
+	stream_dir = getenv("STREAM_DIR");
+	if(stream_dir && scheme != CPU_GPU_DYNAMIC)
+	{
+		fprintf(stderr, "Error: streaming needs the dynamic scheme\n");
+		exit(1);
+	}
+	//DRIVER=threads gives each OpenCL worker of the dynamic scheme a blocking
+	//thread of its own instead of driving them all from the main thread
+	const char* driver_value = getenv("DRIVER");
+	if(driver_value && !parse_driver(driver_value, &driver))
+	{
+		fprintf(stderr, "Error: unknown driver %s\n", driver_value);
+		exit(1);
+	}
+	//CPU_BACKEND=native runs CPU chunks on the host SIMD kernels instead of
+	//the OpenCL CPU device, and both keeps the two side by side
+	const char* backend = getenv("CPU_BACKEND");
+	if(backend && !parse_cpu_backend(backend, &cpu_backend))
+	{
+		fprintf(stderr, "Error: unknown CPU backend %s\n", backend);
+		exit(1);
+	}
+	//TRACE_FILE=path writes a Chrome trace of every command and scheduler phase
+	trace_open(getenv("TRACE_FILE"));
+	trace_track(TRACE_HOST, TRACE_MAIN, "main");
+
+	if(stream_dir)
+		stream_setup();
+	else
+	{
+		h_a = host_alloc(elem_size * length);
+		h_b = host_alloc(elem_size * length);
+		h_c = host_alloc(elem_size * length);
+		h_check = malloc(elem_size * length);
 	}
-	h_a = malloc(sizeof(*h_a) *  length);
-	h_b = malloc(sizeof(*h_b) *  length);
-	h_c = malloc(sizeof(*h_c) *  length);
-	h_check = malloc(sizeof(*h_check) *  length);
 
 	setupGPU();	
+	pool_setup();
+	fprintf(stderr, "kernel cache: %d hits, %d misses, %f ms build time\n",
+		program_cache_stats.hits, program_cache_stats.misses, program_cache_stats.build_time);
+
+	//Inputs are generated once and reused by every iteration unless
+	//FRESH_DATA=1 asks for new ones each time; SEED picks the inputs. They
+	//exist before any tuning, so the probes do not read untouched zero pages.
+	const char* seed_value = getenv("SEED");
+	if(seed_value)
+		seed = strtoul(seed_value, NULL, 0);
+	//VERIFY=none|full|sample|checksum picks how each run's result is checked
+	const char* verify = getenv("VERIFY");
+	if(verify && !parse_verify_mode(verify, &verify_mode))
+	{
+		fprintf(stderr, "Error: unknown verify mode %s\n", verify);
+		exit(1);
+	}
+	const char* fresh = getenv("FRESH_DATA");
+	if(fresh)
+		fresh_data = atoi(fresh);
+	test_setup();
+
+	if(auto_scheme)
+		scheme_name = choose_auto_scheme();
+	else if(scheme == CPU_GPU_STATIC && tune_split)
+		ratio = tune_shares();
+	else
+		shares_from_ratio(workers, num_workers, ratio, shares);
 
-	srand(time(0));
+	if(scheme == CPU_GPU_DYNAMIC && chunk_mode != CHUNK_FIXED)
+	{
+		int d;
+		fprintf(stderr, "%s chunking:", chunk_mode_name(chunk_mode));
+		for(d = 0; d < num_workers; d++)
+		{
+			calibrate_chunking(d, &workers[d].chunking);
+			fprintf(stderr, " %s min %lu (%f ms overhead)", workers[d].name,
+				workers[d].chunking.min_chunk, workers[d].chunking.overhead);
+		}
+		fprintf(stderr, "\n");
+	}
 
 	float data_time = 0;
 	float exec_time = 0;
@@ -532,7 +1222,12 @@ int main(int argc, char** argv)
 	int i;
 	for(i = 0; i < iters+warmup; i++)
 	{
-		memset(h_c, 0, sizeof(unsigned char) * length);
+		if(fresh_data && i > 0)
+			test_setup();
+		if(stream_dir)
+			stream_restart();
+		else
+			memset(h_c, 0, elem_size * length);
 //		vadd_default(h_a, h_b, h_c, length, &data_time, &exec_time);
 //		verify_answer(h_c, h_check, length);	
 		run_test(&data_time, &exec_time, &total_time);
@@ -545,9 +1240,22 @@ int main(int argc, char** argv)
 	}
 
 	fflush(stdout);
-	free(h_a);
-	free(h_b);
-	free(h_c);
-	free(h_check);
+	trace_close();
+	pool_teardown();
+	if(scheme != GPU_ONLY && cpu_backend != BACKEND_OPENCL)
+		native_shutdown();
+	if(stream_dir)
+	{
+		stream_close(&stream_a);
+		stream_close(&stream_b);
+		stream_close(&stream_c);
+	}
+	else
+	{
+		free(h_a);
+		free(h_b);
+		free(h_c);
+		free(h_check);
+	}
 	return 0;
 }
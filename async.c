@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "async.h"
+
+void async_init(struct async_loop* loop)
+{
+	memset(loop, 0, sizeof(*loop));
+	pthread_mutex_init(&loop->lock, NULL);
+	pthread_cond_init(&loop->posted, NULL);
+}
+
+void async_destroy(struct async_loop* loop)
+{
+	pthread_mutex_destroy(&loop->lock);
+	pthread_cond_destroy(&loop->posted);
+}
+
+// Count future as outstanding until it is collected
+void async_expect(struct async_loop* loop, struct async_future* future, void* tag)
+{
+	future->done = 0;
+	future->status = CL_COMPLETE;
+	future->tag = tag;
+	future->next = NULL;
+	pthread_mutex_lock(&loop->lock);
+	loop->pending++;
+	pthread_mutex_unlock(&loop->lock);
+}
+
+// Mark future done and hand it to the loop's owner
+void async_complete(struct async_loop* loop, struct async_future* future, cl_int status)
+{
+	pthread_mutex_lock(&loop->lock);
+	future->status = status;
+	future->done = 1;
+	if(loop->tail)
+		loop->tail->next = future;
+	else
+		loop->head = future;
+	loop->tail = future;
+	pthread_cond_signal(&loop->posted);
+	pthread_mutex_unlock(&loop->lock);
+}
+
+struct watch
+{
+	struct async_loop* loop;
+	struct async_future* future;
+};
+
+static void CL_CALLBACK event_done(cl_event event, cl_int status, void* data)
+{
+	struct watch* w = data;
+	async_complete(w->loop, w->future, status);
+	free(w);
+}
+
+// Complete future when event does. The runtime may call back before this
+// returns, if the event is already complete, so nothing may be locked here.
+void async_watch(struct async_loop* loop, struct async_future* future, cl_event event, void* tag)
+{
+	struct watch* w = malloc(sizeof(*w));
+	w->loop = loop;
+	w->future = future;
+	async_expect(loop, future, tag);
+	int err = clSetEventCallback(event, CL_COMPLETE, event_done, w);
+	if(err != CL_SUCCESS)
+	{
+		fprintf(stderr, "CL Error %d: Failed to watch an event!\n", err);
+		exit(1);
+	}
+}
+
+// Wait for the next future to complete and take it off the loop. Returns
+// NULL straight away when nothing is outstanding.
+struct async_future* async_next(struct async_loop* loop)
+{
+	pthread_mutex_lock(&loop->lock);
+	while(loop->head == NULL && loop->pending > 0)
+		pthread_cond_wait(&loop->posted, &loop->lock);
+	struct async_future* future = loop->head;
+	if(future)
+	{
+		loop->head = future->next;
+		if(loop->head == NULL)
+			loop->tail = NULL;
+		future->next = NULL;
+		loop->pending--;
+	}
+	pthread_mutex_unlock(&loop->lock);
+	return future;
+}
+
+int parse_driver(const char* name, enum driver_t* driver)
+{
+	if(strcmp(name, "async") == 0)
+		*driver = DRIVER_ASYNC;
+	else if(strcmp(name, "threads") == 0)
+		*driver = DRIVER_THREADS;
+	else
+		return 0;
+	return 1;
+}
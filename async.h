@@ -0,0 +1,47 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <pthread.h>
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/opencl.h>
+#endif
+
+// How the dynamic scheme drives OpenCL workers: all from the host thread,
+// reacting to completions, or with a blocking thread per worker
+enum driver_t { DRIVER_ASYNC, DRIVER_THREADS };
+
+// Completion handle of one piece of submitted work. It is done once the
+// event it watches completes, or once async_complete is called on it.
+struct async_future
+{
+	int done;
+	cl_int status;		//CL_COMPLETE, or the negative error the work ended with
+	void* tag;		//Whatever the submitter wants back
+	struct async_future* next;
+};
+
+// Futures that completed and have not been collected yet. Completion
+// callbacks run on the OpenCL runtime's threads and only append here; the
+// thread that owns the loop collects them with async_next and does the rest.
+struct async_loop
+{
+	pthread_mutex_t lock;
+	pthread_cond_t posted;
+	struct async_future* head;
+	struct async_future* tail;
+	int pending;		//Watched and not yet collected
+};
+
+void async_init(struct async_loop* loop);
+void async_destroy(struct async_loop* loop);
+void async_watch(struct async_loop* loop, struct async_future* future, cl_event event, void* tag);
+void async_expect(struct async_loop* loop, struct async_future* future, void* tag);
+void async_complete(struct async_loop* loop, struct async_future* future, cl_int status);
+struct async_future* async_next(struct async_loop* loop);
+
+int parse_driver(const char* name, enum driver_t* driver);
+
+#endif
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "dispenser.h"
+
+#define MAX_THREADS 32
+
+//Small chunks so the benchmark measures claiming, not arithmetic
+#define BENCH_LENGTH (1024UL * 1024 * 1024)
+#define BENCH_CHUNK 256
+
+struct dispenser dispenser;
+struct device_chunking devices[MAX_THREADS];
+int use_lock;
+
+struct bench_args
+{
+	int id;
+	unsigned long claims;
+	size_t claimed;
+};
+
+void* claimer(void* argv)
+{
+	struct bench_args* args = argv;
+	size_t offset;
+	size_t size;
+	while(1)
+	{
+		if(use_lock)
+			size = dispenser_claim_locked(&dispenser, args->id, &offset);
+		else
+			size = dispenser_claim(&dispenser, args->id, &offset);
+		if(size == 0)
+			break;
+		args->claims++;
+		args->claimed += size;
+	}
+	return NULL;
+}
+
+// Claims per second with num_threads threads draining one dispenser
+double run(enum chunk_mode_t mode, int num_threads, int locked)
+{
+	pthread_t threads[MAX_THREADS];
+	struct bench_args args[MAX_THREADS];
+	struct timespec time_start, time_end;
+	int i;
+
+	for(i = 0; i < num_threads; i++)
+	{
+		devices[i].min_chunk = BENCH_CHUNK;
+		devices[i].max_chunk = BENCH_CHUNK;
+		devices[i].overhead = 0;
+		devices[i].rate = 0;
+		args[i].id = i;
+		args[i].claims = 0;
+		args[i].claimed = 0;
+	}
+	use_lock = locked;
+	dispenser_init(&dispenser, mode, BENCH_LENGTH, devices, num_threads);
+
+	clock_gettime(CLOCK_MONOTONIC, &time_start);
+	for(i = 0; i < num_threads; i++)
+		pthread_create(&threads[i], NULL, claimer, &args[i]);
+	for(i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &time_end);
+	dispenser_destroy(&dispenser);
+
+	unsigned long claims = 0;
+	size_t claimed = 0;
+	for(i = 0; i < num_threads; i++)
+	{
+		claims += args[i].claims;
+		claimed += args[i].claimed;
+	}
+	if(claimed != BENCH_LENGTH)
+	{
+		fprintf(stderr, "Error: %s dispenser handed out %lu of %lu elements\n", locked ? "locked" : "atomic", claimed, BENCH_LENGTH);
+		exit(1);
+	}
+
+	double seconds = (time_end.tv_sec - time_start.tv_sec) + (time_end.tv_nsec - time_start.tv_nsec) / 1e9;
+	return claims / seconds;
+}
+
+int main(int argc, char** argv)
+{
+	const int thread_counts[] = {2, 8, 32};
+	const enum chunk_mode_t modes[] = {CHUNK_FIXED, CHUNK_GUIDED};
+	int m, t;
+
+	fprintf(stdout, "mode\tthreads\tmutex_claims_per_s\tatomic_claims_per_s\tspeedup\n");
+	for(m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+	{
+		for(t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++)
+		{
+			double locked = run(modes[m], thread_counts[t], 1);
+			double atomic = run(modes[m], thread_counts[t], 0);
+			fprintf(stdout, "%s\t%d\t%.0f\t%.0f\t%.2f\n", chunk_mode_name(modes[m]), thread_counts[t], locked, atomic, atomic / locked);
+		}
+	}
+	return 0;
+}
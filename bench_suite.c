@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+//Most values one sweep axis can take
+#define MAX_VALUES 16
+
+//Most timed iterations kept per configuration
+#define MAX_SAMPLES 1024
+
+// One benchmark binary, the arrays it moves and its default element size
+struct workload
+{
+	const char* name;	//As reported; Fused-store is Fused with an EXPR
+	const char* binary;
+	int arrays;
+	int elem_size;
+	const char* expr;	//EXPR for Fused, NULL for its default sum(a + b)
+};
+
+const struct workload workloads[] = {
+	{ "VectorAdd", "VectorAdd", 3, 1 },
+	{ "VectorAdd+", "VectorAddPlus", 3, 1 },
+	{ "Reduce", "Reduce", 1, 8 },
+	{ "Fused", "Fused", 2, 8 },
+	{ "Fused-store", "Fused", 3, 8, "min(a, b) * 3" },
+	{ "Chain", "Chain", 4, 1 },
+	{ "CoChain", "CoChain", 4, 1 },
+};
+
+// Element types the binaries take in ELEM_TYPE, and their sizes
+struct elem_type
+{
+	const char* name;
+	int size;
+};
+
+const struct elem_type elem_types[] = {
+	{ "uint8", 1 },
+	{ "uint32", 4 },
+	{ "uint64", 8 },
+	{ "float", 4 },
+	{ "double", 8 },
+};
+
+// A comma-separated list of values for one sweep axis
+struct axis
+{
+	char* values[MAX_VALUES];
+	int count;
+};
+
+struct axis workload_axis, length_axis, type_axis, scheme_axis, ratio_axis, mode_axis, chunk_axis, local_axis;
+int iters = 10;
+int warmup = 1;
+int json = 0;
+const char* bin_dir = ".";
+
+// Median, 5th and 95th percentile and a 95% confidence interval of the mean
+struct summary
+{
+	float median;
+	float p5;
+	float p95;
+	float ci_low;
+	float ci_high;
+};
+
+struct samples
+{
+	float data[MAX_SAMPLES];
+	float exec[MAX_SAMPLES];
+	float total[MAX_SAMPLES];
+	int count;
+	char scheme_name[64];
+};
+
+void parse_axis(struct axis* axis, const char* list)
+{
+	char* copy = strdup(list);
+	char* value;
+	axis->count = 0;
+	for(value = strtok(copy, ","); value; value = strtok(NULL, ","))
+	{
+		if(axis->count == MAX_VALUES)
+		{
+			fprintf(stderr, "Error: more than %d values in %s\n", MAX_VALUES, list);
+			exit(1);
+		}
+		axis->values[axis->count++] = value;
+	}
+}
+
+const struct workload* find_workload(const char* name)
+{
+	int i;
+	for(i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+		if(strcmp(workloads[i].name, name) == 0 || strcmp(workloads[i].binary, name) == 0)
+			return &workloads[i];
+	fprintf(stderr, "Error: unknown workload %s\n", name);
+	exit(1);
+}
+
+// Bytes one element of w moves; type "0" keeps the binary's default
+int bytes_per_element(const struct workload* w, const char* type)
+{
+	int i;
+	if(strcmp(type, "0") == 0)
+		return w->arrays * w->elem_size;
+	for(i = 0; i < sizeof(elem_types) / sizeof(elem_types[0]); i++)
+		if(strcmp(elem_types[i].name, type) == 0)
+			return w->arrays * elem_types[i].size;
+	fprintf(stderr, "Error: unknown element type %s\n", type);
+	exit(1);
+}
+
+int compare_floats(const void* a, const void* b)
+{
+	float x = *(const float*) a;
+	float y = *(const float*) b;
+	return x < y ? -1 : x > y;
+}
+
+// Linear interpolation between the closest ranks of sorted values
+float percentile(const float* sorted, int n, float p)
+{
+	float rank = p * (n - 1);
+	int below = (int) rank;
+	if(below + 1 >= n)
+		return sorted[n - 1];
+	return sorted[below] + (rank - below) * (sorted[below + 1] - sorted[below]);
+}
+
+// Two-sided 95% Student t quantile for df degrees of freedom
+float t_quantile(int df)
+{
+	static const float table[] = { 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+		2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+		2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+	if(df < 1)
+		return 0;
+	if(df <= 30)
+		return table[df - 1];
+	return 1.96;
+}
+
+void summarize(const float* values, int n, struct summary* s)
+{
+	float sorted[MAX_SAMPLES];
+	memcpy(sorted, values, sizeof(float) * n);
+	qsort(sorted, n, sizeof(float), compare_floats);
+	s->median = percentile(sorted, n, 0.5);
+	s->p5 = percentile(sorted, n, 0.05);
+	s->p95 = percentile(sorted, n, 0.95);
+
+	double mean = 0;
+	double var = 0;
+	int i;
+	for(i = 0; i < n; i++)
+		mean += values[i];
+	mean /= n;
+	for(i = 0; i < n; i++)
+		var += (values[i] - mean) * (values[i] - mean);
+	double half = n > 1 ? t_quantile(n - 1) * sqrt(var / (n - 1)) / sqrt(n) : 0;
+	s->ci_low = mean - half;
+	s->ci_high = mean + half;
+}
+
+// Run one configuration and collect its TSV lines, dropping the first warmup
+// iterations. Returns 0 if the binary failed or printed nothing.
+int run_config(const struct workload* w, const char* length, const char* type, const char* scheme, const char* arg, const char* chunk, const char* local, struct samples* out)
+{
+	char command[1024];
+	snprintf(command, sizeof(command), "%s/%s %s %d %s %s", bin_dir, w->binary, length, iters + warmup, scheme, arg ? arg : "");
+
+	if(strcmp(type, "0") == 0)
+		unsetenv("ELEM_TYPE");
+	else
+		setenv("ELEM_TYPE", type, 1);
+	if(strcmp(chunk, "0") == 0)
+		unsetenv("CHUNK_SIZE");
+	else
+		setenv("CHUNK_SIZE", chunk, 1);
+	if(strcmp(local, "0") == 0)
+		unsetenv("LOCAL_SIZE");
+	else
+		setenv("LOCAL_SIZE", local, 1);
+	if(w->expr == NULL)
+		unsetenv("EXPR");
+	else
+		setenv("EXPR", w->expr, 1);
+
+	FILE* pipe = popen(command, "r");
+	if(pipe == NULL)
+	{
+		fprintf(stderr, "Error: could not run %s\n", command);
+		return 0;
+	}
+
+	char line[1024];
+	out->count = 0;
+	while(fgets(line, sizeof(line), pipe))
+	{
+		int iter;
+		char name[64];
+		float ratio, data_time, exec_time, total_time;
+		unsigned long len;
+		if(sscanf(line, "%d\t%63[^\t]\t%63[^\t]\t%f\t%lu\t%f\t%f\t%f", &iter, name, out->scheme_name, &ratio, &len, &data_time, &exec_time, &total_time) != 8)
+			continue;
+		if(iter < warmup || out->count == MAX_SAMPLES)
+			continue;
+		out->data[out->count] = data_time;
+		out->exec[out->count] = exec_time;
+		out->total[out->count] = total_time;
+		out->count++;
+	}
+	if(pclose(pipe) != 0 || out->count == 0)
+	{
+		fprintf(stderr, "Error: %s failed or printed no timings\n", command);
+		return 0;
+	}
+	return 1;
+}
+
+void print_header()
+{
+	const char* phases[] = { "data", "exec", "total" };
+	int p;
+	if(json)
+	{
+		fprintf(stdout, "[");
+		return;
+	}
+	fprintf(stdout, "workload,length,type,scheme,ratio,mode,chunk,local,samples");
+	for(p = 0; p < 3; p++)
+		fprintf(stdout, ",%s_median_ms,%s_p5_ms,%s_p95_ms,%s_ci_low_ms,%s_ci_high_ms", phases[p], phases[p], phases[p], phases[p], phases[p]);
+	fprintf(stdout, ",gb_per_s\n");
+}
+
+void print_row(const struct workload* w, const char* length, const char* type, const struct samples* s, const char* ratio, const char* mode, const char* chunk, const char* local)
+{
+	static int rows = 0;
+	const char* phases[] = { "data", "exec", "total" };
+	struct summary sums[3];
+	summarize(s->data, s->count, &sums[0]);
+	summarize(s->exec, s->count, &sums[1]);
+	summarize(s->total, s->count, &sums[2]);
+	double gbps = sums[2].median > 0 ? atof(length) * bytes_per_element(w, type) / (sums[2].median * 1e6) : 0;
+	int p;
+
+	if(json)
+	{
+		fprintf(stdout, "%s\n{\"workload\":\"%s\",\"length\":%s,\"type\":\"%s\",\"scheme\":\"%s\",\"ratio\":\"%s\",\"mode\":\"%s\",\"chunk\":%s,\"local\":%s,\"samples\":%d",
+			rows ? "," : "", w->name, length, type, s->scheme_name, ratio, mode, chunk, local, s->count);
+		for(p = 0; p < 3; p++)
+			fprintf(stdout, ",\"%s\":{\"median_ms\":%f,\"p5_ms\":%f,\"p95_ms\":%f,\"ci_low_ms\":%f,\"ci_high_ms\":%f}",
+				phases[p], sums[p].median, sums[p].p5, sums[p].p95, sums[p].ci_low, sums[p].ci_high);
+		fprintf(stdout, ",\"gb_per_s\":%f}", gbps);
+	}
+	else
+	{
+		fprintf(stdout, "%s,%s,%s,%s,%s,%s,%s,%s,%d", w->name, length, type, s->scheme_name, ratio, mode, chunk, local, s->count);
+		for(p = 0; p < 3; p++)
+			fprintf(stdout, ",%f,%f,%f,%f,%f", sums[p].median, sums[p].p5, sums[p].p95, sums[p].ci_low, sums[p].ci_high);
+		fprintf(stdout, ",%f\n", gbps);
+	}
+	fflush(stdout);
+	rows++;
+}
+
+void print_footer()
+{
+	if(json)
+		fprintf(stdout, "\n]\n");
+}
+
+// Ratios only apply to the static scheme and chunk modes to the dynamic one;
+// chunk sizes only change the fixed and steal modes
+void sweep(const struct workload* w, const char* length, const char* type, const char* scheme, const char* local)
+{
+	struct samples* s = malloc(sizeof(*s));
+	int r, m, c;
+	int n = atoi(scheme);
+	if(n == 2)
+	{
+		for(r = 0; r < ratio_axis.count; r++)
+			if(run_config(w, length, type, scheme, ratio_axis.values[r], "0", local, s))
+				print_row(w, length, type, s, ratio_axis.values[r], "", "0", local);
+	}
+	else if(n == 3)
+	{
+		for(m = 0; m < mode_axis.count; m++)
+		{
+			const char* mode = mode_axis.values[m];
+			int sized = strcmp(mode, "fixed") == 0 || strcmp(mode, "steal") == 0;
+			for(c = 0; c < (sized ? chunk_axis.count : 1); c++)
+			{
+				const char* chunk = sized ? chunk_axis.values[c] : "0";
+				if(run_config(w, length, type, scheme, mode, chunk, local, s))
+					print_row(w, length, type, s, "", mode, chunk, local);
+			}
+		}
+	}
+	else if(run_config(w, length, type, scheme, NULL, "0", local, s))
+		print_row(w, length, type, s, "", "", "0", local);
+	free(s);
+}
+
+void usage(const char* name)
+{
+	fprintf(stderr, "Usage: %s [key=value,...]...\n"
+		"  workloads=VectorAdd,VectorAdd+,Reduce  lengths=1048576  types=0  schemes=0,1,2,3\n"
+		"  ratios=0.5  modes=fixed  chunks=0  locals=0  (0 keeps the binary's default)\n"
+		"  types take uint8,uint32,uint64,float,double\n"
+		"  iters=10  warmup=1  format=csv|json  bin=.\n", name);
+	exit(1);
+}
+
+int main(int argc, char** argv)
+{
+	parse_axis(&workload_axis, "VectorAdd,VectorAdd+,Reduce");
+	parse_axis(&length_axis, "1048576");
+	parse_axis(&type_axis, "0");
+	parse_axis(&scheme_axis, "0,1,2,3");
+	parse_axis(&ratio_axis, "0.5");
+	parse_axis(&mode_axis, "fixed");
+	parse_axis(&chunk_axis, "0");
+	parse_axis(&local_axis, "0");
+
+	int i;
+	for(i = 1; i < argc; i++)
+	{
+		char* value = strchr(argv[i], '=');
+		if(value == NULL)
+			usage(argv[0]);
+		*value++ = 0;
+		if(strcmp(argv[i], "workloads") == 0)
+			parse_axis(&workload_axis, value);
+		else if(strcmp(argv[i], "lengths") == 0)
+			parse_axis(&length_axis, value);
+		else if(strcmp(argv[i], "types") == 0)
+			parse_axis(&type_axis, value);
+		else if(strcmp(argv[i], "schemes") == 0)
+			parse_axis(&scheme_axis, value);
+		else if(strcmp(argv[i], "ratios") == 0)
+			parse_axis(&ratio_axis, value);
+		else if(strcmp(argv[i], "modes") == 0)
+			parse_axis(&mode_axis, value);
+		else if(strcmp(argv[i], "chunks") == 0)
+			parse_axis(&chunk_axis, value);
+		else if(strcmp(argv[i], "locals") == 0)
+			parse_axis(&local_axis, value);
+		else if(strcmp(argv[i], "iters") == 0)
+			iters = atoi(value);
+		else if(strcmp(argv[i], "warmup") == 0)
+			warmup = atoi(value);
+		else if(strcmp(argv[i], "format") == 0)
+			json = strcmp(value, "json") == 0;
+		else if(strcmp(argv[i], "bin") == 0)
+			bin_dir = value;
+		else
+			usage(argv[0]);
+	}
+	if(iters < 1 || warmup < 0)
+		usage(argv[0]);
+	for(i = 0; i < type_axis.count; i++)
+		bytes_per_element(&workloads[0], type_axis.values[i]);
+
+	int w, l, t, s, k;
+	print_header();
+	for(w = 0; w < workload_axis.count; w++)
+	{
+		const struct workload* workload = find_workload(workload_axis.values[w]);
+		for(l = 0; l < length_axis.count; l++)
+			for(t = 0; t < type_axis.count; t++)
+				for(s = 0; s < scheme_axis.count; s++)
+					for(k = 0; k < local_axis.count; k++)
+						sweep(workload, length_axis.values[l], type_axis.values[t], scheme_axis.values[s], local_axis.values[k]);
+	}
+	print_footer();
+	return 0;
+}
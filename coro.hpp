@@ -0,0 +1,311 @@
+#ifndef CORO_HPP
+#define CORO_HPP
+
+// C++20 front-end over the OpenCL objects the hosts use. A job is a
+// coroutine that enqueues commands and co_awaits them; an executor resumes
+// it when they complete, from whichever thread calls run(). OpenCL objects
+// are owned by move-only wrappers that release them when they go.
+//
+//	balancer::job stream(balancer::queue& q, ...)
+//	{
+//		q.write(a, h_a, bytes);
+//		co_await q.write(b, h_b, bytes);	//In order, so a is there too
+//		co_await q.run(add, size, local_size);
+//		co_await q.read(c, h_c, bytes);
+//	}
+//
+// Errors end the program the way CHKERR does in the C hosts.
+
+#include <cmath>
+#include <coroutine>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+extern "C" {
+#include "async.h"
+#include "progcache.h"
+}
+
+namespace balancer
+{
+
+inline void check(cl_int err, const char* what)
+{
+	if(err != CL_SUCCESS)
+	{
+		fprintf(stdout, "CL Error %d: %s\n", err, what);
+		exit(1);
+	}
+}
+
+// Sole owner of one OpenCL object
+template <typename T, cl_int (*Release)(T)>
+class handle
+{
+public:
+	handle() = default;
+	explicit handle(T raw) : raw(raw) {}
+	handle(handle&& other) noexcept : raw(std::exchange(other.raw, nullptr)) {}
+	handle& operator=(handle&& other) noexcept
+	{
+		if(this != &other)
+			reset(std::exchange(other.raw, nullptr));
+		return *this;
+	}
+	handle(const handle&) = delete;
+	handle& operator=(const handle&) = delete;
+	~handle() { reset(); }
+
+	T get() const { return raw; }
+	explicit operator bool() const { return raw != nullptr; }
+	void reset(T next = nullptr)
+	{
+		if(raw)
+			Release(raw);
+		raw = next;
+	}
+
+private:
+	T raw = nullptr;
+};
+
+using event = handle<cl_event, clReleaseEvent>;
+
+// Resumes jobs as the commands they wait on complete. Completions are
+// collected by the async loop, so the runtime's callback threads never run
+// job code themselves.
+class executor
+{
+public:
+	executor() { async_init(&loop); }
+	~executor() { async_destroy(&loop); }
+	executor(const executor&) = delete;
+	executor& operator=(const executor&) = delete;
+
+	void watch(cl_event event, async_future* future, std::coroutine_handle<> job)
+	{
+		async_watch(&loop, future, event, job.address());
+	}
+
+	// Queue job to be resumed after the completions already collected
+	void post(async_future* future, std::coroutine_handle<> job)
+	{
+		async_expect(&loop, future, job.address());
+		async_complete(&loop, future, CL_COMPLETE);
+	}
+
+	// Until no job is waiting on a command
+	void run()
+	{
+		async_future* future;
+		while((future = async_next(&loop)) != nullptr)
+			std::coroutine_handle<>::from_address(future->tag).resume();
+	}
+
+private:
+	async_loop loop;
+};
+
+// A command in flight. Awaiting it flushes its queue and suspends the job
+// until the command completes; dropping it only lets go of the event.
+class command
+{
+public:
+	command(executor& ex, cl_command_queue queue, cl_event done) : ex(&ex), queue(queue), done(done) {}
+
+	cl_event get() const { return done.get(); }
+
+	// How long it ran once complete, from its queue's profiling; NAN if the
+	// queue does not profile
+	float milliseconds() const
+	{
+		cl_ulong start, end;
+		cl_int err = clGetEventProfilingInfo(done.get(), CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, nullptr);
+		err |= clGetEventProfilingInfo(done.get(), CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, nullptr);
+		if(err != CL_SUCCESS || end < start)
+			return NAN;
+		return (end - start) / 1000000.0f;
+	}
+
+	bool await_ready() const { return !done; }
+	void await_suspend(std::coroutine_handle<> job)
+	{
+		check(clFlush(queue), "Failed to flush a queue!");
+		ex->watch(done.get(), &future, job);
+	}
+	void await_resume() const { check(future.status, "A command failed!"); }
+
+private:
+	executor* ex;
+	cl_command_queue queue;
+	event done;
+	async_future future = {};
+};
+
+// Lets the executor resume the jobs whose commands completed meanwhile, for
+// jobs that do long stretches of host work between commands
+class yield
+{
+public:
+	explicit yield(executor& ex) : ex(&ex) {}
+	bool await_ready() const { return false; }
+	void await_suspend(std::coroutine_handle<> job) { ex->post(&future, job); }
+	void await_resume() const {}
+
+private:
+	executor* ex;
+	async_future future = {};
+};
+
+// Coroutine type of a job. It starts running as soon as it is called and
+// frees itself when it returns, so the caller keeps nothing.
+struct job
+{
+	struct promise_type
+	{
+		job get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+class context
+{
+public:
+	explicit context(cl_device_id device)
+	{
+		cl_int err;
+		raw.reset(clCreateContext(nullptr, 1, &device, nullptr, nullptr, &err));
+		check(err, "Failed to create a compute context!");
+	}
+	cl_context get() const { return raw.get(); }
+
+private:
+	handle<cl_context, clReleaseContext> raw;
+};
+
+class buffer
+{
+public:
+	buffer() = default;
+	buffer(const context& ctx, size_t size, cl_mem_flags flags = CL_MEM_READ_WRITE)
+	{
+		cl_int err;
+		raw.reset(clCreateBuffer(ctx.get(), flags, size, nullptr, &err));
+		check(err, "Failed to allocate a buffer!");
+	}
+	cl_mem get() const { return raw.get(); }
+
+private:
+	handle<cl_mem, clReleaseMemObject> raw;
+};
+
+// A kernel built from a source file through the kernel cache
+class kernel
+{
+public:
+	kernel(const context& ctx, cl_device_id device, const char* filename, const char* name, const char* options)
+	{
+		std::ifstream file(filename);
+		if(!file)
+		{
+			fprintf(stdout, "Error reading file.\n");
+			exit(0);
+		}
+		std::stringstream source;
+		source << file.rdbuf();
+
+		cl_int err;
+		program.reset(build_cached_program(ctx.get(), device, source.str().c_str(), options, &err));
+		if(err == CL_BUILD_PROGRAM_FAILURE)
+		{
+			size_t length;
+			clGetProgramBuildInfo(program.get(), device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &length);
+			std::string log(length, 0);
+			clGetProgramBuildInfo(program.get(), device, CL_PROGRAM_BUILD_LOG, length, log.data(), nullptr);
+			fprintf(stdout, "CL Error %d: Failed to build program! Log:\n%s", err, log.c_str());
+			exit(1);
+		}
+		check(err, "Failed to build program!");
+		raw.reset(clCreateKernel(program.get(), name, &err));
+		check(err, "Failed to create a compute kernel!");
+	}
+	cl_kernel get() const { return raw.get(); }
+
+	// Set every argument in order: buffers by their cl_mem, anything else by value
+	template <typename... Args>
+	void args(const Args&... values)
+	{
+		cl_uint index = 0;
+		(set(index++, values), ...);
+	}
+
+private:
+	void set(cl_uint index, const buffer& value)
+	{
+		cl_mem mem = value.get();
+		check(clSetKernelArg(raw.get(), index, sizeof(mem), &mem), "Errors setting kernel arguments");
+	}
+	template <typename T>
+	void set(cl_uint index, const T& value)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+		check(clSetKernelArg(raw.get(), index, sizeof(value), &value), "Errors setting kernel arguments");
+	}
+
+	handle<cl_program, clReleaseProgram> program;
+	handle<cl_kernel, clReleaseKernel> raw;
+};
+
+// An in-order command queue whose commands can be awaited. Enqueueing never
+// blocks; only awaiting suspends, and only the job that awaits.
+class queue
+{
+public:
+	queue(executor& ex, const context& ctx, cl_device_id device) : ex(&ex)
+	{
+		cl_int err;
+		raw.reset(clCreateCommandQueue(ctx.get(), device, CL_QUEUE_PROFILING_ENABLE, &err));
+		check(err, "Failed to create a command queue!");
+	}
+	cl_command_queue get() const { return raw.get(); }
+
+	command write(const buffer& to, const void* from, size_t size, size_t offset = 0)
+	{
+		cl_event done;
+		check(clEnqueueWriteBuffer(raw.get(), to.get(), CL_FALSE, offset, size, from, 0, nullptr, &done), "Failed to write a buffer!");
+		return command(*ex, raw.get(), done);
+	}
+
+	command read(const buffer& from, void* to, size_t size, size_t offset = 0)
+	{
+		cl_event done;
+		check(clEnqueueReadBuffer(raw.get(), from.get(), CL_FALSE, offset, size, to, 0, nullptr, &done), "Failed to read a buffer!");
+		return command(*ex, raw.get(), done);
+	}
+
+	// Launch k over size work items, rounded up to whole groups of local_size
+	command run(const kernel& k, size_t size, size_t local_size)
+	{
+		size_t global_size = (size + local_size - 1) / local_size * local_size;
+		cl_event done;
+		check(clEnqueueNDRangeKernel(raw.get(), k.get(), 1, nullptr, &global_size, &local_size, 0, nullptr, &done), "Failed to run kernel!");
+		return command(*ex, raw.get(), done);
+	}
+
+private:
+	executor* ex;
+	handle<cl_command_queue, clReleaseCommandQueue> raw;
+};
+
+}
+
+#endif
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "devices.h"
+
+#define CHKERR(err, str) \
+	if (err != CL_SUCCESS) \
+	{ \
+		fprintf(stdout, "CL Error %d: %s\n", err, str); \
+		exit(1); \
+	}
+
+// Partition a CPU device into sub-devices: by NUMA affinity domain when
+// cpu_split is 0, or into cpu_split equal parts when it is above 1. Returns
+// the number of sub-devices written to out, or 0 to use the whole device.
+static int split_cpu(cl_device_id device, int cpu_split, cl_device_id* out, int room)
+{
+	cl_device_partition_property props[MAX_WORKERS + 3];
+	cl_uint count = 0;
+	int err;
+	int i;
+
+	if(cpu_split == 1)
+		return 0;
+	if(cpu_split == 0)
+	{
+		props[0] = CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN;
+		props[1] = CL_DEVICE_AFFINITY_DOMAIN_NUMA;
+		props[2] = 0;
+	}
+	else
+	{
+		cl_uint units;
+		err = clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &units, NULL);
+		CHKERR(err, "Failed to query compute units!");
+		if(cpu_split > units)
+			cpu_split = units;
+		if(cpu_split > MAX_WORKERS)
+			cpu_split = MAX_WORKERS;
+		if(cpu_split < 2)
+			return 0;
+
+		props[0] = CL_DEVICE_PARTITION_BY_COUNTS;
+		for(i = 0; i < cpu_split; i++)
+			props[i + 1] = units / cpu_split + (i < units % cpu_split ? 1 : 0);
+		props[cpu_split + 1] = CL_DEVICE_PARTITION_BY_COUNTS_LIST_END;
+		props[cpu_split + 2] = 0;
+	}
+
+	//Runtimes without the partition type, or single-node machines, leave the device whole
+	err = clCreateSubDevices(device, props, 0, NULL, &count);
+	if(err != CL_SUCCESS || count < 2 || count > room)
+	{
+		if(cpu_split > 1)
+			fprintf(stderr, "Warning: could not split the CPU into %d sub-devices, using the whole device\n", cpu_split);
+		return 0;
+	}
+	err = clCreateSubDevices(device, props, count, out, NULL);
+	CHKERR(err, "Failed to create sub-devices!");
+	return count;
+}
+
+// Fill workers with every device of the given type on every platform, up to
+// max of them. CPU devices are split into sub-devices as split_cpu describes.
+int enumerate_workers(struct worker* workers, int max, cl_device_type type, int cpu_split)
+{
+	cl_uint num_platforms = 0;
+	int err = clGetPlatformIDs(0, NULL, &num_platforms);
+	CHKERR(err, "Failed to get a platform!");
+
+	cl_platform_id* platform_ids = (cl_platform_id*) malloc(sizeof(cl_platform_id) * num_platforms);
+	err = clGetPlatformIDs(num_platforms, platform_ids, NULL);
+	CHKERR(err, "Failed to get a platform!");
+
+	int num_workers = 0;
+	int num_cpus = 0;
+	int num_gpus = 0;
+	int p, d, i;
+	for(p = 0; p < num_platforms; p++)
+	{
+		cl_uint num_devices = 0;
+		err = clGetDeviceIDs(platform_ids[p], type, 0, NULL, &num_devices);
+		if(err == CL_DEVICE_NOT_FOUND)
+			continue;
+		CHKERR(err, "Failed to create a device group!");
+
+		cl_device_id* device_ids = (cl_device_id*) malloc(sizeof(cl_device_id) * num_devices);
+		err = clGetDeviceIDs(platform_ids[p], type, num_devices, device_ids, NULL);
+		CHKERR(err, "Failed to create a device group!");
+
+		for(d = 0; d < num_devices; d++)
+		{
+			cl_device_type device_type;
+			err = clGetDeviceInfo(device_ids[d], CL_DEVICE_TYPE, sizeof(cl_device_type), &device_type, NULL);
+			CHKERR(err, "Failed to query the device type!");
+			int isGPU = !(device_type & CL_DEVICE_TYPE_CPU);
+
+			cl_device_id parts[MAX_WORKERS];
+			int num_parts = 0;
+			if(!isGPU && num_workers < max)
+				num_parts = split_cpu(device_ids[d], cpu_split, parts, max - num_workers);
+			if(num_parts == 0)
+				parts[num_parts++] = device_ids[d];
+
+			for(i = 0; i < num_parts; i++)
+			{
+				if(num_workers == max)
+				{
+					fprintf(stderr, "Warning: more than %d devices, ignoring the rest\n", max);
+					break;
+				}
+				struct worker* w = &workers[num_workers++];
+				memset(w, 0, sizeof(*w));
+				w->device = parts[i];
+				w->isGPU = isGPU;
+				w->subdevice = parts[i] != device_ids[d];
+				snprintf(w->name, sizeof(w->name), "%s%d", isGPU ? "gpu" : "cpu", isGPU ? num_gpus++ : num_cpus++);
+			}
+		}
+		free(device_ids);
+	}
+	free(platform_ids);
+
+	return num_workers;
+}
+
+// Append the native host worker after the OpenCL devices, so the static
+// scheme flushes their kernels before it runs its own. Returns the new count.
+int add_native_worker(struct worker* workers, int num_workers, int max)
+{
+	if(num_workers == max)
+	{
+		fprintf(stderr, "Warning: more than %d devices, ignoring the native backend\n", max);
+		return num_workers;
+	}
+	struct worker* w = &workers[num_workers];
+	memset(w, 0, sizeof(*w));
+	w->native = 1;
+	snprintf(w->name, sizeof(w->name), "host0");
+	return num_workers + 1;
+}
+
+// Native workers finish each chunk before returning, so there is no queue to
+// flush or wait on
+void worker_flush(const struct worker* w)
+{
+	if(!w->native)
+		clFlush(w->commands);
+}
+
+void worker_finish(const struct worker* w)
+{
+	if(!w->native)
+		clFinish(w->commands);
+}
+
+// Give the GPUs ratio of the array and the CPUs the rest, split evenly within
+// each group. If one group has no devices the other takes everything.
+void shares_from_ratio(const struct worker* workers, int num_workers, float ratio, float* shares)
+{
+	int cpus = 0;
+	int gpus = 0;
+	int i;
+	for(i = 0; i < num_workers; i++)
+	{
+		if(workers[i].isGPU)
+			gpus++;
+		else
+			cpus++;
+	}
+	if(gpus == 0)
+		ratio = 0;
+	if(cpus == 0)
+		ratio = 1;
+
+	for(i = 0; i < num_workers; i++)
+		shares[i] = workers[i].isGPU ? ratio / gpus : (1 - ratio) / cpus;
+}
+
+// Cut length elements into one contiguous range per worker. The last worker
+// with a non-zero share also takes whatever rounding left over.
+void split_by_shares(const float* shares, int num_workers, size_t length, size_t* sizes, size_t* offsets)
+{
+	int last = num_workers - 1;
+	while(last > 0 && shares[last] <= 0)
+		last--;
+
+	size_t offset = 0;
+	int i;
+	for(i = 0; i < num_workers; i++)
+	{
+		size_t size = length * shares[i];
+		if(i == last || size > length - offset)
+			size = length - offset;
+		if(i > last)
+			size = 0;
+		sizes[i] = size;
+		offsets[i] = offset;
+		offset += size;
+	}
+}
+
+int parse_cpu_backend(const char* name, enum cpu_backend_t* backend)
+{
+	if(strcmp(name, "opencl") == 0)
+		*backend = BACKEND_OPENCL;
+	else if(strcmp(name, "native") == 0)
+		*backend = BACKEND_NATIVE;
+	else if(strcmp(name, "both") == 0)
+		*backend = BACKEND_BOTH;
+	else
+		return 0;
+	return 1;
+}
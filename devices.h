@@ -0,0 +1,45 @@
+#ifndef DEVICES_H
+#define DEVICES_H
+
+#include <stddef.h>
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/opencl.h>
+#endif
+
+#include "dispenser.h"
+
+#define MAX_WORKERS 16
+
+// Where CPU chunks run: the OpenCL CPU device, the native SIMD kernels, or both
+enum cpu_backend_t { BACKEND_OPENCL, BACKEND_NATIVE, BACKEND_BOTH };
+
+// One OpenCL device the schedulers hand work to, with its own context,
+// queues and kernel. A native worker has none of these and runs its chunks on
+// the host thread team in native.c instead.
+struct worker
+{
+	cl_device_id device;
+	cl_context context;
+	cl_command_queue commands;
+	cl_command_queue upload;	//Only created when pipelining
+	cl_command_queue download;	//Only created when pipelining
+	cl_kernel kernel;
+	int isGPU;			//Anything that is not a CPU runs the GPU kernels
+	int subdevice;			//Device came from clCreateSubDevices
+	int native;			//Host SIMD kernels, no OpenCL objects
+	char name[16];			//Short label for reports, e.g. cpu0 or gpu1
+	struct device_chunking chunking;
+};
+
+int enumerate_workers(struct worker* workers, int max, cl_device_type type, int cpu_split);
+int add_native_worker(struct worker* workers, int num_workers, int max);
+void worker_flush(const struct worker* w);
+void worker_finish(const struct worker* w);
+void shares_from_ratio(const struct worker* workers, int num_workers, float ratio, float* shares);
+void split_by_shares(const float* shares, int num_workers, size_t length, size_t* sizes, size_t* offsets);
+int parse_cpu_backend(const char* name, enum cpu_backend_t* backend);
+
+#endif
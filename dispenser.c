@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dispenser.h"
+
+// Fraction of the remaining work a device should take, weighted by its
+// measured rate so the slower device is not handed a slab.
+static float device_share(const struct dispenser* d, const struct device_chunking* device)
+{
+	if(d->total_rate <= 0 || device->rate <= 0)
+		return 1.0f / d->num_devices;
+	return device->rate / d->total_rate;
+}
+
+void dispenser_init(struct dispenser* d, enum chunk_mode_t mode, size_t length, const struct device_chunking* devices, int num_devices)
+{
+	d->mode = mode;
+	d->num_devices = num_devices;
+	d->devices = devices;
+	d->length = length;
+	d->chunk = FIXED_CHUNK_SIZE;
+	atomic_init(&d->offset, 0);
+
+	d->total_rate = 0;
+	int i;
+	for(i = 0; i < num_devices; i++)
+		d->total_rate += devices[i].rate;
+
+	pthread_mutex_init(&d->mutex, NULL);
+
+	d->ranges = NULL;
+	if(mode != CHUNK_STEAL)
+		return;
+
+	// Start every device on a contiguous range sized by its expected speed
+	d->ranges = malloc(sizeof(struct steal_range) * num_devices);
+	size_t front = 0;
+	for(i = 0; i < num_devices; i++)
+	{
+		size_t size = length * device_share(d, &devices[i]);
+		if(i == num_devices - 1 || size > length - front)
+			size = length - front;
+		d->ranges[i].front = front;
+		d->ranges[i].back = front + size;
+		pthread_mutex_init(&d->ranges[i].mutex, NULL);
+		front += size;
+	}
+}
+
+void dispenser_destroy(struct dispenser* d)
+{
+	int i;
+	if(d->ranges)
+	{
+		for(i = 0; i < d->num_devices; i++)
+			pthread_mutex_destroy(&d->ranges[i].mutex);
+		free(d->ranges);
+		d->ranges = NULL;
+	}
+	pthread_mutex_destroy(&d->mutex);
+}
+
+// A dispenser for callers that cannot hold one themselves. It still needs
+// dispenser_init, and dispenser_destroy before dispenser_free.
+struct dispenser* dispenser_alloc()
+{
+	struct dispenser* d = calloc(1, sizeof(*d));
+	if(d == NULL)
+	{
+		fprintf(stderr, "Error: out of memory for a dispenser\n");
+		exit(1);
+	}
+	return d;
+}
+
+void dispenser_free(struct dispenser* d)
+{
+	free(d);
+}
+
+// Elements per claim in fixed and steal modes, set after dispenser_init
+void dispenser_set_chunk(struct dispenser* d, size_t chunk)
+{
+	d->chunk = chunk;
+}
+
+// Size of the next chunk for a device with remaining elements left
+static size_t chunk_size(const struct dispenser* d, const struct device_chunking* device, size_t remaining)
+{
+	size_t size;
+	switch(d->mode)
+	{
+		case CHUNK_GUIDED:
+			// Guided self-scheduling: each claim takes its share of what is left
+			size = remaining * device_share(d, device);
+			break;
+		case CHUNK_FACTORING:
+			// Factoring: batches cover half of what is left, split between
+			// the devices by share
+			size = remaining * device_share(d, device) / 2;
+			break;
+		case CHUNK_STEAL:
+			// Work stealing: the range is already sized for the device, so
+			// take fixed chunks off it and leave the rest for thieves
+		default:
+			size = d->chunk;
+			break;
+	}
+
+	if(d->mode != CHUNK_FIXED && size < device->min_chunk)
+		size = device->min_chunk;
+	if(device->max_chunk > 0 && size > device->max_chunk)
+		size = device->max_chunk;
+	if(size == 0)
+		size = 1;
+	if(size > remaining)
+		size = remaining;
+	return size;
+}
+
+// Move the back half of the fullest other range into dev's own, empty range.
+// Returns 0 once every range is empty.
+static int steal(struct dispenser* d, int dev)
+{
+	int i;
+	while(1)
+	{
+		int victim = -1;
+		size_t most = 0;
+		for(i = 0; i < d->num_devices; i++)
+		{
+			if(i == dev)
+				continue;
+			pthread_mutex_lock(&d->ranges[i].mutex);
+			size_t left = d->ranges[i].back - d->ranges[i].front;
+			pthread_mutex_unlock(&d->ranges[i].mutex);
+			if(left > most)
+			{
+				most = left;
+				victim = i;
+			}
+		}
+		if(victim < 0)
+			return 0;
+
+		struct steal_range* range = &d->ranges[victim];
+		pthread_mutex_lock(&range->mutex);
+		size_t left = range->back - range->front;
+		size_t take = (left + 1) / 2;
+		range->back -= take;
+		size_t start = range->back;
+		pthread_mutex_unlock(&range->mutex);
+		//The victim drained its range since we looked, pick again
+		if(take == 0)
+			continue;
+
+		struct steal_range* own = &d->ranges[dev];
+		pthread_mutex_lock(&own->mutex);
+		own->front = start;
+		own->back = start + take;
+		pthread_mutex_unlock(&own->mutex);
+		return 1;
+	}
+}
+
+// Claim the next chunk from the front of dev's own range, stealing more work
+// when it runs dry. Each range's lock is only contended while it is robbed.
+static size_t steal_claim(struct dispenser* d, int dev, size_t* offset)
+{
+	struct steal_range* own = &d->ranges[dev];
+	do
+	{
+		pthread_mutex_lock(&own->mutex);
+		if(own->front < own->back)
+		{
+			size_t size = chunk_size(d, &d->devices[dev], own->back - own->front);
+			*offset = own->front;
+			own->front += size;
+			pthread_mutex_unlock(&own->mutex);
+			return size;
+		}
+		pthread_mutex_unlock(&own->mutex);
+	} while(steal(d, dev));
+	return 0;
+}
+
+// Claim the next chunk without taking a lock. Fixed chunks are a single
+// fetch-and-add on the offset; adaptive chunk sizes depend on what is left,
+// so those retry a compare-and-swap until no other claim slipped in between.
+// CHUNK_STEAL has no shared offset and claims from dev's own range instead.
+size_t dispenser_claim(struct dispenser* d, int dev, size_t* offset)
+{
+	const struct device_chunking* device = &d->devices[dev];
+	size_t size;
+
+	if(d->mode == CHUNK_STEAL)
+		return steal_claim(d, dev, offset);
+
+	if(d->mode == CHUNK_FIXED)
+	{
+		size = chunk_size(d, device, (size_t) -1);
+		size_t old = atomic_fetch_add_explicit(&d->offset, size, memory_order_relaxed);
+		if(old >= d->length)
+			return 0;
+		//The last chunk may run past the end of the array
+		if(size > d->length - old)
+			size = d->length - old;
+		*offset = old;
+		return size;
+	}
+
+	size_t old = atomic_load_explicit(&d->offset, memory_order_relaxed);
+	do
+	{
+		if(old >= d->length)
+			return 0;
+		size = chunk_size(d, device, d->length - old);
+	} while(!atomic_compare_exchange_weak_explicit(&d->offset, &old, old + size, memory_order_relaxed, memory_order_relaxed));
+
+	*offset = old;
+	return size;
+}
+
+// Mutex-protected claim the scheduler used before dispenser_claim; kept as
+// the baseline for bench_dispenser.
+size_t dispenser_claim_locked(struct dispenser* d, int dev, size_t* offset)
+{
+	const struct device_chunking* device = &d->devices[dev];
+	size_t size;
+
+	if(d->mode == CHUNK_STEAL)
+		return steal_claim(d, dev, offset);
+
+	pthread_mutex_lock(&d->mutex);
+	size_t old = atomic_load_explicit(&d->offset, memory_order_relaxed);
+	if(old >= d->length)
+	{
+		pthread_mutex_unlock(&d->mutex);
+		return 0;
+	}
+	size = chunk_size(d, device, d->length - old);
+	atomic_store_explicit(&d->offset, old + size, memory_order_relaxed);
+	pthread_mutex_unlock(&d->mutex);
+
+	*offset = old;
+	return size;
+}
+
+// Fit t(n) = overhead + n / rate through two timed chunks and derive the
+// smallest chunk whose overhead stays under CHUNK_OVERHEAD_FRACTION.
+void chunking_from_probes(struct device_chunking* chunking, size_t small, float t_small, size_t large, float t_large, size_t granularity)
+{
+	float rate;
+	if(t_large > t_small && large > small)
+		rate = (large - small) / (t_large - t_small);
+	else
+		rate = t_large > 0 ? large / t_large : 0;
+
+	float overhead = rate > 0 ? t_small - small / rate : t_small;
+	if(overhead < 0)
+		overhead = 0;
+
+	size_t min_chunk = overhead * rate * (1 - CHUNK_OVERHEAD_FRACTION) / CHUNK_OVERHEAD_FRACTION;
+	if(granularity == 0)
+		granularity = 1;
+	min_chunk = (min_chunk / granularity + 1) * granularity;
+
+	chunking->overhead = overhead;
+	chunking->rate = rate;
+	chunking->min_chunk = min_chunk;
+}
+
+int parse_chunk_mode(const char* name, enum chunk_mode_t* mode)
+{
+	if(strcmp(name, "fixed") == 0)
+		*mode = CHUNK_FIXED;
+	else if(strcmp(name, "guided") == 0)
+		*mode = CHUNK_GUIDED;
+	else if(strcmp(name, "factoring") == 0)
+		*mode = CHUNK_FACTORING;
+	else if(strcmp(name, "steal") == 0)
+		*mode = CHUNK_STEAL;
+	else
+		return 0;
+	return 1;
+}
+
+const char* chunk_mode_name(enum chunk_mode_t mode)
+{
+	switch(mode)
+	{
+		case CHUNK_GUIDED: return "guided";
+		case CHUNK_FACTORING: return "factoring";
+		case CHUNK_STEAL: return "steal";
+		default: return "fixed";
+	}
+}
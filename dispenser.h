@@ -0,0 +1,70 @@
+#ifndef DISPENSER_H
+#define DISPENSER_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#ifndef __cplusplus
+#include <stdatomic.h>
+#endif
+
+//Chunk size used by the original fixed-size dynamic scheme
+#define FIXED_CHUNK_SIZE (1024 * 80)
+
+//Largest fraction of a chunk's time we are willing to spend on per-chunk overhead
+#define CHUNK_OVERHEAD_FRACTION 0.1f
+
+enum chunk_mode_t { CHUNK_FIXED, CHUNK_GUIDED, CHUNK_FACTORING, CHUNK_STEAL };
+
+// Per-device chunking parameters, measured by calibrate_chunking()
+struct device_chunking
+{
+	size_t min_chunk;	//Smallest chunk worth paying the per-chunk overhead for
+	size_t max_chunk;	//Largest chunk the device's buffers can hold, 0 for no limit
+	float overhead;		//Fixed cost of one chunk in milliseconds
+	float rate;		//Elements processed per millisecond
+};
+
+// Unclaimed part of one device's share of the array in CHUNK_STEAL mode. The
+// owner claims from the front, other devices steal from the back.
+struct steal_range
+{
+	size_t front;
+	size_t back;
+	pthread_mutex_t mutex;
+};
+
+// Shared work queue the dynamic scheduler threads pull chunks from. C++ has
+// no _Atomic, so C++ sources only see its name: they get one from
+// dispenser_alloc and use the functions below.
+#ifdef __cplusplus
+struct dispenser;
+#else
+struct dispenser
+{
+	enum chunk_mode_t mode;
+	int num_devices;
+	const struct device_chunking* devices;	//Indexed by the dev passed to dispenser_claim
+	float total_rate;
+	size_t length;
+	size_t chunk;		//Elements per claim in fixed and steal modes, FIXED_CHUNK_SIZE by default
+	_Atomic size_t offset;	//Start of the next unclaimed chunk, may overshoot length
+	pthread_mutex_t mutex;	//Only taken by dispenser_claim_locked
+	struct steal_range* ranges;	//One per device in CHUNK_STEAL mode, NULL otherwise
+};
+#endif
+
+void dispenser_init(struct dispenser* d, enum chunk_mode_t mode, size_t length, const struct device_chunking* devices, int num_devices);
+void dispenser_destroy(struct dispenser* d);
+struct dispenser* dispenser_alloc();
+void dispenser_free(struct dispenser* d);
+void dispenser_set_chunk(struct dispenser* d, size_t chunk);
+size_t dispenser_claim(struct dispenser* d, int dev, size_t* offset);
+size_t dispenser_claim_locked(struct dispenser* d, int dev, size_t* offset);
+
+void chunking_from_probes(struct device_chunking* chunking, size_t small, float t_small, size_t large, float t_large, size_t granularity);
+
+int parse_chunk_mode(const char* name, enum chunk_mode_t* mode);
+const char* chunk_mode_name(enum chunk_mode_t mode);
+
+#endif
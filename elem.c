@@ -0,0 +1,138 @@
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "elem.h"
+
+//Relative error allowed between two floating point reductions, which add the
+//same values in a different order
+#define FLOAT_TOLERANCE 1e-3
+#define DOUBLE_TOLERANCE 1e-9
+
+// ELEM is the element type, CALC the type CPUBound.cl accumulates in and ACC
+// the type the reduction kernels sum into, matching the host loops below
+static const struct elem_info infos[] = {
+	{ "uint8", 1, 8, 0, "-DELEM=uchar -DCALC=uint -DACC=ulong" },
+	{ "uint32", 4, 8, 0, "-DELEM=uint -DCALC=uint -DACC=ulong" },
+	{ "uint64", 8, 8, 0, "-DELEM=ulong -DCALC=ulong -DACC=ulong" },
+	{ "float", 4, 4, 1, "-DELEM=float -DCALC=float -DACC=float" },
+	{ "double", 8, 8, 1, "-DELEM=double -DCALC=double -DACC=double" },
+};
+
+const struct elem_info* elem_info(enum elem_type_t type)
+{
+	return &infos[type];
+}
+
+int parse_elem_type(const char* name, enum elem_type_t* type)
+{
+	int i;
+	for(i = 0; i < sizeof(infos) / sizeof(infos[0]); i++)
+	{
+		if(strcmp(name, infos[i].name) == 0)
+		{
+			*type = i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+#define VECTOR_ADD(elem) \
+	{ \
+		const elem* x = a; \
+		const elem* y = b; \
+		elem* z = c; \
+		for(i = 0; i < length; i++) \
+			z[i] = x[i] + y[i]; \
+	}
+
+void elem_vector_add(enum elem_type_t type, const void* a, const void* b, void* c, size_t length)
+{
+	size_t i;
+	switch(type)
+	{
+		case ELEM_UINT8: VECTOR_ADD(uint8_t); break;
+		case ELEM_UINT32: VECTOR_ADD(uint32_t); break;
+		case ELEM_UINT64: VECTOR_ADD(uint64_t); break;
+		case ELEM_FLOAT: VECTOR_ADD(float); break;
+		case ELEM_DOUBLE: VECTOR_ADD(double); break;
+	}
+}
+
+#define CPU_BOUND(elem, calc) \
+	{ \
+		const elem* x = a; \
+		const elem* y = b; \
+		elem* z = c; \
+		for(i = 0; i < length; i++) \
+			z[i] = (calc) x[i] * CPU_BOUND_X_ADDS + (calc) y[i] * CPU_BOUND_Y_ADDS; \
+	}
+
+// What CPUBound.cl leaves in c, without doing every add. The inputs are small
+// integers, so the floating point products are exact like the kernel's sums.
+void elem_cpu_bound(enum elem_type_t type, const void* a, const void* b, void* c, size_t length)
+{
+	size_t i;
+	switch(type)
+	{
+		case ELEM_UINT8: CPU_BOUND(uint8_t, uint32_t); break;
+		case ELEM_UINT32: CPU_BOUND(uint32_t, uint32_t); break;
+		case ELEM_UINT64: CPU_BOUND(uint64_t, uint64_t); break;
+		case ELEM_FLOAT: CPU_BOUND(float, float); break;
+		case ELEM_DOUBLE: CPU_BOUND(double, double); break;
+	}
+}
+
+#define REDUCE(elem, total) \
+	{ \
+		const elem* x = a; \
+		for(i = 0; i < length; i++) \
+			total += x[i]; \
+	}
+
+// Floats are summed in double so the host answer is the more accurate one
+void elem_reduce(enum elem_type_t type, const void* a, size_t length, union elem_acc* sum)
+{
+	size_t i;
+	double total = 0;
+	sum->u = 0;
+	switch(type)
+	{
+		case ELEM_UINT8: REDUCE(uint8_t, sum->u); break;
+		case ELEM_UINT32: REDUCE(uint32_t, sum->u); break;
+		case ELEM_UINT64: REDUCE(uint64_t, sum->u); break;
+		case ELEM_FLOAT: REDUCE(float, total); sum->s = total; break;
+		case ELEM_DOUBLE: REDUCE(double, total); sum->f = total; break;
+	}
+}
+
+void elem_acc_add(enum elem_type_t type, union elem_acc* sum, const union elem_acc* value)
+{
+	if(type == ELEM_FLOAT)
+		sum->s += value->s;
+	else if(type == ELEM_DOUBLE)
+		sum->f += value->f;
+	else
+		sum->u += value->u;
+}
+
+// Integer totals must match exactly, floating point ones to a relative tolerance
+int elem_acc_equal(enum elem_type_t type, const union elem_acc* a, const union elem_acc* b)
+{
+	if(!elem_info(type)->is_float)
+		return a->u == b->u;
+	double x = elem_acc_value(type, a);
+	double y = elem_acc_value(type, b);
+	double tolerance = type == ELEM_FLOAT ? FLOAT_TOLERANCE : DOUBLE_TOLERANCE;
+	return fabs(x - y) <= tolerance * fmax(fabs(x), fabs(y));
+}
+
+double elem_acc_value(enum elem_type_t type, const union elem_acc* acc)
+{
+	if(type == ELEM_FLOAT)
+		return acc->s;
+	if(type == ELEM_DOUBLE)
+		return acc->f;
+	return acc->u;
+}
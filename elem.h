@@ -0,0 +1,41 @@
+#ifndef ELEM_H
+#define ELEM_H
+
+#include <stddef.h>
+
+//Times CPUBound.cl adds x and y into its accumulator
+#define CPU_BOUND_X_ADDS 501
+#define CPU_BOUND_Y_ADDS 500
+
+// Element types every workload can be built for
+enum elem_type_t { ELEM_UINT8, ELEM_UINT32, ELEM_UINT64, ELEM_FLOAT, ELEM_DOUBLE };
+
+// A reduction total. Integer types sum into u, float into s, double into f;
+// the first acc_size bytes are what the kernels write.
+union elem_acc
+{
+	unsigned long u;
+	float s;
+	double f;
+};
+
+struct elem_info
+{
+	const char* name;	//As given to ELEM_TYPE
+	size_t size;		//Bytes per element
+	size_t acc_size;	//Bytes per reduction accumulator
+	int is_float;
+	const char* options;	//Kernel build options defining ELEM, CALC and ACC
+};
+
+const struct elem_info* elem_info(enum elem_type_t type);
+int parse_elem_type(const char* name, enum elem_type_t* type);
+
+void elem_vector_add(enum elem_type_t type, const void* a, const void* b, void* c, size_t length);
+void elem_cpu_bound(enum elem_type_t type, const void* a, const void* b, void* c, size_t length);
+void elem_reduce(enum elem_type_t type, const void* a, size_t length, union elem_acc* sum);
+void elem_acc_add(enum elem_type_t type, union elem_acc* sum, const union elem_acc* value);
+int elem_acc_equal(enum elem_type_t type, const union elem_acc* a, const union elem_acc* b);
+double elem_acc_value(enum elem_type_t type, const union elem_acc* acc);
+
+#endif
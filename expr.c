@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "expr.h"
+
+void expr_init(struct expr_graph* g, enum elem_type_t type)
+{
+	memset(g, 0, sizeof(*g));
+	g->type = type;
+	g->root = -1;
+}
+
+// Append a node whose operands, -1 for none, must already be in the graph
+static int add_node(struct expr_graph* g, enum expr_op_t op, int x, int y)
+{
+	if(g->num_nodes == EXPR_MAX_NODES)
+	{
+		fprintf(stderr, "Error: expression has more than %d nodes\n", EXPR_MAX_NODES);
+		exit(1);
+	}
+	if(x < -1 || y < -1 || x >= g->num_nodes || y >= g->num_nodes)
+	{
+		fprintf(stderr, "Error: expression operand is not an earlier node\n");
+		exit(1);
+	}
+	struct expr_node* e = &g->nodes[g->num_nodes];
+	e->op = op;
+	e->args[0] = x;
+	e->args[1] = y;
+	e->input = 0;
+	e->value = 0;
+	return g->num_nodes++;
+}
+
+static int add_binary(struct expr_graph* g, enum expr_op_t op, int x, int y)
+{
+	if(x < 0 || y < 0)
+	{
+		fprintf(stderr, "Error: expression operand is missing\n");
+		exit(1);
+	}
+	return add_node(g, op, x, y);
+}
+
+int expr_input(struct expr_graph* g, int input)
+{
+	if(input < 0 || input >= EXPR_MAX_INPUTS)
+	{
+		fprintf(stderr, "Error: expressions read at most %d arrays\n", EXPR_MAX_INPUTS);
+		exit(1);
+	}
+	int n = add_node(g, EXPR_INPUT, -1, -1);
+	g->nodes[n].input = input;
+	if(input >= g->num_inputs)
+		g->num_inputs = input + 1;
+	return n;
+}
+
+// Integer types take the integer part of value
+int expr_const(struct expr_graph* g, double value)
+{
+	int n = add_node(g, EXPR_CONST, -1, -1);
+	g->nodes[n].value = value;
+	return n;
+}
+
+int expr_add(struct expr_graph* g, int x, int y)
+{
+	return add_binary(g, EXPR_ADD, x, y);
+}
+
+int expr_sub(struct expr_graph* g, int x, int y)
+{
+	return add_binary(g, EXPR_SUB, x, y);
+}
+
+int expr_mul(struct expr_graph* g, int x, int y)
+{
+	return add_binary(g, EXPR_MUL, x, y);
+}
+
+int expr_min(struct expr_graph* g, int x, int y)
+{
+	return add_binary(g, EXPR_MIN, x, y);
+}
+
+int expr_max(struct expr_graph* g, int x, int y)
+{
+	return add_binary(g, EXPR_MAX, x, y);
+}
+
+static void set_root(struct expr_graph* g, int root, int reduce)
+{
+	if(root < 0 || root >= g->num_nodes)
+	{
+		fprintf(stderr, "Error: expression root is not a node\n");
+		exit(1);
+	}
+	g->root = root;
+	g->reduce = reduce;
+}
+
+// Write the values of root to the output array
+void expr_store(struct expr_graph* g, int root)
+{
+	set_root(g, root, 0);
+}
+
+// Sum the values of root instead of writing them anywhere
+void expr_sum(struct expr_graph* g, int root)
+{
+	set_root(g, root, 1);
+}
+
+static void append(char* text, size_t len, const char* format, ...)
+{
+	size_t used = strlen(text);
+	if(used + 1 >= len)
+		return;
+	va_list args;
+	va_start(args, format);
+	vsnprintf(text + used, len - used, format, args);
+	va_end(args);
+}
+
+// Node n written out in text, either readably or as OpenCL C where inputs
+// are the locals x0, x1, ... and constants are cast to the macro argument T
+static void node_text(const struct expr_graph* g, int n, int code, int outer, char* text, size_t len)
+{
+	static const char* infix[] = { [EXPR_ADD] = "+", [EXPR_SUB] = "-", [EXPR_MUL] = "*" };
+	const struct expr_node* e = &g->nodes[n];
+	switch(e->op)
+	{
+		case EXPR_INPUT:
+			if(code)
+				append(text, len, "x%d", e->input);
+			else
+				append(text, len, "%c", 'a' + e->input);
+			break;
+		case EXPR_CONST:
+			//Integer values stay integer literals; others get an f suffix for
+			//float so they do not need double support
+			if(!code)
+				append(text, len, "%g", e->value);
+			else if(!elem_info(g->type)->is_float || e->value == (long) e->value)
+				append(text, len, "((T)(%ld))", (long) e->value);
+			else
+				append(text, len, "((T)(%.17g%s))", e->value, g->type == ELEM_FLOAT ? "f" : "");
+			break;
+		case EXPR_MIN:
+		case EXPR_MAX:
+			append(text, len, e->op == EXPR_MIN ? "min(" : "max(");
+			node_text(g, e->args[0], code, 1, text, len);
+			append(text, len, ", ");
+			node_text(g, e->args[1], code, 1, text, len);
+			append(text, len, ")");
+			break;
+		default:
+			append(text, len, outer ? "" : "(");
+			node_text(g, e->args[0], code, 0, text, len);
+			append(text, len, " %s ", infix[e->op]);
+			node_text(g, e->args[1], code, 0, text, len);
+			append(text, len, outer ? "" : ")");
+			break;
+	}
+}
+
+// The expression as it would be written by hand, e.g. "sum(a + b)"
+void expr_string(const struct expr_graph* g, char* text, size_t len)
+{
+	text[0] = 0;
+	if(g->root < 0)
+		return;
+	append(text, len, g->reduce ? "sum(" : "");
+	node_text(g, g->root, 0, 1, text, len);
+	append(text, len, g->reduce ? ")" : "");
+}
+
+// Where expr_parse has got to in its text
+struct parser
+{
+	struct expr_graph* g;
+	const char* p;
+};
+
+static void skip_space(struct parser* in)
+{
+	while(isspace((unsigned char) *in->p))
+		in->p++;
+}
+
+// Consume word if the text continues with it
+static int accept(struct parser* in, const char* word)
+{
+	skip_space(in);
+	size_t n = strlen(word);
+	if(strncmp(in->p, word, n) != 0)
+		return 0;
+	in->p += n;
+	return 1;
+}
+
+static int parse_sum(struct parser* in);
+
+// An input a to h, a number, min(x, y), max(x, y) or a bracketed expression.
+// Returns the node, or -1 on a syntax error.
+static int parse_operand(struct parser* in)
+{
+	skip_space(in);
+	const char* p = in->p;
+	if((accept(in, "min") || accept(in, "max")) && accept(in, "("))
+	{
+		int is_min = p[1] == 'i';
+		int x = parse_sum(in);
+		if(x < 0 || !accept(in, ","))
+			return -1;
+		int y = parse_sum(in);
+		if(y < 0 || !accept(in, ")"))
+			return -1;
+		return is_min ? expr_min(in->g, x, y) : expr_max(in->g, x, y);
+	}
+	in->p = p;
+	if(accept(in, "("))
+	{
+		int x = parse_sum(in);
+		return x >= 0 && accept(in, ")") ? x : -1;
+	}
+	if(*p >= 'a' && *p < 'a' + EXPR_MAX_INPUTS && !isalnum((unsigned char) p[1]))
+	{
+		in->p++;
+		return expr_input(in->g, *p - 'a');
+	}
+	if(isdigit((unsigned char) *p) || *p == '.' || (*p == '-' && (isdigit((unsigned char) p[1]) || p[1] == '.')))
+	{
+		char* end;
+		double value = strtod(p, &end);
+		in->p = end;
+		return expr_const(in->g, value);
+	}
+	return -1;
+}
+
+static int parse_product(struct parser* in)
+{
+	int x = parse_operand(in);
+	while(x >= 0 && accept(in, "*"))
+	{
+		int y = parse_operand(in);
+		x = y < 0 ? -1 : expr_mul(in->g, x, y);
+	}
+	return x;
+}
+
+static int parse_sum(struct parser* in)
+{
+	int x = parse_product(in);
+	while(x >= 0)
+	{
+		int add = accept(in, "+");
+		if(!add && !accept(in, "-"))
+			break;
+		int y = parse_product(in);
+		x = y < 0 ? -1 : add ? expr_add(in->g, x, y) : expr_sub(in->g, x, y);
+	}
+	return x;
+}
+
+// Record text, written the way expr_string writes expressions: inputs a to
+// h, numbers, +, -, *, min, max and brackets, all inside sum(...) to sum the
+// values instead of storing them. Returns 0 if text is not an expression.
+int expr_parse(struct expr_graph* g, const char* text)
+{
+	struct parser in = { g, text };
+	int reduce = accept(&in, "sum") && accept(&in, "(");
+	if(!reduce)
+		in.p = text;
+	int root = parse_sum(&in);
+	if(root < 0 || (reduce && !accept(&in, ")")))
+		return 0;
+	skip_space(&in);
+	if(*in.p != 0)
+		return 0;
+	if(reduce)
+		expr_sum(g, root);
+	else
+		expr_store(g, root);
+	return 1;
+}
+
+// OpenCL source of the fused kernel: the expression as macros, followed by
+// kernel_template, which builds the kernel out of them. INPUT_PARAMS declares
+// one parameter per input, LOAD_INPUTS(T, load) declares the locals x0, x1,
+// ... of type T from load(in0), load(in1), ... and EXPR(T) is the root's
+// value in type T. EXPR_SUM or EXPR_STORE says what is done with the values,
+// so a template written for the other fails to build. Returns a string to
+// free.
+char* expr_source(const struct expr_graph* g, const char* kernel_template)
+{
+	char defines[8192] = "";
+	char name[1024];
+	int i;
+	expr_string(g, name, sizeof(name));
+	append(defines, sizeof(defines), "// Generated for %s\n", name);
+	append(defines, sizeof(defines), "#define %s\n", g->reduce ? "EXPR_SUM" : "EXPR_STORE");
+	append(defines, sizeof(defines), "#define NUM_INPUTS %d\n#define INPUT_PARAMS", g->num_inputs);
+	for(i = 0; i < g->num_inputs; i++)
+		append(defines, sizeof(defines), " __global const ELEM* in%d,", i);
+	append(defines, sizeof(defines), "\n#define LOAD_INPUTS(T, load)");
+	for(i = 0; i < g->num_inputs; i++)
+		append(defines, sizeof(defines), " T x%d = load(in%d);", i, i);
+	append(defines, sizeof(defines), "\n#define EXPR(T) (");
+	node_text(g, g->root, 1, 1, defines, sizeof(defines));
+	append(defines, sizeof(defines), ")\n\n");
+	if(strlen(defines) + 1 >= sizeof(defines))
+	{
+		fprintf(stderr, "Error: expression source is too long\n");
+		exit(1);
+	}
+
+	char* source = malloc(strlen(defines) + strlen(kernel_template) + 1);
+	strcpy(source, defines);
+	strcat(source, kernel_template);
+	return source;
+}
+
+// Every node over a block of elements at a time, each loop simple enough for
+// the compiler to vectorise. Blocks are summed in acc like the kernels do
+// and the block sums in total, which is wider for floats.
+#define EVAL(elem, calc, acc, total_type, is_float) \
+	{ \
+		calc values[EXPR_MAX_NODES][EXPR_BLOCK]; \
+		total_type total = 0; \
+		size_t done, j; \
+		int k; \
+		for(done = 0; done < count; done += EXPR_BLOCK) \
+		{ \
+			size_t n = count - done < EXPR_BLOCK ? count - done : EXPR_BLOCK; \
+			size_t at = first + done; \
+			for(k = 0; k < g->num_nodes; k++) \
+			{ \
+				const struct expr_node* e = &g->nodes[k]; \
+				calc* restrict v = values[k]; \
+				const calc* x = values[e->args[0] >= 0 ? e->args[0] : k]; \
+				const calc* y = values[e->args[1] >= 0 ? e->args[1] : k]; \
+				calc c = is_float ? (calc) e->value : (calc) (long) e->value; \
+				switch(e->op) \
+				{ \
+					case EXPR_INPUT: \
+						for(j = 0; j < n; j++) \
+							v[j] = ((const elem*) inputs[e->input])[at + j]; \
+						break; \
+					case EXPR_CONST: \
+						for(j = 0; j < n; j++) \
+							v[j] = c; \
+						break; \
+					case EXPR_ADD: \
+						for(j = 0; j < n; j++) \
+							v[j] = x[j] + y[j]; \
+						break; \
+					case EXPR_SUB: \
+						for(j = 0; j < n; j++) \
+							v[j] = x[j] - y[j]; \
+						break; \
+					case EXPR_MUL: \
+						for(j = 0; j < n; j++) \
+							v[j] = x[j] * y[j]; \
+						break; \
+					case EXPR_MIN: \
+						for(j = 0; j < n; j++) \
+							v[j] = x[j] < y[j] ? x[j] : y[j]; \
+						break; \
+					case EXPR_MAX: \
+						for(j = 0; j < n; j++) \
+							v[j] = x[j] > y[j] ? x[j] : y[j]; \
+						break; \
+				} \
+			} \
+			const calc* r = values[g->root]; \
+			if(g->reduce) \
+			{ \
+				acc block = 0; \
+				for(j = 0; j < n; j++) \
+					block += r[j]; \
+				total += block; \
+			} \
+			else \
+				for(j = 0; j < n; j++) \
+					((elem*) output)[at + j] = r[j]; \
+		} \
+		if(g->reduce && sum && is_float && sizeof(acc) == sizeof(float)) \
+			sum->s = total; \
+		else if(g->reduce && sum && is_float) \
+			sum->f = total; \
+		else if(g->reduce && sum) \
+			sum->u = total; \
+	}
+
+// What the fused kernel computes for elements [first, first + count) of the
+// inputs: the root's values are written to the same elements of output, or
+// their sum to sum
+void expr_eval(const struct expr_graph* g, const void* const* inputs, void* output, size_t first, size_t count, union elem_acc* sum)
+{
+	switch(g->type)
+	{
+		case ELEM_UINT8: EVAL(uint8_t, uint32_t, uint64_t, uint64_t, 0); break;
+		case ELEM_UINT32: EVAL(uint32_t, uint32_t, uint64_t, uint64_t, 0); break;
+		case ELEM_UINT64: EVAL(uint64_t, uint64_t, uint64_t, uint64_t, 0); break;
+		case ELEM_FLOAT: EVAL(float, float, float, double, 1); break;
+		case ELEM_DOUBLE: EVAL(double, double, double, double, 1); break;
+	}
+}
@@ -0,0 +1,59 @@
+#ifndef EXPR_H
+#define EXPR_H
+
+#include <stddef.h>
+
+#include "elem.h"
+
+//Most nodes one expression can have
+#define EXPR_MAX_NODES 32
+
+//Most arrays one expression can read
+#define EXPR_MAX_INPUTS 8
+
+//Elements the host evaluates at a time, few enough that every node's values
+//stay in L1
+#define EXPR_BLOCK 128
+
+enum expr_op_t { EXPR_INPUT, EXPR_CONST, EXPR_ADD, EXPR_SUB, EXPR_MUL, EXPR_MIN, EXPR_MAX };
+
+// One node of an expression. Operands are earlier nodes, so the nodes are
+// always in an order they can be evaluated in.
+struct expr_node
+{
+	enum expr_op_t op;
+	int args[2];
+	int input;		//Array read by EXPR_INPUT
+	double value;		//Value of EXPR_CONST, in the element type's arithmetic
+};
+
+// Element-wise maps over equally long input arrays, recorded but not run.
+// The values of the root node are either written to an output array or
+// summed, in one pass that reads every input element once.
+struct expr_graph
+{
+	enum elem_type_t type;
+	struct expr_node nodes[EXPR_MAX_NODES];
+	int num_nodes;
+	int num_inputs;
+	int root;
+	int reduce;
+};
+
+void expr_init(struct expr_graph* g, enum elem_type_t type);
+int expr_input(struct expr_graph* g, int input);
+int expr_const(struct expr_graph* g, double value);
+int expr_add(struct expr_graph* g, int x, int y);
+int expr_sub(struct expr_graph* g, int x, int y);
+int expr_mul(struct expr_graph* g, int x, int y);
+int expr_min(struct expr_graph* g, int x, int y);
+int expr_max(struct expr_graph* g, int x, int y);
+void expr_store(struct expr_graph* g, int root);
+void expr_sum(struct expr_graph* g, int root);
+int expr_parse(struct expr_graph* g, const char* text);
+
+void expr_string(const struct expr_graph* g, char* text, size_t len);
+char* expr_source(const struct expr_graph* g, const char* kernel_template);
+void expr_eval(const struct expr_graph* g, const void* const* inputs, void* output, size_t first, size_t count, union elem_acc* sum);
+
+#endif
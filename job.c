@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "job.h"
+
+const char* job_socket_path()
+{
+	const char* path = getenv("BALANCER_SOCKET");
+	if(path == NULL || path[0] == 0)
+		path = JOB_SOCKET;
+	return path;
+}
+
+const char* job_kind_name(enum job_kind_t kind)
+{
+	return kind == JOB_VECTOR_ADD_PLUS ? "VectorAdd+" : "VectorAdd";
+}
+
+int parse_job_kind(const char* name, enum job_kind_t* kind)
+{
+	if(strcmp(name, "VectorAdd") == 0)
+		*kind = JOB_VECTOR_ADD;
+	else if(strcmp(name, "VectorAdd+") == 0 || strcmp(name, "VectorAddPlus") == 0)
+		*kind = JOB_VECTOR_ADD_PLUS;
+	else
+		return 0;
+	return 1;
+}
+
+// Write all size bytes of data. Returns 0 if the other end went away.
+int job_send(int fd, const void* data, size_t size)
+{
+	const char* p = data;
+	while(size > 0)
+	{
+		ssize_t n = write(fd, p, size);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return 0;
+		p += n;
+		size -= n;
+	}
+	return 1;
+}
+
+// Read exactly size bytes into data. Returns 0 on end of file or an error.
+int job_recv(int fd, void* data, size_t size)
+{
+	char* p = data;
+	while(size > 0)
+	{
+		ssize_t n = read(fd, p, size);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return 0;
+		p += n;
+		size -= n;
+	}
+	return 1;
+}
+
+// Map the shared memory object name, size bytes long. With create it is made
+// and sized first, replacing any object of the same name. Returns NULL if it
+// cannot be opened or mapped, or is shorter than size.
+unsigned char* job_map(const char* name, size_t size, int create)
+{
+	struct stat st;
+	int fd = create ? shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600) : shm_open(name, O_RDWR, 0);
+	if(fd < 0)
+		return NULL;
+	if(create && ftruncate(fd, size) != 0)
+	{
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+	//Touching a page past the end of the object would kill the daemon
+	if(!create && (fstat(fd, &st) != 0 || st.st_size < size))
+	{
+		close(fd);
+		return NULL;
+	}
+	void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return data == MAP_FAILED ? NULL : data;
+}
+
+void job_unmap(unsigned char* data, size_t size)
+{
+	munmap(data, size);
+}
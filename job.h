@@ -0,0 +1,47 @@
+#ifndef JOB_H
+#define JOB_H
+
+#include <stddef.h>
+
+//Socket the daemon listens on, overridden by $BALANCER_SOCKET
+#define JOB_SOCKET "/tmp/balancer.sock"
+
+//Longest shared memory object name a job can give
+#define JOB_NAME_SIZE 64
+
+// Workloads the daemon runs: the kernels of VectorAdd and VectorAddPlus
+enum job_kind_t { JOB_VECTOR_ADD, JOB_VECTOR_ADD_PLUS };
+
+// One job, sent over the socket. Its arrays are not: a, b and c lie one
+// after the other, length elements each, in the shared memory object shm.
+// The daemon writes c there before it replies.
+struct job_request
+{
+	enum job_kind_t kind;
+	int elem_type;		//An enum elem_type_t
+	unsigned long length;
+	unsigned long chunk;	//Elements per task, 0 for the daemon's default
+	char shm[JOB_NAME_SIZE];
+};
+
+// What the daemon did with a job
+struct job_reply
+{
+	int status;		//0 when c holds the result
+	char message[128];	//Why not, otherwise
+	float setup_time;	//Milliseconds mapping the arrays and warming up the element type
+	float run_time;		//Milliseconds scheduling and running the tasks
+	float gpu_share;	//Elements the GPUs processed
+	unsigned long uploaded;	//Elements copied to devices
+	unsigned long downloaded;	//and back to the host
+};
+
+const char* job_socket_path();
+const char* job_kind_name(enum job_kind_t kind);
+int parse_job_kind(const char* name, enum job_kind_t* kind);
+int job_send(int fd, const void* data, size_t size);
+int job_recv(int fd, void* data, size_t size);
+unsigned char* job_map(const char* name, size_t size, int create);
+void job_unmap(unsigned char* data, size_t size);
+
+#endif
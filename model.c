@@ -0,0 +1,120 @@
+#include "model.h"
+
+void fit_phase(struct phase_fit* fit, size_t n1, float t1, size_t n2, float t2)
+{
+	if(n2 > n1 && t2 > t1)
+		fit->rate = (n2 - n1) / (t2 - t1);
+	else
+		fit->rate = t2 > 0 ? n2 / t2 : 0;
+
+	fit->overhead = fit->rate > 0 ? t1 - n1 / fit->rate : t1;
+	if(fit->overhead < 0)
+		fit->overhead = 0;
+}
+
+// Least squares line through count probes. With no time growing with n it
+// falls back to the throughput of the largest probe, as fit_phase does.
+void fit_phase_points(struct phase_fit* fit, const size_t* n, const float* t, int count)
+{
+	double n_mean = 0, t_mean = 0;
+	int i, largest = 0;
+	for(i = 0; i < count; i++)
+	{
+		n_mean += n[i];
+		t_mean += t[i];
+		if(n[i] > n[largest])
+			largest = i;
+	}
+	n_mean /= count;
+	t_mean /= count;
+
+	double covariance = 0, variance = 0;
+	for(i = 0; i < count; i++)
+	{
+		covariance += (n[i] - n_mean) * (t[i] - t_mean);
+		variance += (n[i] - n_mean) * (n[i] - n_mean);
+	}
+	if(variance > 0 && covariance > 0)
+		fit->rate = variance / covariance;
+	else
+		fit->rate = t[largest] > 0 ? n[largest] / t[largest] : 0;
+
+	fit->overhead = fit->rate > 0 ? t_mean - n_mean / fit->rate : t_mean;
+	if(fit->overhead < 0)
+		fit->overhead = 0;
+}
+
+float phase_time(const struct phase_fit* fit, size_t n)
+{
+	if(n == 0)
+		return 0;
+	return fit->overhead + (fit->rate > 0 ? n / fit->rate : 0);
+}
+
+float model_time(const struct device_model* model, size_t n)
+{
+	return phase_time(&model->data, n) + phase_time(&model->exec, n);
+}
+
+static float element_time(const struct phase_fit* fit)
+{
+	return fit->rate > 0 ? 1 / fit->rate : 0;
+}
+
+// Fraction of the array to give each of n devices so that they are all
+// predicted to finish at the same time. A device whose fixed overhead alone
+// outlasts that finish time gets nothing and the rest are solved again.
+void solve_static_shares(const struct device_model* models, int n, size_t length, float* shares)
+{
+	int i;
+	int active = n;
+	for(i = 0; i < n; i++)
+	{
+		shares[i] = 1;
+		if(length * (element_time(&models[i].data) + element_time(&models[i].exec)) <= 0)
+			active = 0;
+	}
+	if(active == 0)
+	{
+		for(i = 0; i < n; i++)
+			shares[i] = 1.0f / n;
+		return;
+	}
+
+	float finish = 0;
+	int dropped = 1;
+	while(dropped)
+	{
+		// overhead_i + share_i * cost_i == finish for every active device, and
+		// the shares sum to one
+		float inverse_sum = 0;
+		float overhead_sum = 0;
+		for(i = 0; i < n; i++)
+		{
+			if(shares[i] <= 0)
+				continue;
+			float cost = length * (element_time(&models[i].data) + element_time(&models[i].exec));
+			inverse_sum += 1 / cost;
+			overhead_sum += (models[i].data.overhead + models[i].exec.overhead) / cost;
+		}
+		finish = (1 + overhead_sum) / inverse_sum;
+
+		dropped = 0;
+		for(i = 0; i < n; i++)
+		{
+			if(shares[i] > 0 && models[i].data.overhead + models[i].exec.overhead >= finish)
+			{
+				shares[i] = 0;
+				dropped = 1;
+			}
+		}
+	}
+
+	for(i = 0; i < n; i++)
+	{
+		if(shares[i] <= 0)
+			continue;
+		float cost = length * (element_time(&models[i].data) + element_time(&models[i].exec));
+		shares[i] = (finish - models[i].data.overhead - models[i].exec.overhead) / cost;
+	}
+}
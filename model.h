@@ -0,0 +1,27 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <stddef.h>
+
+// Linear cost of one phase of a chunk: time(n) = overhead + n / rate
+struct phase_fit
+{
+	float overhead;		//Milliseconds
+	float rate;		//Elements per millisecond
+};
+
+// Transfer and kernel cost of a device, kept apart the same way run_test
+// splits data_time and exec_time
+struct device_model
+{
+	struct phase_fit data;
+	struct phase_fit exec;
+};
+
+void fit_phase(struct phase_fit* fit, size_t n1, float t1, size_t n2, float t2);
+void fit_phase_points(struct phase_fit* fit, const size_t* n, const float* t, int count);
+float phase_time(const struct phase_fit* fit, size_t n);
+float model_time(const struct device_model* model, size_t n);
+void solve_static_shares(const struct device_model* models, int n, size_t length, float* shares);
+
+#endif
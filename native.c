@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <immintrin.h>
+
+#include "native.h"
+
+// Kernels for one instruction set, picked once by native_init
+struct native_isa
+{
+	const char* name;
+	void (*vector_add)(const unsigned char* a, const unsigned char* b, unsigned char* c, size_t length);
+	void (*cpu_bound)(const unsigned char* a, const unsigned char* b, unsigned char* c, size_t length);
+	unsigned long (*reduce)(const unsigned long* a, size_t length);
+};
+
+// Arguments of the job the team is running; each part works on its own slice
+struct native_job
+{
+	const void* a;
+	const void* b;
+	void* c;
+	size_t length;
+	size_t size;		//Bytes per element
+	enum elem_type_t type;
+	union elem_acc partials[NATIVE_MAX_THREADS + 1];
+	const struct expr_graph* graph;
+	const void* const* inputs;
+	size_t first;		//Element of the inputs the job starts at
+	void (*run)(struct native_job* job, size_t start, size_t end, int part);
+};
+
+// Helper threads pinned one per core. The calling thread runs part 0 itself.
+static struct
+{
+	pthread_t threads[NATIVE_MAX_THREADS];
+	int num_threads;
+	pthread_mutex_t mutex;	//Serialises callers and guards the fields below
+	pthread_mutex_t state;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned long generation;
+	int pending;
+	int quit;
+	struct native_job* job;
+} team;
+
+static struct native_isa isa;
+
+static void scalar_vector_add(const unsigned char* a, const unsigned char* b, unsigned char* c, size_t length)
+{
+	size_t i;
+	for(i = 0; i < length; i++)
+		c[i] = a[i] + b[i];
+}
+
+static void scalar_cpu_bound(const unsigned char* a, const unsigned char* b, unsigned char* c, size_t length)
+{
+	size_t i;
+	int k;
+	for(i = 0; i < length; i++)
+	{
+		unsigned int x = a[i];
+		unsigned int y = b[i];
+		unsigned int val = x;
+		for(k = 0; k < CPU_BOUND_Y_ADDS; k++)
+		{
+			val += y;
+			val += x;
+		}
+		c[i] = val;
+	}
+}
+
+static unsigned long scalar_reduce(const unsigned long* a, size_t length)
+{
+	unsigned long sum = 0;
+	size_t i;
+	for(i = 0; i < length; i++)
+		sum += a[i];
+	return sum;
+}
+
+__attribute__((target("avx2")))
+static void avx2_vector_add(const unsigned char* a, const unsigned char* b, unsigned char* c, size_t length)
+{
+	size_t i = 0;
+	for(; i + 32 <= length; i += 32)
+	{
+		__m256i x = _mm256_loadu_si256((const __m256i*) (a + i));
+		__m256i y = _mm256_loadu_si256((const __m256i*) (b + i));
+		_mm256_storeu_si256((__m256i*) (c + i), _mm256_add_epi8(x, y));
+	}
+	scalar_vector_add(a + i, b + i, c + i, length - i);
+}
+
+// Only the low byte of the kernel's accumulator is stored, so byte lanes
+// that wrap give the same answer after the same number of adds
+__attribute__((target("avx2")))
+static void avx2_cpu_bound(const unsigned char* a, const unsigned char* b, unsigned char* c, size_t length)
+{
+	size_t i = 0;
+	int k;
+	for(; i + 32 <= length; i += 32)
+	{
+		__m256i x = _mm256_loadu_si256((const __m256i*) (a + i));
+		__m256i y = _mm256_loadu_si256((const __m256i*) (b + i));
+		__m256i val = x;
+		for(k = 0; k < CPU_BOUND_Y_ADDS; k++)
+		{
+			val = _mm256_add_epi8(val, y);
+			val = _mm256_add_epi8(val, x);
+		}
+		_mm256_storeu_si256((__m256i*) (c + i), val);
+	}
+	scalar_cpu_bound(a + i, b + i, c + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static unsigned long avx2_reduce(const unsigned long* a, size_t length)
+{
+	__m256i acc0 = _mm256_setzero_si256();
+	__m256i acc1 = _mm256_setzero_si256();
+	size_t i = 0;
+	for(; i + 8 <= length; i += 8)
+	{
+		acc0 = _mm256_add_epi64(acc0, _mm256_loadu_si256((const __m256i*) (a + i)));
+		acc1 = _mm256_add_epi64(acc1, _mm256_loadu_si256((const __m256i*) (a + i + 4)));
+	}
+	unsigned long lanes[4];
+	_mm256_storeu_si256((__m256i*) lanes, _mm256_add_epi64(acc0, acc1));
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + scalar_reduce(a + i, length - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void avx512_vector_add(const unsigned char* a, const unsigned char* b, unsigned char* c, size_t length)
+{
+	size_t i = 0;
+	for(; i + 64 <= length; i += 64)
+	{
+		__m512i x = _mm512_loadu_si512(a + i);
+		__m512i y = _mm512_loadu_si512(b + i);
+		_mm512_storeu_si512(c + i, _mm512_add_epi8(x, y));
+	}
+	scalar_vector_add(a + i, b + i, c + i, length - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void avx512_cpu_bound(const unsigned char* a, const unsigned char* b, unsigned char* c, size_t length)
+{
+	size_t i = 0;
+	int k;
+	for(; i + 64 <= length; i += 64)
+	{
+		__m512i x = _mm512_loadu_si512(a + i);
+		__m512i y = _mm512_loadu_si512(b + i);
+		__m512i val = x;
+		for(k = 0; k < CPU_BOUND_Y_ADDS; k++)
+		{
+			val = _mm512_add_epi8(val, y);
+			val = _mm512_add_epi8(val, x);
+		}
+		_mm512_storeu_si512(c + i, val);
+	}
+	scalar_cpu_bound(a + i, b + i, c + i, length - i);
+}
+
+__attribute__((target("avx512f")))
+static unsigned long avx512_reduce(const unsigned long* a, size_t length)
+{
+	__m512i acc0 = _mm512_setzero_si512();
+	__m512i acc1 = _mm512_setzero_si512();
+	size_t i = 0;
+	for(; i + 16 <= length; i += 16)
+	{
+		acc0 = _mm512_add_epi64(acc0, _mm512_loadu_si512(a + i));
+		acc1 = _mm512_add_epi64(acc1, _mm512_loadu_si512(a + i + 8));
+	}
+	return _mm512_reduce_add_epi64(_mm512_add_epi64(acc0, acc1)) + scalar_reduce(a + i, length - i);
+}
+
+// Slice [start, end) of part out of parts, cut on NATIVE_GRANULARITY bytes so
+// no two threads write the same cache line
+static void part_range(size_t length, size_t size, int part, int parts, size_t* start, size_t* end)
+{
+	size_t step = NATIVE_GRANULARITY / size;
+	size_t steps = (length + step - 1) / step;
+	*start = steps * part / parts * step;
+	*end = steps * (part + 1) / parts * step;
+	if(*start > length)
+		*start = length;
+	if(*end > length)
+		*end = length;
+}
+
+static void run_part(struct native_job* job, int part)
+{
+	size_t start, end;
+	part_range(job->length, job->size, part, team.num_threads + 1, &start, &end);
+	job->run(job, start, end, part);
+}
+
+static void* team_main(void* argv)
+{
+	int part = (int) (size_t) argv;
+	unsigned long seen = 0;
+	while(1)
+	{
+		pthread_mutex_lock(&team.state);
+		while(team.generation == seen && !team.quit)
+			pthread_cond_wait(&team.start, &team.state);
+		if(team.quit)
+		{
+			pthread_mutex_unlock(&team.state);
+			return NULL;
+		}
+		seen = team.generation;
+		struct native_job* job = team.job;
+		pthread_mutex_unlock(&team.state);
+
+		run_part(job, part);
+
+		pthread_mutex_lock(&team.state);
+		if(--team.pending == 0)
+			pthread_cond_signal(&team.done);
+		pthread_mutex_unlock(&team.state);
+	}
+}
+
+// Split job across the team and wait for every part
+static void team_run(struct native_job* job)
+{
+	pthread_mutex_lock(&team.mutex);
+	pthread_mutex_lock(&team.state);
+	team.job = job;
+	team.pending = team.num_threads;
+	team.generation++;
+	pthread_cond_broadcast(&team.start);
+	pthread_mutex_unlock(&team.state);
+
+	run_part(job, 0);
+
+	pthread_mutex_lock(&team.state);
+	while(team.pending > 0)
+		pthread_cond_wait(&team.done, &team.state);
+	pthread_mutex_unlock(&team.state);
+	pthread_mutex_unlock(&team.mutex);
+}
+
+// Pick the widest kernels this CPU runs and start num_threads - 1 helper
+// threads, each pinned to its own core. 0 uses every online core.
+void native_init(int num_threads)
+{
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512bw"))
+	{
+		isa.name = "avx512";
+		isa.vector_add = avx512_vector_add;
+		isa.cpu_bound = avx512_cpu_bound;
+		isa.reduce = avx512_reduce;
+	}
+	else if(__builtin_cpu_supports("avx2"))
+	{
+		isa.name = "avx2";
+		isa.vector_add = avx2_vector_add;
+		isa.cpu_bound = avx2_cpu_bound;
+		isa.reduce = avx2_reduce;
+	}
+	else
+	{
+		isa.name = "scalar";
+		isa.vector_add = scalar_vector_add;
+		isa.cpu_bound = scalar_cpu_bound;
+		isa.reduce = scalar_reduce;
+	}
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if(num_threads <= 0)
+		num_threads = cores > 0 ? cores : 1;
+	if(num_threads > NATIVE_MAX_THREADS + 1)
+		num_threads = NATIVE_MAX_THREADS + 1;
+
+	pthread_mutex_init(&team.mutex, NULL);
+	pthread_mutex_init(&team.state, NULL);
+	pthread_cond_init(&team.start, NULL);
+	pthread_cond_init(&team.done, NULL);
+	team.generation = 0;
+	team.quit = 0;
+	team.num_threads = 0;
+
+	int i;
+	for(i = 1; i < num_threads; i++)
+	{
+		if(pthread_create(&team.threads[team.num_threads], NULL, team_main, (void*) (size_t) i) != 0)
+		{
+			fprintf(stderr, "Warning: started only %d native threads\n", i);
+			break;
+		}
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cores > 0 ? i % cores : 0, &cpus);
+		pthread_setaffinity_np(team.threads[team.num_threads], sizeof(cpus), &cpus);
+		team.num_threads++;
+	}
+}
+
+void native_shutdown()
+{
+	int i;
+	pthread_mutex_lock(&team.state);
+	team.quit = 1;
+	pthread_cond_broadcast(&team.start);
+	pthread_mutex_unlock(&team.state);
+	for(i = 0; i < team.num_threads; i++)
+		pthread_join(team.threads[i], NULL);
+	team.num_threads = 0;
+}
+
+// Threads working on each call, counting the caller
+int native_threads()
+{
+	return team.num_threads + 1;
+}
+
+const char* native_isa_name()
+{
+	return isa.name;
+}
+
+// The hand-written SIMD kernels cover the original element types: bytes for
+// the vector workloads and 64-bit integers for the reduction. Other types run
+// the generic loops in elem.c, which the compiler vectorises.
+static void vector_add_part(struct native_job* job, size_t start, size_t end, int part)
+{
+	const unsigned char* a = job->a;
+	const unsigned char* b = job->b;
+	unsigned char* c = job->c;
+	size_t at = start * job->size;
+	if(job->type == ELEM_UINT8)
+		isa.vector_add(a + at, b + at, c + at, end - start);
+	else
+		elem_vector_add(job->type, a + at, b + at, c + at, end - start);
+}
+
+static void cpu_bound_part(struct native_job* job, size_t start, size_t end, int part)
+{
+	const unsigned char* a = job->a;
+	const unsigned char* b = job->b;
+	unsigned char* c = job->c;
+	size_t at = start * job->size;
+	if(job->type == ELEM_UINT8)
+		isa.cpu_bound(a + at, b + at, c + at, end - start);
+	else
+		elem_cpu_bound(job->type, a + at, b + at, c + at, end - start);
+}
+
+static void reduce_part(struct native_job* job, size_t start, size_t end, int part)
+{
+	const unsigned char* a = job->a;
+	if(job->type == ELEM_UINT64)
+		job->partials[part].u = isa.reduce((const unsigned long*) a + start, end - start);
+	else
+		elem_reduce(job->type, a + start * job->size, end - start, &job->partials[part]);
+}
+
+void native_vector_add(const void* a, const void* b, void* c, size_t length, enum elem_type_t type)
+{
+	struct native_job job = { a, b, c, length, elem_info(type)->size, type };
+	job.run = vector_add_part;
+	team_run(&job);
+}
+
+// c = a * CPU_BOUND_X_ADDS + b * CPU_BOUND_Y_ADDS, one add at a time like CPUBound.cl
+void native_cpu_bound(const void* a, const void* b, void* c, size_t length, enum elem_type_t type)
+{
+	struct native_job job = { a, b, c, length, elem_info(type)->size, type };
+	job.run = cpu_bound_part;
+	team_run(&job);
+}
+
+void native_reduce(const void* a, size_t length, enum elem_type_t type, union elem_acc* sum)
+{
+	struct native_job job = { a, NULL, NULL, length, elem_info(type)->size, type };
+	job.run = reduce_part;
+	team_run(&job);
+
+	int i;
+	sum->u = 0;
+	for(i = 0; i < native_threads(); i++)
+		elem_acc_add(type, sum, &job.partials[i]);
+}
+
+static void expr_part(struct native_job* job, size_t start, size_t end, int part)
+{
+	expr_eval(job->graph, job->inputs, job->c, job->first + start, end - start, &job->partials[part]);
+}
+
+// Evaluate g over elements [first, first + length) of its inputs on the team.
+// Summing graphs leave the total in sum, the others write to output.
+void native_expr(const struct expr_graph* g, const void* const* inputs, void* output, size_t first, size_t length, union elem_acc* sum)
+{
+	struct native_job job = { NULL, NULL, output, length, elem_info(g->type)->size, g->type };
+	job.graph = g;
+	job.inputs = inputs;
+	job.first = first;
+	job.run = expr_part;
+	team_run(&job);
+	if(!g->reduce)
+		return;
+
+	int i;
+	sum->u = 0;
+	for(i = 0; i < native_threads(); i++)
+		elem_acc_add(g->type, sum, &job.partials[i]);
+}
@@ -0,0 +1,25 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include <stddef.h>
+
+#include "elem.h"
+#include "expr.h"
+
+//Most helper threads the native backend will start
+#define NATIVE_MAX_THREADS 64
+
+//Elements per native chunk step: one AVX-512 register of bytes
+#define NATIVE_GRANULARITY 64
+
+void native_init(int num_threads);
+void native_shutdown();
+int native_threads();
+const char* native_isa_name();
+
+void native_vector_add(const void* a, const void* b, void* c, size_t length, enum elem_type_t type);
+void native_cpu_bound(const void* a, const void* b, void* c, size_t length, enum elem_type_t type);
+void native_reduce(const void* a, size_t length, enum elem_type_t type, union elem_acc* sum);
+void native_expr(const struct expr_graph* g, const void* const* inputs, void* output, size_t first, size_t length, union elem_acc* sum);
+
+#endif
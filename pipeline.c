@@ -0,0 +1,53 @@
+#include "pipeline.h"
+
+// Events the next command of a chunk has to wait for
+cl_uint slot_wait_list(const struct slot_events* events, const cl_event** list)
+{
+	*list = events->last ? &events->last : NULL;
+	return events->last ? 1 : 0;
+}
+
+void slot_chain(struct slot_events* events, cl_event next)
+{
+	trace_command(events->track, next);
+	if(events->first == NULL)
+	{
+		clRetainEvent(next);
+		events->first = next;
+	}
+	if(events->last)
+		clReleaseEvent(events->last);
+	events->last = next;
+}
+
+void slot_reset(struct slot_events* events)
+{
+	if(events->first)
+		clReleaseEvent(events->first);
+	if(events->last)
+		clReleaseEvent(events->last);
+	events->first = NULL;
+	events->last = NULL;
+}
+
+// Milliseconds from the start of a chunk's first command to the end of its
+// last one. Needs a queue created with CL_QUEUE_PROFILING_ENABLE.
+float slot_latency(const struct slot_events* events)
+{
+	cl_ulong start, end;
+	if(events->first == NULL || events->last == NULL)
+		return 0;
+	int err = clGetEventProfilingInfo(events->first, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+	err |= clGetEventProfilingInfo(events->last, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+	if(err != CL_SUCCESS || end < start)
+		return 0;
+	return (end - start) / 1000000.0f;
+}
+
+// Bytes of the pool each of depth in-flight chunks may use, keeping every
+// slot origin a legal sub-buffer origin
+size_t pool_slot_size(const struct buffer_pool* pool, int depth)
+{
+	size_t size = pool->size / depth;
+	return size / pool->align * pool->align;
+}
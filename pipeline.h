@@ -0,0 +1,34 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/opencl.h>
+#endif
+
+#include "pool.h"
+#include "trace.h"
+
+#define MAX_PIPELINE_DEPTH 8
+
+// Commands of the chunk currently occupying a pipeline slot. Each command a
+// chunk enqueues waits on the previous one, so the chunk's stages can sit on
+// different queues and still run in order.
+struct slot_events
+{
+	cl_event first;		//First command of the chunk
+	cl_event last;		//Most recent command of the chunk
+	int track;		//Device track the commands are traced on
+};
+
+cl_uint slot_wait_list(const struct slot_events* events, const cl_event** list);
+void slot_chain(struct slot_events* events, cl_event next);
+void slot_reset(struct slot_events* events);
+float slot_latency(const struct slot_events* events);
+
+size_t pool_slot_size(const struct buffer_pool* pool, int depth);
+
+#endif
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+#define CHKERR(err, str) \
+	if (err != CL_SUCCESS) \
+	{ \
+		fprintf(stdout, "CL Error %d: %s\n", err, str); \
+		exit(1); \
+	}
+
+// Allocate up to wanted bytes, capped by CL_DEVICE_MAX_MEM_ALLOC_SIZE. If the
+// device cannot back that much, keep halving until an allocation succeeds.
+void pool_create(struct buffer_pool* pool, cl_context context, cl_device_id device, cl_mem_flags flags, size_t wanted)
+{
+	cl_ulong max_alloc;
+	cl_uint align_bits;
+	int err;
+
+	err = clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc, NULL);
+	err |= clGetDeviceInfo(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &align_bits, NULL);
+	CHKERR(err, "Failed to query device memory limits!");
+
+	pool->context = context;
+	pool->flags = flags;
+	pool->host = NULL;
+	pool->align = align_bits / 8 > 0 ? align_bits / 8 : 1;
+	pool->size = wanted < max_alloc ? wanted : max_alloc;
+	pool->buffer = NULL;
+
+	while(pool->size > 0)
+	{
+		pool->buffer = clCreateBuffer(context, flags, pool->size, NULL, &err);
+		if(err == CL_SUCCESS)
+			return;
+		if(err != CL_MEM_OBJECT_ALLOCATION_FAILURE && err != CL_OUT_OF_RESOURCES && err != CL_INVALID_BUFFER_SIZE)
+			CHKERR(err, "Failed to create buffer pool!");
+		pool->size /= 2;
+	}
+	pool->buffer = NULL;
+}
+
+// Wrap a host array for a device that shares memory with the host
+// (CL_DEVICE_HOST_UNIFIED_MEMORY), so kernels read and write it in place.
+// Returns 0 if the device cannot, in which case the pool is left empty.
+int pool_wrap(struct buffer_pool* pool, cl_context context, cl_device_id device, cl_mem_flags flags, void* host, size_t size)
+{
+	cl_bool unified = CL_FALSE;
+	cl_ulong max_alloc = 0;
+	int err;
+
+	pool->buffer = NULL;
+	pool->host = NULL;
+	pool->size = 0;
+
+	err = clGetDeviceInfo(device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &unified, NULL);
+	err |= clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc, NULL);
+	if(err != CL_SUCCESS || !unified || size > max_alloc)
+		return 0;
+
+	pool->buffer = clCreateBuffer(context, flags | CL_MEM_USE_HOST_PTR, size, host, &err);
+	if(err != CL_SUCCESS)
+	{
+		pool->buffer = NULL;
+		return 0;
+	}
+
+	pool->context = context;
+	pool->flags = flags;
+	pool->host = host;
+	pool->size = size;
+	pool->align = 1;
+	return 1;
+}
+
+void pool_release(struct buffer_pool* pool)
+{
+	if(pool->buffer)
+		clReleaseMemObject(pool->buffer);
+	pool->buffer = NULL;
+	pool->host = NULL;
+	pool->size = 0;
+}
+
+// Return a buffer covering [origin, origin + size) of the pool. Release it
+// with clReleaseMemObject when the chunk is done; the pool memory stays.
+cl_mem pool_view(struct buffer_pool* pool, size_t origin, size_t size)
+{
+	cl_mem view;
+	int err;
+
+	if(pool->buffer == NULL || origin + size > pool->size)
+	{
+		//Chunk is larger than the pool, fall back to a one-off allocation
+		view = clCreateBuffer(pool->context, pool->flags, size, NULL, &err);
+		CHKERR(err, "Failed to create chunk buffer!");
+		return view;
+	}
+
+	cl_buffer_region region = {origin, size};
+	view = clCreateSubBuffer(pool->buffer, 0, CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+	CHKERR(err, "Failed to create chunk sub-buffer!");
+	return view;
+}
+
+// The whole pool buffer, retained so it can be released like a view
+cl_mem pool_whole(struct buffer_pool* pool)
+{
+	clRetainMemObject(pool->buffer);
+	return pool->buffer;
+}
+
+// Make host writes to a wrapped array visible to its device. On unified
+// memory the map returns the host array itself, so no bytes are moved.
+void pool_publish(struct buffer_pool* pool, cl_command_queue queue)
+{
+	if(pool->host == NULL)
+		return;
+
+	int err;
+	void* mapped = clEnqueueMapBuffer(queue, pool->buffer, CL_TRUE, CL_MAP_WRITE, 0, pool->size, 0, NULL, NULL, &err);
+	CHKERR(err, "Failed to map host buffer!");
+	err = clEnqueueUnmapMemObject(queue, pool->buffer, mapped, 0, NULL, NULL);
+	CHKERR(err, "Failed to unmap host buffer!");
+	clFinish(queue);
+}
+
+// Page-aligned host allocation, which zero-copy drivers need to use the
+// memory in place instead of shadowing it
+void* host_alloc(size_t size)
+{
+	void* ptr = NULL;
+	long page = sysconf(_SC_PAGESIZE);
+	if(posix_memalign(&ptr, page > 0 ? page : 4096, size > 0 ? size : 1) != 0)
+		return NULL;
+	return ptr;
+}
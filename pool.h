@@ -0,0 +1,32 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/opencl.h>
+#endif
+
+// One persistent device allocation that chunk buffers are carved out of
+struct buffer_pool
+{
+	cl_context context;
+	cl_mem buffer;
+	cl_mem_flags flags;
+	void* host;		//Host array the buffer wraps for zero-copy devices, or NULL
+	size_t size;		//Bytes
+	size_t align;		//Bytes, sub-buffer origins must be a multiple of this
+};
+
+void pool_create(struct buffer_pool* pool, cl_context context, cl_device_id device, cl_mem_flags flags, size_t wanted);
+int pool_wrap(struct buffer_pool* pool, cl_context context, cl_device_id device, cl_mem_flags flags, void* host, size_t size);
+void pool_release(struct buffer_pool* pool);
+cl_mem pool_view(struct buffer_pool* pool, size_t origin, size_t size);
+cl_mem pool_whole(struct buffer_pool* pool);
+void pool_publish(struct buffer_pool* pool, cl_command_queue queue);
+
+void* host_alloc(size_t size);
+
+#endif
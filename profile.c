@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "profile.h"
+
+const char* profile_path()
+{
+	const char* path = getenv("PROFILE_FILE");
+	if(path == NULL || path[0] == 0)
+		path = PROFILE_FILE;
+	return path;
+}
+
+// Name a worker's calibrations are filed under: its label and the device's
+// name, so a different card in the same slot is measured again
+void profile_key(const struct worker* w, char* key, size_t len)
+{
+	char name[256] = "native";
+	if(!w->native && clGetDeviceInfo(w->device, CL_DEVICE_NAME, sizeof(name), name, NULL) != CL_SUCCESS)
+		strcpy(name, "unknown");
+	name[sizeof(name) - 1] = 0;
+	snprintf(key, len, "%s:%s", w->name, name);
+	for(; *key; key++)
+		if(!isalnum((unsigned char) *key) && *key != ':' && *key != '.' && *key != '-')
+			*key = '_';
+}
+
+static int parse_line(const char* line, char* workload, char* type, char* key, struct device_profile* p)
+{
+	if(line[0] == '#')
+		return 0;
+	return sscanf(line, "%63s %31s %255s %f %f %f %f %f %f %f", workload, type, key,
+		&p->upload.overhead, &p->upload.rate, &p->exec.overhead, &p->exec.rate,
+		&p->download.overhead, &p->download.rate, &p->jitter) == 10;
+}
+
+// Look up the calibration of one worker for a workload and element type.
+// Returns 0 if the file has none.
+int profile_load(const char* path, const char* workload, const char* type, const char* key, struct device_profile* profile)
+{
+	FILE* file = fopen(path, "r");
+	if(!file)
+		return 0;
+	char line[1024], w[64], t[32], k[256];
+	struct device_profile p;
+	int found = 0;
+	while(!found && fgets(line, sizeof(line), file))
+	{
+		if(parse_line(line, w, t, k, &p) && strcmp(w, workload) == 0 && strcmp(t, type) == 0 && strcmp(k, key) == 0)
+		{
+			*profile = p;
+			found = 1;
+		}
+	}
+	fclose(file);
+	return found;
+}
+
+// Add or replace one calibration. The file is rewritten under a temporary
+// name and renamed, so concurrent runs never read half a file.
+void profile_save(const char* path, const char* workload, const char* type, const char* key, const struct device_profile* profile)
+{
+	char tmp[1100];
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+	FILE* out = fopen(tmp, "w");
+	if(!out)
+	{
+		fprintf(stderr, "Warning: could not write the profile %s\n", path);
+		return;
+	}
+	fprintf(out, "#workload\ttype\tdevice\tupload_ms\tupload_rate\tlaunch_ms\texec_rate\tdownload_ms\tdownload_rate\tjitter\n");
+
+	FILE* in = fopen(path, "r");
+	if(in)
+	{
+		char line[1024], w[64], t[32], k[256];
+		struct device_profile p;
+		while(fgets(line, sizeof(line), in))
+		{
+			if(!parse_line(line, w, t, k, &p))
+				continue;
+			if(strcmp(w, workload) != 0 || strcmp(t, type) != 0 || strcmp(k, key) != 0)
+				fputs(line, out);
+		}
+		fclose(in);
+	}
+	fprintf(out, "%s\t%s\t%s\t%g\t%g\t%g\t%g\t%g\t%g\t%g\n", workload, type, key,
+		profile->upload.overhead, profile->upload.rate, profile->exec.overhead, profile->exec.rate,
+		profile->download.overhead, profile->download.rate, profile->jitter);
+
+	int ok = fclose(out) == 0;
+	if(!ok || rename(tmp, path) != 0)
+	{
+		unlink(tmp);
+		fprintf(stderr, "Warning: could not write the profile %s\n", path);
+	}
+}
+
+static float element_time(const struct phase_fit* fit)
+{
+	return fit->rate > 0 ? 1 / fit->rate : 0;
+}
+
+// Fold the two transfers into the data phase run_test reports
+void profile_model(const struct device_profile* profile, struct device_model* model)
+{
+	float transfer = element_time(&profile->upload) + element_time(&profile->download);
+	model->data.overhead = profile->upload.overhead + profile->download.overhead;
+	model->data.rate = transfer > 0 ? 1 / transfer : 0;
+	model->exec = profile->exec;
+}
+
+// Predicted finish of a static split over the workers marked in use, with
+// their shares of the array in shares. Several workers finish together only
+// as well as the model holds, so the prediction is stretched by the worst
+// jitter among them. Returns -1 if no worker is in use.
+static float static_time(const struct device_model* models, const struct device_profile* profiles, const int* use, int n, size_t length, float* shares)
+{
+	struct device_model used[MAX_WORKERS];
+	float used_shares[MAX_WORKERS];
+	int map[MAX_WORKERS];
+	int i, k = 0;
+	for(i = 0; i < n; i++)
+	{
+		shares[i] = 0;
+		if(use[i])
+		{
+			map[k] = i;
+			used[k++] = models[i];
+		}
+	}
+	if(k == 0)
+		return -1;
+	solve_static_shares(used, k, length, used_shares);
+
+	float finish = 0;
+	float jitter = 0;
+	for(i = 0; i < k; i++)
+	{
+		shares[map[i]] = used_shares[i];
+		float t = model_time(&used[i], (size_t) (length * used_shares[i]));
+		if(t > finish)
+			finish = t;
+		if(used_shares[i] > 0 && profiles[map[i]].jitter > jitter)
+			jitter = profiles[map[i]].jitter;
+	}
+	return k > 1 ? finish * (1 + jitter) : finish;
+}
+
+// Predicted finish of the dynamic scheme with chunks of chunk elements.
+// Every chunk pays each worker's fixed costs again, and the last chunk to
+// start may leave the others idle for half of it.
+static float dynamic_time(const struct device_model* models, int n, size_t length, size_t chunk)
+{
+	float throughput = 0;
+	float tail = 0;
+	int i;
+	for(i = 0; i < n; i++)
+	{
+		float t = model_time(&models[i], chunk);
+		if(t > 0)
+			throughput += chunk / t;
+		if(t / 2 > tail)
+			tail = t / 2;
+	}
+	return throughput > 0 ? length / throughput + tail : -1;
+}
+
+// Predict every scheme for a job of length elements and pick the fastest.
+// Dynamic chunk sizes are tried from granularity up, doubling.
+void choose_scheme(const struct worker* workers, const struct device_profile* profiles, int n, size_t length, size_t granularity, struct scheme_choice* choice)
+{
+	struct device_model models[MAX_WORKERS];
+	int cpus[MAX_WORKERS], gpus[MAX_WORKERS], all[MAX_WORKERS];
+	float shares[MAX_WORKERS];
+	int i, s;
+	for(i = 0; i < n; i++)
+	{
+		profile_model(&profiles[i], &models[i]);
+		cpus[i] = !workers[i].isGPU;
+		gpus[i] = workers[i].isGPU;
+		all[i] = 1;
+	}
+
+	const int* use[3] = { cpus, gpus, all };
+	memset(choice, 0, sizeof(*choice));
+	choice->scheme = -1;
+	for(s = 0; s < 3; s++)
+	{
+		choice->predicted[s] = static_time(models, profiles, use[s], n, length, shares);
+		if(choice->predicted[s] >= 0 && (choice->scheme < 0 || choice->predicted[s] < choice->predicted[choice->scheme]))
+		{
+			choice->scheme = s;
+			memcpy(choice->shares, shares, sizeof(float) * n);
+		}
+	}
+
+	size_t chunk;
+	if(granularity == 0)
+		granularity = 1;
+	choice->predicted[3] = -1;
+	for(chunk = granularity; ; chunk *= 2)
+	{
+		size_t size = chunk < length ? chunk : length;
+		float t = dynamic_time(models, n, length, size);
+		if(t >= 0 && (choice->predicted[3] < 0 || t < choice->predicted[3]))
+		{
+			choice->predicted[3] = t;
+			choice->chunk = size;
+		}
+		//Past a chunk per worker there is nothing left to balance
+		if(size * n >= length)
+			break;
+	}
+	if(choice->predicted[3] >= 0 && (choice->scheme < 0 || choice->predicted[3] < choice->predicted[choice->scheme]))
+		choice->scheme = 3;
+}
@@ -0,0 +1,42 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stddef.h>
+
+#include "model.h"
+#include "devices.h"
+
+//File calibrations are kept in, overridden by $PROFILE_FILE
+#define PROFILE_FILE ".balancer_profile"
+
+//Chunk sizes each worker is measured at
+#define PROFILE_SIZES 4
+
+// What one chunk of a workload costs on one worker, phase by phase. The
+// kernel's overhead is its launch latency and its rate its throughput.
+struct device_profile
+{
+	struct phase_fit upload;	//Host to device
+	struct phase_fit exec;
+	struct phase_fit download;	//Device to host
+	float jitter;			//Spread of repeated runs, relative to the fastest
+};
+
+// The scheme the model predicts to finish first, numbered as in argv[3]:
+// 0 CPUs only, 1 GPUs only, 2 static split, 3 dynamic
+struct scheme_choice
+{
+	int scheme;
+	float shares[MAX_WORKERS];	//Split for schemes 0 to 2, 0 for unused workers
+	size_t chunk;			//Elements per chunk for scheme 3
+	float predicted[4];		//Milliseconds per scheme, negative if it has no workers
+};
+
+const char* profile_path();
+void profile_key(const struct worker* w, char* key, size_t len);
+int profile_load(const char* path, const char* workload, const char* type, const char* key, struct device_profile* profile);
+void profile_save(const char* path, const char* workload, const char* type, const char* key, const struct device_profile* profile);
+void profile_model(const struct device_profile* profile, struct device_model* model);
+void choose_scheme(const struct worker* workers, const struct device_profile* profiles, int n, size_t length, size_t granularity, struct scheme_choice* choice);
+
+#endif
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "progcache.h"
+
+struct program_cache_stats program_cache_stats;
+
+static unsigned long long fnv1a(unsigned long long hash, const char* str)
+{
+	//Hash the terminator too, so ("ab", "c") and ("a", "bc") differ
+	do
+	{
+		hash ^= (unsigned char) *str;
+		hash *= 1099511628211ULL;
+	} while(*str++);
+	return hash;
+}
+
+static void device_string(cl_device_id device, cl_device_info param, char* buf, size_t len)
+{
+	if(clGetDeviceInfo(device, param, len, buf, NULL) != CL_SUCCESS)
+		buf[0] = 0;
+	buf[len - 1] = 0;
+}
+
+// Cache file for a program: hash of the source, build options, device name
+// and driver version, so a driver upgrade or kernel edit forces a rebuild
+static void cache_path(cl_device_id device, const char* source, const char* options, char* path, size_t len)
+{
+	char name[256];
+	char driver[256];
+	device_string(device, CL_DEVICE_NAME, name, sizeof(name));
+	device_string(device, CL_DRIVER_VERSION, driver, sizeof(driver));
+
+	unsigned long long hash = 14695981039346656037ULL;
+	hash = fnv1a(hash, source);
+	hash = fnv1a(hash, options ? options : "");
+	hash = fnv1a(hash, name);
+	hash = fnv1a(hash, driver);
+
+	const char* dir = getenv("KERNEL_CACHE_DIR");
+	if(dir == NULL || dir[0] == 0)
+		dir = KERNEL_CACHE_DIR;
+	snprintf(path, len, "%s/%016llx.bin", dir, hash);
+}
+
+static unsigned char* read_binary(const char* path, size_t* size)
+{
+	FILE* file = fopen(path, "rb");
+	if(!file)
+		return NULL;
+	fseek(file, 0, SEEK_END);
+	long length = ftell(file);
+	rewind(file);
+	if(length <= 0)
+	{
+		fclose(file);
+		return NULL;
+	}
+
+	unsigned char* binary = malloc(length);
+	if(fread(binary, length, 1, file) != 1)
+	{
+		free(binary);
+		fclose(file);
+		return NULL;
+	}
+	fclose(file);
+	*size = length;
+	return binary;
+}
+
+// Store the program's binary. Written to a temporary file and renamed into
+// place so a concurrent run never loads a half-written binary.
+static void write_binary(cl_program program, const char* path)
+{
+	size_t size = 0;
+	if(clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &size, NULL) != CL_SUCCESS || size == 0)
+		return;
+
+	unsigned char* binary = malloc(size);
+	if(clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char*), &binary, NULL) != CL_SUCCESS)
+	{
+		free(binary);
+		return;
+	}
+
+	char dir[1024];
+	strncpy(dir, path, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = 0;
+	char* slash = strrchr(dir, '/');
+	if(slash)
+	{
+		*slash = 0;
+		if(mkdir(dir, 0755) != 0 && errno != EEXIST)
+		{
+			free(binary);
+			return;
+		}
+	}
+
+	char tmp[1100];
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+	FILE* file = fopen(tmp, "wb");
+	if(file)
+	{
+		int ok = fwrite(binary, size, 1, file) == 1;
+		ok &= fclose(file) == 0;
+		if(!ok || rename(tmp, path) != 0)
+			unlink(tmp);
+	}
+	free(binary);
+}
+
+// Build a program for one device, loading a previously compiled binary from
+// the cache when there is one. *err is the result of clBuildProgram.
+cl_program build_cached_program(cl_context context, cl_device_id device, const char* source, const char* options, cl_int* err)
+{
+	struct timespec time_start, time_end;
+	char path[1024];
+	cl_program program = NULL;
+	size_t size;
+
+	clock_gettime(CLOCK_REALTIME, &time_start);
+	cache_path(device, source, options, path, sizeof(path));
+
+	unsigned char* binary = read_binary(path, &size);
+	if(binary)
+	{
+		cl_int status;
+		program = clCreateProgramWithBinary(context, 1, &device, &size, (const unsigned char**) &binary, &status, err);
+		free(binary);
+		if(*err == CL_SUCCESS && status == CL_SUCCESS)
+			*err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+		if(*err == CL_SUCCESS)
+		{
+			program_cache_stats.hits++;
+		}
+		else
+		{
+			//Stale or foreign binary, rebuild from source and replace it
+			if(program)
+				clReleaseProgram(program);
+			program = NULL;
+		}
+	}
+
+	if(program == NULL)
+	{
+		program_cache_stats.misses++;
+		program = clCreateProgramWithSource(context, 1, &source, NULL, err);
+		if(*err == CL_SUCCESS)
+			*err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+		if(*err == CL_SUCCESS)
+			write_binary(program, path);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &time_end);
+	program_cache_stats.build_time += (time_end.tv_sec - time_start.tv_sec) * 1000.0f + (time_end.tv_nsec - time_start.tv_nsec) / 1000000.0f;
+	return program;
+}
@@ -0,0 +1,24 @@
+#ifndef PROGCACHE_H
+#define PROGCACHE_H
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/opencl.h>
+#endif
+
+//Directory compiled programs are kept in, overridden by $KERNEL_CACHE_DIR
+#define KERNEL_CACHE_DIR ".kernel_cache"
+
+struct program_cache_stats
+{
+	int hits;
+	int misses;
+	float build_time;	//Milliseconds spent loading or building programs
+};
+
+extern struct program_cache_stats program_cache_stats;
+
+cl_program build_cached_program(cl_context context, cl_device_id device, const char* source, const char* options, cl_int* err);
+
+#endif
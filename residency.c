@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "residency.h"
+
+void residency_init(struct residency* r, size_t length)
+{
+	memset(r, 0, sizeof(*r));
+	r->length = length;
+	residency_reset(r);
+}
+
+void residency_destroy(struct residency* r)
+{
+	free(r->segments);
+	r->segments = NULL;
+	r->count = 0;
+	r->max = 0;
+}
+
+// The host copy is the only one: it was just written, or the device copies
+// no longer matter
+void residency_reset(struct residency* r)
+{
+	if(r->max == 0)
+	{
+		r->max = 16;
+		r->segments = malloc(sizeof(*r->segments) * r->max);
+	}
+	r->count = 1;
+	r->segments[0].start = 0;
+	r->segments[0].end = r->length;
+	r->segments[0].valid = 1u << RESIDENCY_HOST;
+	r->segments[0].writer = -1;
+	r->segments[0].num_readers = 0;
+}
+
+// Index of the segment holding element at, which must be in the array
+int residency_find(const struct residency* r, size_t at)
+{
+	int low = 0, high = r->count - 1;
+	while(low < high)
+	{
+		int mid = (low + high + 1) / 2;
+		if(r->segments[mid].start <= at)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	return low;
+}
+
+// Cut the segment holding at in two so that one of them starts at at
+static void split(struct residency* r, size_t at)
+{
+	if(at == 0 || at >= r->length)
+		return;
+	int i = residency_find(r, at);
+	if(r->segments[i].start == at)
+		return;
+	if(r->count == r->max)
+	{
+		r->max *= 2;
+		r->segments = realloc(r->segments, sizeof(*r->segments) * r->max);
+		if(r->segments == NULL)
+		{
+			fprintf(stderr, "Error: out of memory for the residency map\n");
+			exit(1);
+		}
+	}
+	memmove(&r->segments[i + 1], &r->segments[i], sizeof(*r->segments) * (r->count - i));
+	r->count++;
+	r->segments[i].end = at;
+	r->segments[i + 1].start = at;
+}
+
+// Make [start, end) exactly cover whole segments. Returns how many, with the
+// index of the first in first.
+int residency_range(struct residency* r, size_t start, size_t end, int* first)
+{
+	int i;
+	*first = r->count;
+	if(start >= end || start >= r->length)
+		return 0;
+	split(r, start);
+	split(r, end);
+	*first = residency_find(r, start);
+	for(i = *first; i < r->count && r->segments[i].end <= end; i++)
+		;
+	return i - *first;
+}
+
+// Whether two segments hold the same copies, written and read by the same tasks
+static int same(const struct residency_segment* x, const struct residency_segment* y)
+{
+	return x->valid == y->valid && x->writer == y->writer && x->num_readers == y->num_readers
+		&& memcmp(x->readers, y->readers, sizeof(int) * (x->num_readers < RESIDENCY_READERS ? x->num_readers : RESIDENCY_READERS)) == 0;
+}
+
+// Join the neighbouring segments among [from, to) that are the same
+static void coalesce(struct residency* r, int from, int to)
+{
+	int i, n = from;
+	for(i = from; i < to; i++)
+	{
+		struct residency_segment* last = n > from ? &r->segments[n - 1] : NULL;
+		if(last && same(last, &r->segments[i]))
+			last->end = r->segments[i].end;
+		else
+			r->segments[n++] = r->segments[i];
+	}
+	memmove(&r->segments[n], &r->segments[to], sizeof(*r->segments) * (r->count - to));
+	r->count -= to - n;
+}
+
+// Elements [start, end) were written at location, which now holds the only
+// up-to-date copy. They become one segment, joined with its neighbours if
+// they match, so rewriting a range does not leave the cuts earlier tasks made.
+void residency_write(struct residency* r, size_t start, size_t end, int location, int writer)
+{
+	int first, i;
+	int n = residency_range(r, start, end, &first);
+	for(i = first; i < first + n; i++)
+	{
+		r->segments[i].valid = 1u << location;
+		r->segments[i].writer = writer;
+		r->segments[i].num_readers = 0;
+	}
+	if(n > 0)
+		coalesce(r, first > 0 ? first - 1 : first, first + n < r->count ? first + n + 1 : first + n);
+}
+
+// Remember that reader read the elements of one segment
+void residency_read(struct residency* r, int segment, int reader)
+{
+	struct residency_segment* s = &r->segments[segment];
+	if(s->num_readers > 0 && s->num_readers <= RESIDENCY_READERS && s->readers[s->num_readers - 1] == reader)
+		return;
+	if(s->num_readers < RESIDENCY_READERS)
+		s->readers[s->num_readers] = reader;
+	if(s->num_readers <= RESIDENCY_READERS)
+		s->num_readers++;
+}
+
+// Join neighbouring segments with the same copies, writer and readers
+void residency_merge(struct residency* r)
+{
+	coalesce(r, 0, r->count);
+}
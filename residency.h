@@ -0,0 +1,42 @@
+#ifndef RESIDENCY_H
+#define RESIDENCY_H
+
+#include <stddef.h>
+
+//Location of the host copy; devices are locations 0 up to it
+#define RESIDENCY_HOST 31
+
+//Most readers one segment remembers since it was last written
+#define RESIDENCY_READERS 16
+
+// Elements [start, end) of an array, with the same copies everywhere
+struct residency_segment
+{
+	size_t start;
+	size_t end;
+	unsigned int valid;	//Bit per location holding an up-to-date copy
+	int writer;		//Task that last wrote the elements, -1 for none
+	int readers[RESIDENCY_READERS];	//Tasks that read them since
+	int num_readers;	//More than RESIDENCY_READERS once some were lost
+};
+
+// Where the up-to-date copies of each range of one array are. A range not
+// valid on the host is dirty: only a device holds its latest values.
+struct residency
+{
+	struct residency_segment* segments;	//Sorted, covering the whole array
+	int count;
+	int max;
+	size_t length;
+};
+
+void residency_init(struct residency* r, size_t length);
+void residency_destroy(struct residency* r);
+void residency_reset(struct residency* r);
+int residency_find(const struct residency* r, size_t at);
+int residency_range(struct residency* r, size_t start, size_t end, int* first);
+void residency_write(struct residency* r, size_t start, size_t end, int location, int writer);
+void residency_read(struct residency* r, int segment, int reader);
+void residency_merge(struct residency* r);
+
+#endif
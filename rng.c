@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "rng.h"
+
+//Most threads one fill starts
+#define RNG_MAX_THREADS 64
+
+//Elements filled from one Philox block of four 32-bit words
+#define BLOCK_ELEMENTS 16
+
+// One thread's share of a fill, in whole blocks
+struct fill_range
+{
+	unsigned char* array;
+	size_t count;
+	size_t size;
+	int is_float;
+	size_t first_block;
+	size_t end_block;
+	uint32_t key[2];
+	uint64_t stream;
+};
+
+static inline void mulhilo(uint32_t a, uint32_t b, uint32_t* hi, uint32_t* lo)
+{
+	uint64_t product = (uint64_t) a * b;
+	*hi = product >> 32;
+	*lo = (uint32_t) product;
+}
+
+// Philox4x32-10 (Salmon et al., SC'11): ten rounds of a keyed bijection on
+// a 128-bit counter. Any block can be computed without the ones before it.
+static void philox4x32(const uint32_t key_in[2], const uint32_t counter[4], uint32_t out[4])
+{
+	uint32_t k0 = key_in[0], k1 = key_in[1];
+	uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+	int round;
+	for(round = 0; round < 10; round++)
+	{
+		uint32_t hi0, lo0, hi1, lo1;
+		mulhilo(0xD2511F53, c0, &hi0, &lo0);
+		mulhilo(0xCD9E8D57, c2, &hi1, &lo1);
+		c0 = hi1 ^ c1 ^ k0;
+		c1 = lo1;
+		c2 = hi0 ^ c3 ^ k1;
+		c3 = lo0;
+		k0 += 0x9E3779B9;
+		k1 += 0xBB67AE85;
+	}
+	out[0] = c0;
+	out[1] = c1;
+	out[2] = c2;
+	out[3] = c3;
+}
+
+static void* fill_blocks(void* argv)
+{
+	struct fill_range* r = argv;
+	size_t block;
+	for(block = r->first_block; block < r->end_block; block++)
+	{
+		uint32_t counter[4] = { (uint32_t) block, (uint32_t) ((uint64_t) block >> 32), (uint32_t) r->stream, (uint32_t) (r->stream >> 32) };
+		uint32_t words[4];
+		philox4x32(r->key, counter, words);
+
+		size_t first = block * BLOCK_ELEMENTS;
+		size_t n = r->count - first < BLOCK_ELEMENTS ? r->count - first : BLOCK_ELEMENTS;
+		size_t i;
+		for(i = 0; i < n; i++)
+		{
+			unsigned char byte = words[i / 4] >> (8 * (i % 4));
+			if(r->is_float && r->size == sizeof(float))
+				((float*) r->array)[first + i] = byte;
+			else if(r->is_float)
+				((double*) r->array)[first + i] = byte;
+			else switch(r->size)
+			{
+				case 1: r->array[first + i] = byte; break;
+				case 2: ((uint16_t*) r->array)[first + i] = byte; break;
+				case 4: ((uint32_t*) r->array)[first + i] = byte; break;
+				default: ((uint64_t*) r->array)[first + i] = byte; break;
+			}
+		}
+	}
+	return NULL;
+}
+
+// Give each of count elements of size bytes (1, 2, 4 or 8) one uniformly
+// random byte, zero-extended like rand() % 256, or converted to float or
+// double when is_float is set. Element i depends only on
+// seed, stream and i, so the array comes out the same on any number of cores
+// and different streams of one seed do not overlap.
+void fill_random_bytes(void* array, size_t count, size_t size, int is_float, unsigned long seed, unsigned long stream)
+{
+	pthread_t threads[RNG_MAX_THREADS];
+	struct fill_range ranges[RNG_MAX_THREADS];
+	size_t blocks = (count + BLOCK_ELEMENTS - 1) / BLOCK_ELEMENTS;
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int num_threads = cores > 0 ? cores : 1;
+	if(num_threads > RNG_MAX_THREADS)
+		num_threads = RNG_MAX_THREADS;
+	if(num_threads > blocks)
+		num_threads = blocks > 0 ? blocks : 1;
+
+	int t;
+	for(t = 0; t < num_threads; t++)
+	{
+		struct fill_range* r = &ranges[t];
+		r->array = array;
+		r->count = count;
+		r->size = size;
+		r->is_float = is_float;
+		r->first_block = blocks * t / num_threads;
+		r->end_block = blocks * (t + 1) / num_threads;
+		r->key[0] = (uint32_t) seed;
+		r->key[1] = (uint32_t) ((uint64_t) seed >> 32);
+		r->stream = stream;
+	}
+
+	//The calling thread fills the first range itself
+	int started = 1;
+	for(t = 1; t < num_threads; t++, started++)
+		if(pthread_create(&threads[t], NULL, fill_blocks, &ranges[t]) != 0)
+			break;
+	fill_blocks(&ranges[0]);
+	for(; t < num_threads; t++)
+		fill_blocks(&ranges[t]);
+	for(t = 1; t < started; t++)
+		pthread_join(threads[t], NULL);
+}
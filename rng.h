@@ -0,0 +1,11 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stddef.h>
+
+//Seed used unless SEED is set, so runs can be repeated
+#define DEFAULT_SEED 12345UL
+
+void fill_random_bytes(void* array, size_t count, size_t size, int is_float, unsigned long seed, unsigned long stream);
+
+#endif
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stream.h"
+
+static void map_file(struct stream_file* f, const char* path, int prot)
+{
+	f->data = mmap(NULL, f->size, prot, MAP_SHARED, f->fd, 0);
+	if(f->data == MAP_FAILED)
+	{
+		fprintf(stderr, "Error: could not map %s\n", path);
+		exit(1);
+	}
+	//Read ahead aggressively and let pages behind the reader go early
+	madvise(f->data, f->size, MADV_SEQUENTIAL);
+}
+
+// Map dir/name, which must hold exactly size bytes. A file that does not exist
+// yet is created with created set, for the caller to fill; an existing one
+// is used as it is, read-only if it cannot be written.
+void stream_open_input(struct stream_file* f, const char* dir, const char* name, size_t size)
+{
+	char path[1024];
+	int prot = PROT_READ | PROT_WRITE;
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f->size = size;
+	f->created = 0;
+	f->fd = open(path, O_RDWR);
+	if(f->fd < 0 && errno == ENOENT)
+	{
+		f->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+		f->created = 1;
+	}
+	else if(f->fd < 0 && (errno == EACCES || errno == EROFS))
+	{
+		f->fd = open(path, O_RDONLY);
+		prot = PROT_READ;
+	}
+	if(f->fd < 0)
+	{
+		fprintf(stderr, "Error: could not open %s\n", path);
+		exit(1);
+	}
+
+	struct stat st;
+	if(f->created && ftruncate(f->fd, size) != 0)
+	{
+		fprintf(stderr, "Error: could not size %s to %lu bytes\n", path, (unsigned long) size);
+		exit(1);
+	}
+	if(!f->created && (fstat(f->fd, &st) != 0 || st.st_size != size))
+	{
+		fprintf(stderr, "Error: %s is %lld bytes, expected %lu\n", path, (long long) st.st_size, (unsigned long) size);
+		exit(1);
+	}
+	map_file(f, path, prot);
+}
+
+// Create or truncate dir/name to size zero bytes and map it for writing
+void stream_open_output(struct stream_file* f, const char* dir, const char* name, size_t size)
+{
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f->size = size;
+	f->created = 1;
+	f->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(f->fd < 0 || ftruncate(f->fd, size) != 0)
+	{
+		fprintf(stderr, "Error: could not create %s\n", path);
+		exit(1);
+	}
+	map_file(f, path, PROT_READ | PROT_WRITE);
+}
+
+// Zero an output without touching its pages: the file is cut to nothing and
+// grown back sparse, which the mapping sees at once
+void stream_clear(struct stream_file* f)
+{
+	if(ftruncate(f->fd, 0) != 0 || ftruncate(f->fd, f->size) != 0)
+	{
+		fprintf(stderr, "Error: could not clear a stream file\n");
+		exit(1);
+	}
+}
+
+// Clip [offset, offset + len) to the file and widen its start to a page
+// boundary. Returns 0 if nothing is left.
+static int page_range(const struct stream_file* f, size_t* offset, size_t* len)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	if(page <= 0)
+		page = 4096;
+	if(*offset >= f->size)
+		return 0;
+	size_t end = *len < f->size - *offset ? *offset + *len : f->size;
+	*offset = *offset / page * page;
+	*len = end - *offset;
+	return *len > 0;
+}
+
+// Start reading bytes [offset, offset + len) in the background
+void stream_prefetch(struct stream_file* f, size_t offset, size_t len)
+{
+	if(page_range(f, &offset, &len))
+		madvise(f->data + offset, len, MADV_WILLNEED);
+}
+
+// Done with bytes [offset, offset + len) for now: unmap their pages and ask
+// the kernel to write them back and drop them from the page cache. Nothing is
+// lost; a later access, say to a page shared with a neighbouring chunk that
+// is still in flight, reads the file again.
+void stream_release(struct stream_file* f, size_t offset, size_t len)
+{
+	if(!page_range(f, &offset, &len))
+		return;
+	madvise(f->data + offset, len, MADV_DONTNEED);
+	posix_fadvise(f->fd, offset, len, POSIX_FADV_DONTNEED);
+}
+
+void stream_close(struct stream_file* f)
+{
+	munmap(f->data, f->size);
+	close(f->fd);
+	f->data = NULL;
+	f->fd = -1;
+}
@@ -0,0 +1,26 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+
+//Most bytes of each array a device's chunk buffers hold while streaming, so
+//the footprint stays fixed however long the arrays are
+#define STREAM_POOL_SIZE (256UL << 20)
+
+// An array kept in a file and mapped into memory instead of allocated
+struct stream_file
+{
+	int fd;
+	unsigned char* data;
+	size_t size;		//Bytes
+	int created;		//The file did not exist, so its contents are still to be filled
+};
+
+void stream_open_input(struct stream_file* f, const char* dir, const char* name, size_t size);
+void stream_open_output(struct stream_file* f, const char* dir, const char* name, size_t size);
+void stream_clear(struct stream_file* f);
+void stream_prefetch(struct stream_file* f, size_t offset, size_t len);
+void stream_release(struct stream_file* f, size_t offset, size_t len);
+void stream_close(struct stream_file* f);
+
+#endif
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "rng.h"
+#include "verify.h"
+#include "elem.h"
+#include "job.h"
+
+// Hands jobs to a running Balancer and checks what comes back. Prints one
+// line per job in the columns the benchmark hosts use, with "daemon" as the
+// scheme, so bench_suite style scripts can compare the two:
+//	iteration workload scheme gpu_share length setup_ms run_ms total_ms
+// where total is the round trip seen from here.
+//
+// usage: submit VectorAdd|VectorAdd+ length iterations
+
+#define TIMER_START clock_gettime(CLOCK_REALTIME, &timer1)
+#define TIMER_END clock_gettime(CLOCK_REALTIME, &timer2)
+#define MILLISECONDS (timer2.tv_sec - timer1.tv_sec) * 1000.0f + (timer2.tv_nsec - timer1.tv_nsec) / 1000000.0f
+struct timespec timer1;
+struct timespec timer2;
+
+int connect_daemon(const char* path)
+{
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0 || connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0)
+	{
+		fprintf(stderr, "Error: no daemon listening on %s\n", path);
+		exit(1);
+	}
+	return fd;
+}
+
+int main(int argc, char** argv)
+{
+	if(argc < 4)
+	{
+		fprintf(stderr, "usage: %s VectorAdd|VectorAdd+ length iterations\n", argv[0]);
+		return 1;
+	}
+	struct job_request job;
+	memset(&job, 0, sizeof(job));
+	if(!parse_job_kind(argv[1], &job.kind))
+	{
+		fprintf(stderr, "Error: unknown workload %s\n", argv[1]);
+		return 1;
+	}
+	job.length = strtoul(argv[2], NULL, 10);
+	int iterations = atoi(argv[3]);
+	if(job.length == 0)
+	{
+		fprintf(stderr, "Error: length must be positive\n");
+		return 1;
+	}
+
+	//ELEM_TYPE, CHUNK_SIZE, SEED and VERIFY mean what they do for the hosts
+	enum elem_type_t type = ELEM_FLOAT;
+	const char* name = getenv("ELEM_TYPE");
+	if(name && !parse_elem_type(name, &type))
+	{
+		fprintf(stderr, "Error: unknown element type %s\n", name);
+		return 1;
+	}
+	job.elem_type = type;
+	const char* chunk = getenv("CHUNK_SIZE");
+	if(chunk)
+		job.chunk = strtoul(chunk, NULL, 10);
+	unsigned long seed = DEFAULT_SEED;
+	const char* seed_env = getenv("SEED");
+	if(seed_env)
+		seed = strtoul(seed_env, NULL, 10);
+	enum verify_mode_t verify_mode = VERIFY_SAMPLE;
+	const char* verify = getenv("VERIFY");
+	if(verify && !parse_verify_mode(verify, &verify_mode))
+	{
+		fprintf(stderr, "Error: unknown verify mode %s\n", verify);
+		return 1;
+	}
+
+	//The arrays go to the daemon through a shared memory object of our own
+	size_t elem_size = elem_info(type)->size;
+	size_t bytes = elem_size * job.length;
+	snprintf(job.shm, sizeof(job.shm), "/balancer-%d", (int) getpid());
+	unsigned char* data = job_map(job.shm, 3 * bytes, 1);
+	if(data == NULL)
+	{
+		fprintf(stderr, "Error: could not create %s\n", job.shm);
+		return 1;
+	}
+	unsigned char* a = data;
+	unsigned char* b = data + bytes;
+	unsigned char* c = data + 2 * bytes;
+	fill_random_bytes(a, job.length, elem_size, elem_info(type)->is_float, seed, 0);
+	fill_random_bytes(b, job.length, elem_size, elem_info(type)->is_float, seed, 1);
+
+	unsigned char* check = malloc(bytes);
+	if(job.kind == JOB_VECTOR_ADD)
+		elem_vector_add(type, a, b, check, job.length);
+	else
+		elem_cpu_bound(type, a, b, check, job.length);
+	unsigned long check_sum = verify_checksum(check, job.length, elem_size, 0);
+
+	int fd = connect_daemon(job_socket_path());
+	int status = 0;
+	unsigned long uploaded = 0, downloaded = 0;
+	int i;
+	for(i = 0; i < iterations; i++)
+	{
+		struct job_reply reply;
+		memset(c, 0, bytes);
+		TIMER_START;
+		if(!job_send(fd, &job, sizeof(job)) || !job_recv(fd, &reply, sizeof(reply)))
+		{
+			fprintf(stderr, "Error: the daemon went away\n");
+			status = 1;
+			break;
+		}
+		TIMER_END;
+		if(reply.status != 0)
+		{
+			fprintf(stderr, "Error: the daemon refused the job: %s\n", reply.message);
+			status = 1;
+			break;
+		}
+		uploaded += reply.uploaded;
+		downloaded += reply.downloaded;
+
+		unsigned long mismatches = 0;
+		if(verify_mode == VERIFY_CHECKSUM)
+			mismatches = verify_checksum(c, job.length, elem_size, 0) != check_sum ? verify_compare(c, check, job.length, elem_size) : 0;
+		else if(verify_mode == VERIFY_SAMPLE)
+			mismatches = verify_sample(c, check, job.length, elem_size, seed + i);
+		else if(verify_mode == VERIFY_FULL)
+			mismatches = verify_compare(c, check, job.length, elem_size);
+		if(mismatches)
+		{
+			fprintf(stderr, "verify %s: FAILED (%lu mismatches) in iteration %d\n", verify_mode_name(verify_mode), mismatches, i);
+			status = 1;
+		}
+		printf("%d\t%s\tdaemon\t%f\t%lu\t%f\t%f\t%f\n", i, job_kind_name(job.kind), reply.gpu_share, job.length,
+			reply.setup_time, reply.run_time, MILLISECONDS);
+	}
+	fprintf(stderr, "daemon: %lu elements copied in and %lu out\n", uploaded, downloaded);
+
+	close(fd);
+	free(check);
+	job_unmap(data, 3 * bytes);
+	shm_unlink(job.shm);
+	return status;
+}
@@ -0,0 +1,749 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "taskgraph.h"
+#include "trace.h"
+
+#define CHKERR(err, str) \
+	if (err != CL_SUCCESS) \
+	{ \
+		fprintf(stdout, "CL Error %d: %s\n", err, str); \
+		exit(1); \
+	}
+
+static float elapsed(const struct timespec* start, const struct timespec* end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000.0f + (end->tv_nsec - start->tv_nsec) / 1000000.0f;
+}
+
+void taskgraph_init(struct task_graph* g, struct worker* workers, int num_workers, enum elem_type_t type)
+{
+	memset(g, 0, sizeof(*g));
+	g->workers = workers;
+	g->num_workers = num_workers;
+	g->type = type;
+	g->elem_size = elem_info(type)->size;
+	pthread_mutex_init(&g->mutex, NULL);
+	pthread_cond_init(&g->finished, NULL);
+}
+
+void taskgraph_destroy(struct task_graph* g)
+{
+	int i, d;
+	taskgraph_clear(g);
+	for(i = 0; i < g->num_arrays; i++)
+	{
+		for(d = 0; d < g->num_workers; d++)
+			if(g->arrays[i].buffers[d])
+				clReleaseMemObject(g->arrays[i].buffers[d]);
+		residency_destroy(&g->arrays[i].residency);
+	}
+	free(g->tasks);
+	pthread_mutex_destroy(&g->mutex);
+	pthread_cond_destroy(&g->finished);
+}
+
+// Add a kernel, given as one cl_kernel per worker, NULL for workers that
+// cannot run it. Returns its index.
+int taskgraph_kernel(struct task_graph* g, const char* name, const cl_kernel* kernels, task_native_t native)
+{
+	if(g->num_kernels == TASK_MAX_KERNELS)
+	{
+		fprintf(stderr, "Error: a task graph takes at most %d kernels\n", TASK_MAX_KERNELS);
+		exit(1);
+	}
+	struct task_kernel* k = &g->kernels[g->num_kernels];
+	memset(k, 0, sizeof(*k));
+	k->name = name;
+	k->native = native;
+	memcpy(k->kernels, kernels, sizeof(cl_kernel) * g->num_workers);
+	return g->num_kernels++;
+}
+
+// Add a host array of length elements and give every OpenCL worker a buffer
+// for it. Only the host copy is valid to begin with. Returns its index.
+int taskgraph_array(struct task_graph* g, unsigned char* host, size_t length)
+{
+	if(g->num_arrays == TASK_MAX_ARRAYS)
+	{
+		fprintf(stderr, "Error: a task graph takes at most %d arrays\n", TASK_MAX_ARRAYS);
+		exit(1);
+	}
+	memset(&g->arrays[g->num_arrays], 0, sizeof(g->arrays[0]));
+	int err = taskgraph_bind(g, g->num_arrays, host, length);
+	CHKERR(err, "Failed to create a task graph buffer!");
+	return g->num_arrays++;
+}
+
+// Point an array at another host array of length elements. The buffers are
+// kept unless they are too small, but every copy on them is out of date.
+// Returns the error of a buffer that could not be made, leaving the array
+// without buffers until it is bound again.
+cl_int taskgraph_bind(struct task_graph* g, int array, unsigned char* host, size_t length)
+{
+	struct task_array* a = &g->arrays[array];
+	int d;
+	cl_int err = CL_SUCCESS;
+	a->host = host;
+	a->length = length;
+	residency_destroy(&a->residency);
+	residency_init(&a->residency, length);
+	if(length <= a->capacity)
+		return CL_SUCCESS;
+	for(d = 0; d < g->num_workers; d++)
+	{
+		if(a->buffers[d])
+			clReleaseMemObject(a->buffers[d]);
+		a->buffers[d] = NULL;
+		if(!g->workers[d].native && err == CL_SUCCESS)
+			a->buffers[d] = clCreateBuffer(g->workers[d].context, CL_MEM_READ_WRITE, g->elem_size * length, NULL, &err);
+	}
+	if(err != CL_SUCCESS)
+	{
+		for(d = 0; d < g->num_workers; d++)
+			if(a->buffers[d])
+				clReleaseMemObject(a->buffers[d]);
+		memset(a->buffers, 0, sizeof(a->buffers));
+		a->capacity = 0;
+		return err;
+	}
+	a->capacity = length;
+	return CL_SUCCESS;
+}
+
+// Mark an array as an intermediate result. Its values stay on the workers
+// that need them and are forgotten once the graph is cleared.
+void taskgraph_scratch(struct task_graph* g, int array)
+{
+	g->arrays[array].scratch = 1;
+}
+
+// The host array was changed outside the graph, so every worker's copy of it
+// is out of date
+void taskgraph_invalidate(struct task_graph* g, int array)
+{
+	residency_reset(&g->arrays[array].residency);
+}
+
+// Append the task c[offset, offset + size) = kernel(a, b). taskgraph_schedule
+// makes it wait for the earlier tasks it conflicts with, so adding tasks in
+// program order is all it takes to build the graph. Returns its index.
+int taskgraph_task(struct task_graph* g, int kernel, int a, int b, int c, size_t offset, size_t size)
+{
+	if(g->num_tasks == g->max_tasks)
+	{
+		g->max_tasks = g->max_tasks ? g->max_tasks * 2 : 256;
+		g->tasks = realloc(g->tasks, sizeof(*g->tasks) * g->max_tasks);
+		if(g->tasks == NULL)
+		{
+			fprintf(stderr, "Error: out of memory for the task graph\n");
+			exit(1);
+		}
+	}
+	struct task* t = &g->tasks[g->num_tasks];
+	memset(t, 0, sizeof(*t));
+	t->kernel = kernel;
+	t->a = a;
+	t->b = b;
+	t->c = c;
+	t->offset = offset;
+	t->size = size;
+	t->device = -1;
+	t->dependent = -1;
+	return g->num_tasks++;
+}
+
+// Drop every task, keeping the kernels, arrays and their models. Every
+// array but the scratch ones has been copied back to the host by now, and
+// the copies the workers hold stay valid for the next graph.
+void taskgraph_clear(struct task_graph* g)
+{
+	int i, d;
+	for(i = 0; i < g->num_tasks; i++)
+	{
+		struct task* t = &g->tasks[i];
+		if(t->done)
+			clReleaseEvent(t->done);
+		if(t->launched)
+			clReleaseEvent(t->launched);
+		for(d = 0; d < t->num_transfers; d++)
+			clReleaseEvent(t->transfers[d]);
+		free(t->transfers);
+		for(d = 0; d < g->num_workers; d++)
+			if(t->bridges[d])
+				clReleaseEvent(t->bridges[d]);
+		free(t->copies);
+		free(t->deps);
+	}
+	g->num_tasks = 0;
+	g->uploaded = 0;
+	g->downloaded = 0;
+	g->data_time = 0;
+	g->exec_time = 0;
+
+	for(i = 0; i < g->num_arrays; i++)
+	{
+		struct residency* r = &g->arrays[i].residency;
+		if(g->arrays[i].scratch)
+			residency_reset(r);
+		for(d = 0; d < r->count; d++)
+		{
+			r->segments[d].writer = -1;
+			r->segments[d].num_readers = 0;
+		}
+		residency_merge(r);
+	}
+}
+
+// The command is traced on the worker's track, then let go of
+static void traced(int dev, cl_event event)
+{
+	trace_command(dev, event);
+	clReleaseEvent(event);
+}
+
+// Make next the last command of a task, tracing it on the worker's track
+static void chain(int dev, cl_event* last, cl_event next)
+{
+	trace_command(dev, next);
+	if(*last)
+		clReleaseEvent(*last);
+	*last = next;
+}
+
+// Copy elements [start, end) of an array from the host once the wait list
+// has completed
+static cl_event copy_in(struct task_graph* g, int array, size_t start, size_t end, int dev, cl_uint num_wait, const cl_event* wait)
+{
+	size_t origin = g->elem_size * start;
+	cl_event event;
+	int err = clEnqueueWriteBuffer(g->workers[dev].commands, g->arrays[array].buffers[dev], CL_FALSE, origin, g->elem_size * (end - start),
+		g->arrays[array].host + origin, num_wait, wait, &event);
+	CHKERR(err, "Failed to write a task buffer!");
+	return event;
+}
+
+// Copy elements [start, end) of an array back to the host
+static cl_event copy_out(struct task_graph* g, int array, size_t start, size_t end, int dev)
+{
+	size_t origin = g->elem_size * start;
+	cl_event event;
+	int err = clEnqueueReadBuffer(g->workers[dev].commands, g->arrays[array].buffers[dev], CL_FALSE, origin, g->elem_size * (end - start),
+		g->arrays[array].host + origin, 0, NULL, &event);
+	CHKERR(err, "Failed to read a task buffer!");
+	return event;
+}
+
+static cl_event launch(struct task_graph* g, const struct task* t, int dev, cl_uint num_wait, const cl_event* wait)
+{
+	cl_kernel kernel = g->kernels[t->kernel].kernels[dev];
+	size_t local_size;
+	clGetDeviceInfo(g->workers[dev].device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &local_size, NULL);
+	if(g->local_size > 0 && g->local_size < local_size)
+		local_size = g->local_size;
+
+	//The buffers span the whole arrays, so shift the work items to the task
+	size_t global_offset = t->offset;
+	size_t end = t->offset + t->size;
+	size_t global_size = (t->size + local_size - 1) / local_size * local_size;
+	int err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &g->arrays[t->a].buffers[dev]);
+	err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &g->arrays[t->b].buffers[dev]);
+	err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &g->arrays[t->c].buffers[dev]);
+	err |= clSetKernelArg(kernel, 3, sizeof(size_t), &end);
+	CHKERR(err, "Errors setting kernel arguments");
+
+	cl_event event;
+	err = clEnqueueNDRangeKernel(g->workers[dev].commands, kernel, 1, &global_offset, &global_size, &local_size, num_wait, wait, &event);
+	CHKERR(err, "Failed to run kernel!");
+	return event;
+}
+
+static void run_native(struct task_graph* g, const struct task* t)
+{
+	size_t origin = g->elem_size * t->offset;
+	g->kernels[t->kernel].native(g->arrays[t->a].host + origin, g->arrays[t->b].host + origin, g->arrays[t->c].host + origin, t->size, g->type);
+}
+
+// Run one task of size elements on its own, timing the transfers and the
+// kernel separately. The probe leaves the residency maps as they were.
+static void probe(struct task_graph* g, int kernel, int a, int b, int c, int dev, size_t size, float* data_time, float* exec_time)
+{
+	struct task t = { kernel, a, b, c, 0, size };
+	struct timespec start, end;
+
+	if(g->workers[dev].native)
+	{
+		clock_gettime(CLOCK_REALTIME, &start);
+		run_native(g, &t);
+		clock_gettime(CLOCK_REALTIME, &end);
+		*data_time = 0;
+		*exec_time = elapsed(&start, &end);
+		return;
+	}
+	cl_command_queue queue = g->workers[dev].commands;
+
+	clock_gettime(CLOCK_REALTIME, &start);
+	traced(dev, copy_in(g, a, 0, size, dev, 0, NULL));
+	traced(dev, copy_in(g, b, 0, size, dev, 0, NULL));
+	clFinish(queue);
+	clock_gettime(CLOCK_REALTIME, &end);
+	*data_time = elapsed(&start, &end);
+
+	clock_gettime(CLOCK_REALTIME, &start);
+	traced(dev, launch(g, &t, dev, 0, NULL));
+	clFinish(queue);
+	clock_gettime(CLOCK_REALTIME, &end);
+	*exec_time = elapsed(&start, &end);
+
+	clock_gettime(CLOCK_REALTIME, &start);
+	traced(dev, copy_out(g, c, 0, size, dev));
+	clFinish(queue);
+	clock_gettime(CLOCK_REALTIME, &end);
+	*data_time += elapsed(&start, &end);
+}
+
+// Fit each worker's transfer and kernel cost lines for kernel, the way
+// tune_device does, by running it from a and b into c at two sizes. Call it
+// before running any graph: the probes overwrite the start of c on the host
+// and the workers.
+void taskgraph_calibrate(struct task_graph* g, int kernel, int a, int b, int c, size_t small, size_t large)
+{
+	struct task_kernel* k = &g->kernels[kernel];
+	float data_small, exec_small, data_large, exec_large;
+	int d;
+	for(d = 0; d < g->num_workers; d++)
+	{
+		if(g->workers[d].native ? !k->native : !k->kernels[d])
+			continue;
+		//Throw away the first run so one-time driver costs are not counted as overhead
+		probe(g, kernel, a, b, c, d, large, &data_large, &exec_large);
+		probe(g, kernel, a, b, c, d, small, &data_small, &exec_small);
+		probe(g, kernel, a, b, c, d, large, &data_large, &exec_large);
+		fit_phase(&k->models[d].data, small, data_small, large, data_large);
+		fit_phase(&k->models[d].exec, small, exec_small, large, exec_large);
+	}
+}
+
+// Milliseconds to copy n elements of one array over a worker's link
+static float copy_time(const struct phase_fit* fit, size_t n)
+{
+	return fit->rate > 0 ? n / (TASK_ARRAYS * fit->rate) : 0;
+}
+
+// Where a worker reads and writes its arrays
+static int location(const struct task_graph* g, int dev)
+{
+	return g->workers[dev].native ? RESIDENCY_HOST : dev;
+}
+
+// Predicted milliseconds of copies before t could run on dev: the parts of
+// its inputs dev does not hold, plus copying dirty parts back from the
+// worker holding them first. Outputs that are not scratch are copied back
+// too, once the kernel is done.
+static float transfer_time(struct task_graph* g, const struct task* t, int dev)
+{
+	const struct task_kernel* k = &g->kernels[t->kernel];
+	int here = location(g, dev);
+	float time = 0;
+	int inputs[2] = { t->a, t->b };
+	int i, j, first;
+	for(i = 0; i < (t->a == t->b ? 1 : 2); i++)
+	{
+		struct residency* r = &g->arrays[inputs[i]].residency;
+		int n = residency_range(r, t->offset, t->offset + t->size, &first);
+		for(j = first; j < first + n; j++)
+		{
+			const struct residency_segment* s = &r->segments[j];
+			if(s->valid & (1u << here))
+				continue;
+			if(!(s->valid & (1u << RESIDENCY_HOST)))
+				time += copy_time(&k->models[g->tasks[s->writer].device].data, s->end - s->start);
+			if(here != RESIDENCY_HOST)
+				time += copy_time(&k->models[dev].data, s->end - s->start);
+		}
+	}
+	if(here != RESIDENCY_HOST && !g->arrays[t->c].scratch)
+		time += copy_time(&k->models[dev].data, t->size);
+	return time > 0 ? time + k->models[dev].data.overhead : 0;
+}
+
+// Have task index copy its output back to the host after its kernel. The
+// segments it wrote lie within its range, so they are found without cutting
+// any: place calls this while it walks the segments of the same array.
+static void write_back(struct task_graph* g, int index)
+{
+	struct task* t = &g->tasks[index];
+	struct residency* r = &g->arrays[t->c].residency;
+	int i;
+	if(t->writeback)
+		return;
+	t->writeback = 1;
+	g->downloaded += t->size;
+	for(i = residency_find(r, t->offset); i < r->count && r->segments[i].start < t->offset + t->size; i++)
+		if(r->segments[i].writer == index)
+			r->segments[i].valid |= 1u << RESIDENCY_HOST;
+}
+
+static void add_copy(struct task* t, int array, size_t start, size_t end)
+{
+	struct task_copy* last = t->num_copies ? &t->copies[t->num_copies - 1] : NULL;
+	if(last && last->array == array && last->end == start)
+	{
+		last->end = end;
+		return;
+	}
+	t->copies = realloc(t->copies, sizeof(*t->copies) * (t->num_copies + 1));
+	t->copies[t->num_copies++] = (struct task_copy) { array, start, end };
+}
+
+// Record the copies task index needs on the worker it was given, and where
+// the arrays it touches are valid once it has run
+static void place(struct task_graph* g, int index)
+{
+	struct task* t = &g->tasks[index];
+	int here = location(g, t->device);
+	int inputs[2] = { t->a, t->b };
+	int i, j, first;
+	for(i = 0; i < (t->a == t->b ? 1 : 2); i++)
+	{
+		struct residency* r = &g->arrays[inputs[i]].residency;
+		int n = residency_range(r, t->offset, t->offset + t->size, &first);
+		for(j = first; j < first + n; j++)
+		{
+			struct residency_segment* s = &r->segments[j];
+			residency_read(r, j, index);
+			if(s->valid & (1u << here))
+				continue;
+			//Only a device has it, so that device copies it back first
+			if(!(s->valid & (1u << RESIDENCY_HOST)))
+				write_back(g, s->writer);
+			if(here != RESIDENCY_HOST)
+			{
+				add_copy(t, inputs[i], s->start, s->end);
+				g->uploaded += s->end - s->start;
+			}
+			s->valid |= 1u << here;
+		}
+	}
+	residency_write(&g->arrays[t->c].residency, t->offset, t->offset + t->size, here, index);
+	if(here != RESIDENCY_HOST && !g->arrays[t->c].scratch)
+		write_back(g, index);
+}
+
+static void add_dep(struct task_graph* g, int index, int dep)
+{
+	struct task* t = &g->tasks[index];
+	if(dep < 0 || g->tasks[dep].dependent == index)
+		return;
+	g->tasks[dep].dependent = index;
+	if(t->num_deps == t->max_deps)
+	{
+		t->max_deps = t->max_deps ? t->max_deps * 2 : 8;
+		t->deps = realloc(t->deps, sizeof(*t->deps) * t->max_deps);
+		if(t->deps == NULL)
+		{
+			fprintf(stderr, "Error: out of memory for the task graph\n");
+			exit(1);
+		}
+	}
+	t->deps[t->num_deps++] = dep;
+}
+
+// Make task index wait for every earlier task that reads array over
+// [start, end), for ranges with more readers than the residency map keeps
+static void add_readers(struct task_graph* g, int index, int array, size_t start, size_t end)
+{
+	int i;
+	for(i = 0; i < index; i++)
+	{
+		const struct task* r = &g->tasks[i];
+		if((r->a == array || r->b == array) && r->offset < end && start < r->offset + r->size)
+			add_dep(g, index, i);
+	}
+}
+
+// Make task index wait for the last tasks to write what it reads, and for
+// the last to write or read what it writes. The residency maps remember
+// those per range, so only the ranges the task covers are looked at; the
+// tasks before them are ordered by the ones found.
+static void find_deps(struct task_graph* g, int index)
+{
+	struct task* t = &g->tasks[index];
+	int arrays[3] = { t->a, t->b, t->c };
+	int i, j, k, first;
+	//Scheduled before, so forget what was found then
+	for(i = 0; i < t->num_deps; i++)
+		g->tasks[t->deps[i]].dependent = -1;
+	t->num_deps = 0;
+	for(i = 0; i < 3; i++)
+	{
+		if(i == 1 && t->b == t->a)
+			continue;
+		struct residency* r = &g->arrays[arrays[i]].residency;
+		int n = residency_range(r, t->offset, t->offset + t->size, &first);
+		for(j = first; j < first + n; j++)
+		{
+			const struct residency_segment* s = &r->segments[j];
+			add_dep(g, index, s->writer);
+			if(i < 2 && arrays[i] != t->c)
+				continue;
+			if(s->num_readers > RESIDENCY_READERS)
+			{
+				add_readers(g, index, arrays[i], s->start, s->end);
+				continue;
+			}
+			for(k = 0; k < s->num_readers; k++)
+				add_dep(g, index, s->readers[k]);
+		}
+	}
+}
+
+// Give every task to the worker predicted to finish it first, counting the
+// time to copy over the inputs it does not already hold, the time until
+// that worker is free and the time until the tasks it depends on are done.
+// Workers that already hold a task's data are preferred that way, and data
+// is only copied where a task needs it. Returns the predicted milliseconds
+// until the last task is done.
+float taskgraph_schedule(struct task_graph* g)
+{
+	float free_at[MAX_WORKERS] = {0};
+	float makespan = 0;
+	int i, j, d;
+	for(i = 0; i < g->num_tasks; i++)
+	{
+		struct task* t = &g->tasks[i];
+		const struct task_kernel* k = &g->kernels[t->kernel];
+		float ready = 0;
+		find_deps(g, i);
+		for(j = 0; j < t->num_deps; j++)
+			if(g->tasks[t->deps[j]].finish > ready)
+				ready = g->tasks[t->deps[j]].finish;
+
+		t->device = -1;
+		for(d = 0; d < g->num_workers; d++)
+		{
+			if(g->workers[d].native ? !k->native : !k->kernels[d])
+				continue;
+			float start = free_at[d] > ready ? free_at[d] : ready;
+			float finish = start + transfer_time(g, t, d) + phase_time(&k->models[d].exec, t->size);
+			if(t->device < 0 || finish < t->finish)
+			{
+				t->device = d;
+				t->start = start;
+				t->finish = finish;
+			}
+		}
+		if(t->device < 0)
+		{
+			fprintf(stderr, "Error: no worker can run kernel %s\n", k->name);
+			exit(1);
+		}
+		place(g, i);
+		free_at[t->device] = t->finish;
+		if(t->finish > makespan)
+			makespan = t->finish;
+	}
+	return makespan;
+}
+
+static void CL_CALLBACK bridge_complete(cl_event event, cl_int status, void* user_data)
+{
+	cl_event bridge = user_data;
+	clSetUserEventStatus(bridge, status < 0 ? status : CL_COMPLETE);
+	clReleaseEvent(bridge);
+}
+
+// An event in dev's context that completes with dep, or NULL if dep is
+// already done. Events cannot cross contexts, so a dep on another worker
+// gets a user event that its completion sets.
+static cl_event bridge(struct task_graph* g, struct task* dep, int dev)
+{
+	cl_event event = NULL;
+	int err;
+	pthread_mutex_lock(&g->mutex);
+	if(!(g->workers[dep->device].native && dep->complete))
+	{
+		if(dep->bridges[dev] == NULL)
+		{
+			dep->bridges[dev] = clCreateUserEvent(g->workers[dev].context, &err);
+			CHKERR(err, "Failed to create a user event!");
+			if(!g->workers[dep->device].native)
+			{
+				clRetainEvent(dep->bridges[dev]);
+				err = clSetEventCallback(dep->done, CL_COMPLETE, bridge_complete, dep->bridges[dev]);
+				CHKERR(err, "Failed to set an event callback!");
+			}
+		}
+		event = dep->bridges[dev];
+	}
+	pthread_mutex_unlock(&g->mutex);
+	return event;
+}
+
+// Enqueue a task on its OpenCL worker. Dependencies on the same worker are
+// already ordered by its in-order queue; the rest are waited for on the
+// device, not the host. Returns the event of the task's last command.
+static cl_event enqueue_task(struct task_graph* g, struct task* t)
+{
+	int dev = t->device;
+	cl_event* wait = malloc(sizeof(cl_event) * (t->num_deps + 1));
+	cl_uint num_wait = 0;
+	int i;
+	for(i = 0; i < t->num_deps; i++)
+	{
+		struct task* dep = &g->tasks[t->deps[i]];
+		cl_event event = dep->device == dev ? NULL : bridge(g, dep, dev);
+		if(event)
+			wait[num_wait++] = event;
+	}
+	//The first command waits for the other workers, the rest follow it
+	cl_event done = NULL;
+	t->transfers = malloc(sizeof(cl_event) * (t->num_copies + 1));
+	for(i = 0; i < t->num_copies; i++, num_wait = 0)
+	{
+		t->transfers[t->num_transfers] = copy_in(g, t->copies[i].array, t->copies[i].start, t->copies[i].end, dev, num_wait, num_wait ? wait : NULL);
+		clRetainEvent(t->transfers[t->num_transfers]);
+		chain(dev, &done, t->transfers[t->num_transfers++]);
+	}
+	t->launched = launch(g, t, dev, num_wait, num_wait ? wait : NULL);
+	clRetainEvent(t->launched);
+	chain(dev, &done, t->launched);
+	if(t->writeback)
+	{
+		t->transfers[t->num_transfers] = copy_out(g, t->c, t->offset, t->offset + t->size, dev);
+		clRetainEvent(t->transfers[t->num_transfers]);
+		chain(dev, &done, t->transfers[t->num_transfers++]);
+	}
+	clFlush(g->workers[dev].commands);
+	free(wait);
+	return done;
+}
+
+struct native_args
+{
+	struct task_graph* g;
+	int dev;
+};
+
+// Run a native worker's tasks in order, waiting on the host for the ones
+// they depend on
+static void* native_runner(void* argv)
+{
+	struct native_args* args = argv;
+	struct task_graph* g = args->g;
+	int i, j, d;
+	for(i = 0; i < g->num_tasks; i++)
+	{
+		struct task* t = &g->tasks[i];
+		if(t->device != args->dev)
+			continue;
+		for(j = 0; j < t->num_deps; j++)
+		{
+			struct task* dep = &g->tasks[t->deps[j]];
+			if(dep->device == args->dev)
+				continue;
+			if(!g->workers[dep->device].native)
+			{
+				//OpenCL tasks are enqueued in order, so wait for this one's event to exist
+				pthread_mutex_lock(&g->mutex);
+				while(dep->done == NULL)
+					pthread_cond_wait(&g->finished, &g->mutex);
+				pthread_mutex_unlock(&g->mutex);
+				clWaitForEvents(1, &dep->done);
+				continue;
+			}
+			pthread_mutex_lock(&g->mutex);
+			while(!dep->complete)
+				pthread_cond_wait(&g->finished, &g->mutex);
+			pthread_mutex_unlock(&g->mutex);
+		}
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_REALTIME, &start);
+		run_native(g, t);
+		clock_gettime(CLOCK_REALTIME, &end);
+		trace_span(args->dev, g->kernels[t->kernel].name, &start, &end);
+
+		pthread_mutex_lock(&g->mutex);
+		t->exec_time = elapsed(&start, &end);
+		t->complete = 1;
+		for(d = 0; d < g->num_workers; d++)
+			if(t->bridges[d])
+				clSetUserEventStatus(t->bridges[d], CL_COMPLETE);
+		pthread_cond_broadcast(&g->finished);
+		pthread_mutex_unlock(&g->mutex);
+	}
+	return NULL;
+}
+
+// Milliseconds a finished command ran, or -1 if its queue does not profile
+static float command_time(cl_event event)
+{
+	cl_ulong start, end;
+	int err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+	err |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+	if(err != CL_SUCCESS || end < start)
+		return -1;
+	return (end - start) / 1000000.0f;
+}
+
+// Enqueue every task on the worker taskgraph_schedule gave it and wait for
+// them all. The host only waits once, at the end; native workers run their
+// tasks on threads of their own meanwhile. Then add up how long the kernels
+// ran in exec_time, from profiling times on OpenCL workers and host time on
+// native ones, and how long the copies ran in data_time.
+void taskgraph_run(struct task_graph* g)
+{
+	pthread_t threads[MAX_WORKERS];
+	struct native_args args[MAX_WORKERS];
+	int i, d;
+	for(d = 0; d < g->num_workers; d++)
+	{
+		if(!g->workers[d].native)
+			continue;
+		args[d].g = g;
+		args[d].dev = d;
+		pthread_create(&threads[d], NULL, native_runner, &args[d]);
+	}
+
+	for(i = 0; i < g->num_tasks; i++)
+	{
+		struct task* t = &g->tasks[i];
+		if(g->workers[t->device].native)
+			continue;
+		cl_event done = enqueue_task(g, t);
+		//Native runners may be waiting for this task's event to exist
+		pthread_mutex_lock(&g->mutex);
+		t->done = done;
+		pthread_cond_broadcast(&g->finished);
+		pthread_mutex_unlock(&g->mutex);
+	}
+
+	for(d = 0; d < g->num_workers; d++)
+	{
+		if(g->workers[d].native)
+			pthread_join(threads[d], NULL);
+		else
+			clFinish(g->workers[d].commands);
+	}
+
+	g->data_time = 0;
+	g->exec_time = 0;
+	for(i = 0; i < g->num_tasks; i++)
+	{
+		struct task* t = &g->tasks[i];
+		if(t->launched)
+			t->exec_time = command_time(t->launched);
+		if(t->exec_time < 0)
+			g->exec_time = NAN;
+		g->exec_time += t->exec_time;
+		for(d = 0; d < t->num_transfers; d++)
+		{
+			float time = command_time(t->transfers[d]);
+			g->data_time += time < 0 ? NAN : time;
+		}
+	}
+}
@@ -0,0 +1,127 @@
+#ifndef TASKGRAPH_H
+#define TASKGRAPH_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/opencl.h>
+#endif
+
+#include "devices.h"
+#include "model.h"
+#include "elem.h"
+#include "residency.h"
+
+//Most kernels and arrays one graph can use
+#define TASK_MAX_KERNELS 8
+#define TASK_MAX_ARRAYS 8
+
+//Arrays taskgraph_calibrate moves per element: both inputs in, the output back
+#define TASK_ARRAYS 3
+
+// Host version of a kernel for native workers, with the same arguments as
+// native_vector_add
+typedef void (*task_native_t)(const void* a, const void* b, void* c, size_t length, enum elem_type_t type);
+
+// An element-wise kernel c = f(a, b) with the (a, b, c, end) arguments of
+// VectorAdd.cl, built for every OpenCL worker
+struct task_kernel
+{
+	const char* name;
+	cl_kernel kernels[MAX_WORKERS];		//NULL on native workers
+	task_native_t native;
+	struct device_model models[MAX_WORKERS];	//Measured by taskgraph_calibrate
+};
+
+// A host array with a buffer of the same length on every OpenCL worker.
+// Locations in its residency map are worker indices, with native workers
+// using the host copy.
+struct task_array
+{
+	unsigned char* host;
+	size_t length;
+	size_t capacity;	//Elements the buffers hold, at least length
+	cl_mem buffers[MAX_WORKERS];
+	struct residency residency;
+	int scratch;		//Only read within the graph, so never copied back to the host
+};
+
+// Elements [start, end) of an array a task copies from the host first
+struct task_copy
+{
+	int array;
+	size_t start;
+	size_t end;
+};
+
+// One chunk of one kernel: c[offset, offset + size) = f(a, b) over the same
+// range of the three arrays
+struct task
+{
+	int kernel;
+	int a, b, c;
+	size_t offset;
+	size_t size;
+	int* deps;		//Earlier tasks it waits for, found by taskgraph_schedule
+	int num_deps;
+	int max_deps;
+	int dependent;		//Last task found to wait for it, so find_deps adds it once
+	int device;		//Worker picked by taskgraph_schedule
+	float start;		//Predicted, in milliseconds from the start of the run
+	float finish;
+	struct task_copy* copies;	//Ranges of a and b its worker does not hold yet
+	int num_copies;
+	int writeback;		//Copy c back to the host, for the host or another worker to read
+	cl_event done;		//Last command of the task; NULL on native workers
+	cl_event bridges[MAX_WORKERS];	//User events other workers' contexts wait on instead of done
+	cl_event launched;	//Its kernel's command, kept for its profiling times
+	cl_event* transfers;	//and its copies' commands
+	int num_transfers;
+	float exec_time;	//Milliseconds its kernel ran, once the graph has run
+	int complete;		//Native tasks only, guarded by the graph's mutex
+};
+
+// Tasks over a set of arrays, in an order that is always a valid order to
+// run them in. Each task goes to the worker predicted to finish it first, and
+// every worker's queue waits on the tasks it depends on through events, so
+// nothing waits on the host until the whole graph is done. Data stays on the
+// workers between tasks and graphs, and is only copied where it is needed.
+struct task_graph
+{
+	struct worker* workers;
+	int num_workers;
+	enum elem_type_t type;
+	size_t elem_size;
+	size_t local_size;	//Work group size, 0 for the largest each device allows
+	struct task_kernel kernels[TASK_MAX_KERNELS];
+	int num_kernels;
+	struct task_array arrays[TASK_MAX_ARRAYS];
+	int num_arrays;
+	struct task* tasks;
+	int num_tasks;
+	int max_tasks;
+	size_t uploaded;	//Elements the scheduled tasks copy to devices
+	size_t downloaded;	//and back to the host
+	float data_time;	//Milliseconds the tasks' copies ran, summed over workers; NAN if not profiled
+	float exec_time;	//Milliseconds the tasks' kernels ran, likewise
+	pthread_mutex_t mutex;
+	pthread_cond_t finished;	//A native task completed
+};
+
+void taskgraph_init(struct task_graph* g, struct worker* workers, int num_workers, enum elem_type_t type);
+void taskgraph_destroy(struct task_graph* g);
+int taskgraph_kernel(struct task_graph* g, const char* name, const cl_kernel* kernels, task_native_t native);
+int taskgraph_array(struct task_graph* g, unsigned char* host, size_t length);
+cl_int taskgraph_bind(struct task_graph* g, int array, unsigned char* host, size_t length);
+void taskgraph_scratch(struct task_graph* g, int array);
+void taskgraph_invalidate(struct task_graph* g, int array);
+int taskgraph_task(struct task_graph* g, int kernel, int a, int b, int c, size_t offset, size_t size);
+void taskgraph_clear(struct task_graph* g);
+void taskgraph_calibrate(struct task_graph* g, int kernel, int a, int b, int c, size_t small, size_t large);
+float taskgraph_schedule(struct task_graph* g);
+void taskgraph_run(struct task_graph* g);
+
+#endif
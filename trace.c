@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+//Tracks of each kind the timeline can name and align
+#define TRACE_MAX_TRACKS 64
+
+// A command that was enqueued but may not have finished yet
+struct pending_command
+{
+	cl_event event;
+	int track;
+	double host;		//Microseconds, when the host chained the command
+};
+
+// One finished command, in device clock nanoseconds
+struct command_record
+{
+	int track;
+	cl_command_type type;
+	cl_ulong queued;
+	cl_ulong submit;
+	cl_ulong start;
+	cl_ulong end;
+	double host;
+};
+
+// One phase of a host thread, in microseconds since trace_open
+struct span_record
+{
+	int track;
+	const char* name;
+	double start;
+	double end;
+};
+
+static struct
+{
+	FILE* file;
+	struct timespec origin;
+	pthread_mutex_t mutex;
+	struct pending_command* pending;
+	int num_pending, max_pending;
+	struct command_record* commands;
+	int num_commands, max_commands;
+	struct span_record* spans;
+	int num_spans, max_spans;
+	char device_names[TRACE_MAX_TRACKS][64];
+	char host_names[TRACE_MAX_TRACKS + 1][64];
+} trace;
+
+static double since_origin(const struct timespec* t)
+{
+	return (t->tv_sec - trace.origin.tv_sec) * 1000000.0 + (t->tv_nsec - trace.origin.tv_nsec) / 1000.0;
+}
+
+// Make room for one more element of size bytes in a growing array
+static void* grow(void* array, int count, int* max, size_t size)
+{
+	if(count < *max)
+		return array;
+	*max = *max ? *max * 2 : 1024;
+	array = realloc(array, size * *max);
+	if(array == NULL)
+	{
+		fprintf(stderr, "Error: out of memory for the trace\n");
+		exit(1);
+	}
+	return array;
+}
+
+// Start recording a timeline to be written to path by trace_close. With a
+// NULL path nothing is recorded and every other call returns at once.
+void trace_open(const char* path)
+{
+	if(path == NULL)
+		return;
+	trace.file = fopen(path, "w");
+	if(trace.file == NULL)
+	{
+		fprintf(stderr, "Warning: could not open trace file %s, not tracing\n", path);
+		return;
+	}
+	pthread_mutex_init(&trace.mutex, NULL);
+	clock_gettime(CLOCK_REALTIME, &trace.origin);
+}
+
+int trace_enabled()
+{
+	return trace.file != NULL;
+}
+
+// Label a track in the timeline
+void trace_track(enum trace_kind_t kind, int track, const char* name)
+{
+	if(!trace_enabled())
+		return;
+	if(kind == TRACE_DEVICE && track >= 0 && track < TRACE_MAX_TRACKS)
+		snprintf(trace.device_names[track], sizeof(trace.device_names[track]), "%s", name);
+	else if(kind == TRACE_HOST && track >= TRACE_MAIN && track < TRACE_MAX_TRACKS)
+		snprintf(trace.host_names[track + 1], sizeof(trace.host_names[track + 1]), "%s", name);
+}
+
+// Remember a command on a device track. Its profiling info is read by
+// trace_collect, once the command has completed. The queue must have been
+// created with CL_QUEUE_PROFILING_ENABLE.
+void trace_command(int track, cl_event event)
+{
+	if(!trace_enabled() || track < 0 || track >= TRACE_MAX_TRACKS)
+		return;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	clRetainEvent(event);
+
+	pthread_mutex_lock(&trace.mutex);
+	trace.pending = grow(trace.pending, trace.num_pending, &trace.max_pending, sizeof(*trace.pending));
+	struct pending_command* p = &trace.pending[trace.num_pending++];
+	p->event = event;
+	p->track = track;
+	p->host = since_origin(&now);
+	pthread_mutex_unlock(&trace.mutex);
+}
+
+// Record a phase of a host thread, timed with CLOCK_REALTIME
+void trace_span(int track, const char* name, const struct timespec* start, const struct timespec* end)
+{
+	if(!trace_enabled() || track < TRACE_MAIN || track >= TRACE_MAX_TRACKS)
+		return;
+	pthread_mutex_lock(&trace.mutex);
+	trace.spans = grow(trace.spans, trace.num_spans, &trace.max_spans, sizeof(*trace.spans));
+	struct span_record* s = &trace.spans[trace.num_spans++];
+	s->track = track;
+	s->name = name;
+	s->start = since_origin(start);
+	s->end = since_origin(end);
+	pthread_mutex_unlock(&trace.mutex);
+}
+
+// Read the timestamps of every command traced so far and let the events go.
+// Call it once every traced command has completed, e.g. after each run.
+void trace_collect()
+{
+	if(!trace_enabled())
+		return;
+	int i;
+	pthread_mutex_lock(&trace.mutex);
+	for(i = 0; i < trace.num_pending; i++)
+	{
+		struct pending_command* p = &trace.pending[i];
+		struct command_record r;
+		r.track = p->track;
+		r.host = p->host;
+		int err = clGetEventInfo(p->event, CL_EVENT_COMMAND_TYPE, sizeof(r.type), &r.type, NULL);
+		err |= clGetEventProfilingInfo(p->event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &r.queued, NULL);
+		err |= clGetEventProfilingInfo(p->event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &r.submit, NULL);
+		err |= clGetEventProfilingInfo(p->event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &r.start, NULL);
+		err |= clGetEventProfilingInfo(p->event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &r.end, NULL);
+		clReleaseEvent(p->event);
+		if(err != CL_SUCCESS)
+			continue;
+		trace.commands = grow(trace.commands, trace.num_commands, &trace.max_commands, sizeof(*trace.commands));
+		trace.commands[trace.num_commands++] = r;
+	}
+	trace.num_pending = 0;
+	pthread_mutex_unlock(&trace.mutex);
+}
+
+static const char* command_name(cl_command_type type)
+{
+	switch(type)
+	{
+		case CL_COMMAND_WRITE_BUFFER: return "write";
+		case CL_COMMAND_READ_BUFFER: return "read";
+		case CL_COMMAND_NDRANGE_KERNEL: return "kernel";
+		case CL_COMMAND_MAP_BUFFER: return "map";
+		case CL_COMMAND_UNMAP_MEM_OBJECT: return "unmap";
+		default: return "command";
+	}
+}
+
+static void write_string(FILE* f, const char* s)
+{
+	fputc('"', f);
+	for(; *s; s++)
+	{
+		if(*s == '"' || *s == '\\')
+			fputc('\\', f);
+		if((unsigned char) *s >= ' ')
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static void write_name(FILE* f, int* first, int pid, int tid, const char* kind, const char* name)
+{
+	fprintf(f, "%s\n{\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"name\":\"%s\",\"args\":{\"name\":", *first ? "" : ",", pid, tid, kind);
+	write_string(f, name);
+	fprintf(f, "}}");
+	*first = 0;
+}
+
+// Write everything recorded as a Chrome trace (chrome://tracing, Perfetto):
+// process 1 holds one track per device, process 2 one per host thread.
+void trace_close()
+{
+	if(!trace_enabled())
+		return;
+	trace_collect();
+
+	//Device clocks have their own epoch. A command is queued just before the
+	//host chains it, so the smallest gap between the two lines them up.
+	double offsets[TRACE_MAX_TRACKS];
+	int have_offset[TRACE_MAX_TRACKS] = {0};
+	int i;
+	for(i = 0; i < trace.num_commands; i++)
+	{
+		struct command_record* r = &trace.commands[i];
+		double offset = r->host - r->queued / 1000.0;
+		if(!have_offset[r->track] || offset < offsets[r->track])
+			offsets[r->track] = offset;
+		have_offset[r->track] = 1;
+	}
+
+	FILE* f = trace.file;
+	int first = 1;
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	write_name(f, &first, 1, 0, "process_name", "devices");
+	write_name(f, &first, 2, 0, "process_name", "host");
+	for(i = 0; i < TRACE_MAX_TRACKS; i++)
+		if(trace.device_names[i][0])
+			write_name(f, &first, 1, i, "thread_name", trace.device_names[i]);
+	for(i = 0; i <= TRACE_MAX_TRACKS; i++)
+		if(trace.host_names[i][0])
+			write_name(f, &first, 2, i, "thread_name", trace.host_names[i]);
+
+	for(i = 0; i < trace.num_commands; i++)
+	{
+		struct command_record* r = &trace.commands[i];
+		double offset = offsets[r->track];
+		fprintf(f, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"name\":\"%s\",\"ts\":%.3f,\"dur\":%.3f,"
+			"\"args\":{\"queued\":%.3f,\"submit\":%.3f,\"queue_delay_us\":%.3f}}",
+			r->track, command_name(r->type), r->start / 1000.0 + offset, (r->end - r->start) / 1000.0,
+			r->queued / 1000.0 + offset, r->submit / 1000.0 + offset, (r->start - r->queued) / 1000.0);
+	}
+	for(i = 0; i < trace.num_spans; i++)
+	{
+		struct span_record* s = &trace.spans[i];
+		fprintf(f, ",\n{\"ph\":\"X\",\"pid\":2,\"tid\":%d,\"name\":\"%s\",\"ts\":%.3f,\"dur\":%.3f}",
+			s->track + 1, s->name, s->start, s->end - s->start);
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	trace.file = NULL;
+
+	free(trace.pending);
+	free(trace.commands);
+	free(trace.spans);
+	trace.pending = NULL;
+	trace.commands = NULL;
+	trace.spans = NULL;
+	trace.num_pending = trace.max_pending = 0;
+	trace.num_commands = trace.max_commands = 0;
+	trace.num_spans = trace.max_spans = 0;
+}
@@ -0,0 +1,25 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <time.h>
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/opencl.h>
+#endif
+
+//Host track of the main thread; scheduler threads use their worker's index
+#define TRACE_MAIN -1
+
+enum trace_kind_t { TRACE_DEVICE, TRACE_HOST };
+
+void trace_open(const char* path);
+int trace_enabled();
+void trace_track(enum trace_kind_t kind, int track, const char* name);
+void trace_command(int track, cl_event event);
+void trace_span(int track, const char* name, const struct timespec* start, const struct timespec* end);
+void trace_collect();
+void trace_close();
+
+#endif
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "verify.h"
+
+//Most threads one check starts
+#define VERIFY_MAX_THREADS 64
+
+//Smallest range worth splitting across threads, in bytes
+#define VERIFY_MIN_SPLIT (1 << 20)
+
+// One thread's share of a compare or checksum
+struct verify_range
+{
+	const unsigned char* result;
+	const unsigned char* expected;
+	size_t size;
+	size_t start;		//Elements
+	size_t end;
+	size_t first;		//Index of element 0 in the whole array, for checksums
+	unsigned long mismatches;
+	size_t first_mismatch;
+	unsigned long checksum;
+};
+
+// Element i of an array of size-byte elements, zero-extended
+static inline unsigned long element(const unsigned char* array, size_t size, size_t i)
+{
+	switch(size)
+	{
+		case 1: return array[i];
+		case 2: return ((const uint16_t*) array)[i];
+		case 4: return ((const uint32_t*) array)[i];
+		default: return ((const uint64_t*) array)[i];
+	}
+}
+
+// Split [0, count) across the cores and run work on every part
+static void run_split(void* (*work)(void*), struct verify_range* ranges, int* num_ranges, const struct verify_range* proto, size_t count)
+{
+	pthread_t threads[VERIFY_MAX_THREADS];
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int num_threads = cores > 0 ? cores : 1;
+	if(num_threads > VERIFY_MAX_THREADS)
+		num_threads = VERIFY_MAX_THREADS;
+	if(count * proto->size < (size_t) num_threads * VERIFY_MIN_SPLIT)
+		num_threads = count * proto->size / VERIFY_MIN_SPLIT + 1;
+
+	int t;
+	for(t = 0; t < num_threads; t++)
+	{
+		ranges[t] = *proto;
+		ranges[t].start = count * t / num_threads;
+		ranges[t].end = count * (t + 1) / num_threads;
+	}
+
+	//The calling thread takes the first part itself
+	int started = 1;
+	for(t = 1; t < num_threads; t++, started++)
+		if(pthread_create(&threads[t], NULL, work, &ranges[t]) != 0)
+			break;
+	work(&ranges[0]);
+	for(; t < num_threads; t++)
+		work(&ranges[t]);
+	for(t = 1; t < started; t++)
+		pthread_join(threads[t], NULL);
+	*num_ranges = num_threads;
+}
+
+static void* compare_range(void* argv)
+{
+	struct verify_range* r = argv;
+	size_t size = r->size;
+	r->mismatches = 0;
+	//memcmp is vectorised; only walk the elements of a range that differs
+	if(memcmp(r->result + r->start * size, r->expected + r->start * size, (r->end - r->start) * size) == 0)
+		return NULL;
+	size_t i;
+	for(i = r->start; i < r->end; i++)
+	{
+		if(memcmp(r->result + i * size, r->expected + i * size, size) == 0)
+			continue;
+		if(r->mismatches++ == 0)
+			r->first_mismatch = i;
+	}
+	return NULL;
+}
+
+// Element i of result and expected differ; first is the index of element 0
+// in the whole output
+static void report(const unsigned char* result, const unsigned char* expected, size_t size, size_t i, size_t first)
+{
+	fprintf(stderr, "Answers differ at position %lu (%lu, %lu)\n", (unsigned long) (first + i), element(result, size, i), element(expected, size, i));
+}
+
+static void report_rest(unsigned long mismatches, int reported)
+{
+	if(mismatches > reported)
+		fprintf(stderr, "... and %lu more mismatches\n", mismatches - reported);
+}
+
+// Compare count elements on all cores, reporting mismatches until reported
+// reaches VERIFY_MAX_REPORTS
+static unsigned long compare_split(const void* result, const void* expected, size_t count, size_t size, size_t first, int* reported)
+{
+	struct verify_range ranges[VERIFY_MAX_THREADS];
+	struct verify_range proto = { result, expected, size };
+	int num_ranges, t;
+	run_split(compare_range, ranges, &num_ranges, &proto, count);
+
+	unsigned long mismatches = 0;
+	for(t = 0; t < num_ranges; t++)
+	{
+		struct verify_range* r = &ranges[t];
+		mismatches += r->mismatches;
+		size_t i;
+		for(i = r->first_mismatch; r->mismatches > 0 && i < r->end && *reported < VERIFY_MAX_REPORTS; i++)
+		{
+			if(memcmp(proto.result + i * size, proto.expected + i * size, size) == 0)
+				continue;
+			report(proto.result, proto.expected, size, i, first);
+			(*reported)++;
+		}
+	}
+	return mismatches;
+}
+
+// Compare every element on all cores. Prints the first VERIFY_MAX_REPORTS
+// mismatches and returns how many there were.
+unsigned long verify_compare(const void* result, const void* expected, size_t count, size_t size)
+{
+	int reported = 0;
+	unsigned long mismatches = compare_split(result, expected, count, size, 0, &reported);
+	report_rest(mismatches, reported);
+	return mismatches;
+}
+
+static unsigned long splitmix64(unsigned long x)
+{
+	x += 0x9E3779B97F4A7C15UL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9UL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBUL;
+	return x ^ (x >> 31);
+}
+
+// Compare VERIFY_SAMPLES elements at positions drawn from seed, plus the
+// first and last, and return how many differ
+unsigned long verify_sample(const void* result, const void* expected, size_t count, size_t size, unsigned long seed)
+{
+	const unsigned char* r = result;
+	const unsigned char* e = expected;
+	unsigned long mismatches = 0;
+	int k;
+	if(count == 0)
+		return 0;
+	for(k = 0; k < VERIFY_SAMPLES + 2; k++)
+	{
+		size_t i = k == 0 ? 0 : k == 1 ? count - 1 : splitmix64(seed + k) % count;
+		if(memcmp(r + i * size, e + i * size, size) == 0)
+			continue;
+		if(mismatches++ < VERIFY_MAX_REPORTS)
+			report(r, e, size, i, 0);
+	}
+	return mismatches;
+}
+
+#define CHECKSUM_LOOP(type) \
+	for(i = r->start; i < r->end; i++) \
+		sum += (((const type*) r->result)[i] + 1UL) * (((r->first + i) * 0x9E3779B97F4A7C15UL) | 1)
+
+static void* checksum_range(void* argv)
+{
+	struct verify_range* r = argv;
+	unsigned long sum = 0;
+	size_t i;
+	//One loop per element size so each one vectorises
+	switch(r->size)
+	{
+		case 1: CHECKSUM_LOOP(uint8_t); break;
+		case 2: CHECKSUM_LOOP(uint16_t); break;
+		case 4: CHECKSUM_LOOP(uint32_t); break;
+		default: CHECKSUM_LOOP(uint64_t); break;
+	}
+	r->checksum = sum;
+	return NULL;
+}
+
+// Position-weighted checksum of array[0, count), whose first element sits at
+// index first of the whole output. Every element adds (value + 1) times an odd
+// weight of its index, so checksums of disjoint chunks add up to the checksum
+// of the whole array in any order, and one wrong element always changes it.
+unsigned long verify_checksum(const void* array, size_t count, size_t size, size_t first)
+{
+	struct verify_range ranges[VERIFY_MAX_THREADS];
+	struct verify_range proto = { array, NULL, size };
+	proto.first = first;
+	int num_ranges, t;
+	run_split(checksum_range, ranges, &num_ranges, &proto, count);
+
+	unsigned long sum = 0;
+	for(t = 0; t < num_ranges; t++)
+		sum += ranges[t].checksum;
+	return sum;
+}
+
+static void* reference_block(size_t size)
+{
+	void* block = malloc(VERIFY_BLOCK * size);
+	if(block == NULL)
+	{
+		fprintf(stderr, "Error: out of memory for a reference block\n");
+		exit(1);
+	}
+	return block;
+}
+
+// The checks below stand in for the ones above when the expected output is
+// too large to keep, making it VERIFY_BLOCK elements at a time instead
+
+unsigned long verify_compare_reference(const void* result, verify_reference_t reference, size_t count, size_t size)
+{
+	unsigned char* expected = reference_block(size);
+	unsigned long mismatches = 0;
+	int reported = 0;
+	size_t first;
+	for(first = 0; first < count; first += VERIFY_BLOCK)
+	{
+		size_t n = count - first < VERIFY_BLOCK ? count - first : VERIFY_BLOCK;
+		reference(first, n, expected);
+		mismatches += compare_split((const unsigned char*) result + first * size, expected, n, size, first, &reported);
+	}
+	free(expected);
+	report_rest(mismatches, reported);
+	return mismatches;
+}
+
+// Same positions as verify_sample, making one expected element at a time
+unsigned long verify_sample_reference(const void* result, verify_reference_t reference, size_t count, size_t size, unsigned long seed)
+{
+	const unsigned char* r = result;
+	unsigned char expected[sizeof(unsigned long)];
+	unsigned long mismatches = 0;
+	int k;
+	if(count == 0)
+		return 0;
+	for(k = 0; k < VERIFY_SAMPLES + 2; k++)
+	{
+		size_t i = k == 0 ? 0 : k == 1 ? count - 1 : splitmix64(seed + k) % count;
+		reference(i, 1, expected);
+		if(memcmp(r + i * size, expected, size) == 0)
+			continue;
+		if(mismatches++ < VERIFY_MAX_REPORTS)
+			report(r + i * size, expected, size, 0, i);
+	}
+	return mismatches;
+}
+
+unsigned long verify_checksum_reference(verify_reference_t reference, size_t count, size_t size)
+{
+	unsigned char* expected = reference_block(size);
+	unsigned long sum = 0;
+	size_t first;
+	for(first = 0; first < count; first += VERIFY_BLOCK)
+	{
+		size_t n = count - first < VERIFY_BLOCK ? count - first : VERIFY_BLOCK;
+		reference(first, n, expected);
+		sum += verify_checksum(expected, n, size, first);
+	}
+	free(expected);
+	return sum;
+}
+
+int parse_verify_mode(const char* name, enum verify_mode_t* mode)
+{
+	if(strcmp(name, "none") == 0)
+		*mode = VERIFY_NONE;
+	else if(strcmp(name, "full") == 0)
+		*mode = VERIFY_FULL;
+	else if(strcmp(name, "sample") == 0)
+		*mode = VERIFY_SAMPLE;
+	else if(strcmp(name, "checksum") == 0)
+		*mode = VERIFY_CHECKSUM;
+	else
+		return 0;
+	return 1;
+}
+
+const char* verify_mode_name(enum verify_mode_t mode)
+{
+	switch(mode)
+	{
+		case VERIFY_NONE: return "none";
+		case VERIFY_FULL: return "full";
+		case VERIFY_SAMPLE: return "sample";
+		case VERIFY_CHECKSUM: return "checksum";
+	}
+	return "unknown";
+}
@@ -0,0 +1,30 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stddef.h>
+
+enum verify_mode_t { VERIFY_NONE, VERIFY_FULL, VERIFY_SAMPLE, VERIFY_CHECKSUM };
+
+//Elements compared by VERIFY_SAMPLE
+#define VERIFY_SAMPLES 65536
+
+//Mismatches printed before the rest are only counted
+#define VERIFY_MAX_REPORTS 10
+
+//Elements of expected output made at a time when there is no full copy of it
+#define VERIFY_BLOCK (1 << 20)
+
+// Writes the expected output of elements [first, first + count) to out
+typedef void (*verify_reference_t)(size_t first, size_t count, void* out);
+
+unsigned long verify_compare(const void* result, const void* expected, size_t count, size_t size);
+unsigned long verify_sample(const void* result, const void* expected, size_t count, size_t size, unsigned long seed);
+unsigned long verify_checksum(const void* array, size_t count, size_t size, size_t first);
+unsigned long verify_compare_reference(const void* result, verify_reference_t reference, size_t count, size_t size);
+unsigned long verify_sample_reference(const void* result, verify_reference_t reference, size_t count, size_t size, unsigned long seed);
+unsigned long verify_checksum_reference(verify_reference_t reference, size_t count, size_t size);
+
+int parse_verify_mode(const char* name, enum verify_mode_t* mode);
+const char* verify_mode_name(enum verify_mode_t mode);
+
+#endif